@@ -42,6 +42,22 @@ CCpuID::CCpuID()
 
     t = CPUInfo[2];
     mflags |= ((t & 0x00000001) != 0) ? sse3 : 0;			// SSE3
+    mflags |= ((t & 0x00000200) != 0) ? ssse3 : 0;			// SSSE3
+
+    // AVX2 needs the OS to save the ymm state (OSXSAVE + XCR0 bits 1 and 2)
+    if((t & 0x18000000) == 0x18000000 && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuid(CPUInfo, 0);
+        if(CPUInfo[0] >= 7)
+        {
+            __cpuidex(CPUInfo, 7, 0);
+            mflags |= ((CPUInfo[1] & 0x00000020) != 0) ? avx2 : 0;	// AVX2
+
+            // AVX-512F and BW, with the opmask and zmm state saved too (XCR0 bits 5 - 7)
+            if((CPUInfo[1] & 0x40010000) == 0x40010000 && (_xgetbv(0) & 0xe6) == 0xe6)
+                mflags |= avx512bw;
+        }
+    }
 
     // 3dnow
     __cpuid(CPUInfo, 0x80000001);
@@ -49,110 +65,96 @@ CCpuID::CCpuID()
     mflags |= ((t & 0x80000000) != 0) ? _3dnow : 0;			// 3D NOW
     mflags |= ((t & 0x00400000) != 0) ? ssemmx : 0;			// SSE MMX
 
-    // result
-    m_flags = (flag_t)mflags;
-}
+    // SIMD tier, optionally capped from the environment
+    tier_t tier = (mflags & avx512bw) && (mflags & avx2) ? tier_avx512
+                  : (mflags & avx2) ? tier_avx2
+                  : (mflags & sse2) ? tier_sse2
+                  : tier_c;
 
-void memcpy_accel(void* dst, const void* src, size_t len)
-{
-#ifndef _WIN64
-    if((g_cpuid.m_flags & CCpuID::ssefpu) && len >= 128
-       && !((DWORD)src & 15) && !((DWORD)dst & 15))
-    {
-        __asm
-        {
-            mov     esi, dword ptr [src]
-            mov     edi, dword ptr [dst]
-            mov     ecx, len
-            shr     ecx, 7
-            memcpy_accel_sse_loop:
-            prefetchnta	[esi+16*8]
-            movaps		xmm0, [esi]
-            movaps		xmm1, [esi+16*1]
-            movaps		xmm2, [esi+16*2]
-            movaps		xmm3, [esi+16*3]
-            movaps		xmm4, [esi+16*4]
-            movaps		xmm5, [esi+16*5]
-            movaps		xmm6, [esi+16*6]
-            movaps		xmm7, [esi+16*7]
-            movntps		[edi], xmm0
-            movntps		[edi+16*1], xmm1
-            movntps		[edi+16*2], xmm2
-            movntps		[edi+16*3], xmm3
-            movntps		[edi+16*4], xmm4
-            movntps		[edi+16*5], xmm5
-            movntps		[edi+16*6], xmm6
-            movntps		[edi+16*7], xmm7
-            add			esi, 128
-            add			edi, 128
-            dec			ecx
-            jne			memcpy_accel_sse_loop
-            mov     ecx, len
-            and     ecx, 127
-            cmp     ecx, 0
-            je		memcpy_accel_sse_end
-            memcpy_accel_sse_loop2:
-            mov		dl, byte ptr[esi]
-            mov		byte ptr[edi], dl
-            inc		esi
-            inc		edi
-            dec		ecx
-            jne		memcpy_accel_sse_loop2
-            memcpy_accel_sse_end:
-            emms
-            sfence
-        }
-    }
-    else if((g_cpuid.m_flags & CCpuID::mmx) && len >= 64
-            && !((DWORD)src & 7) && !((DWORD)dst & 7))
+    char env[16];
+    size_t len = 0;
+    if(!getenv_s(&len, env, sizeof(env), "VSFILTER_SIMD") && len > 0)
     {
-        __asm
+        for(int t = tier_c; t <= tier_avx512; t++)
         {
-            mov     esi, dword ptr [src]
-            mov     edi, dword ptr [dst]
-            mov     ecx, len
-            shr     ecx, 6
-            memcpy_accel_mmx_loop:
-            movq    mm0, qword ptr [esi]
-            movq    mm1, qword ptr [esi+8*1]
-            movq    mm2, qword ptr [esi+8*2]
-            movq    mm3, qword ptr [esi+8*3]
-            movq    mm4, qword ptr [esi+8*4]
-            movq    mm5, qword ptr [esi+8*5]
-            movq    mm6, qword ptr [esi+8*6]
-            movq    mm7, qword ptr [esi+8*7]
-            movq    qword ptr [edi], mm0
-            movq    qword ptr [edi+8*1], mm1
-            movq    qword ptr [edi+8*2], mm2
-            movq    qword ptr [edi+8*3], mm3
-            movq    qword ptr [edi+8*4], mm4
-            movq    qword ptr [edi+8*5], mm5
-            movq    qword ptr [edi+8*6], mm6
-            movq    qword ptr [edi+8*7], mm7
-            add     esi, 64
-            add     edi, 64
-            loop	memcpy_accel_mmx_loop
-            mov     ecx, len
-            and     ecx, 63
-            cmp     ecx, 0
-            je		memcpy_accel_mmx_end
-            memcpy_accel_mmx_loop2:
-            mov		dl, byte ptr [esi]
-            mov		byte ptr [edi], dl
-            inc		esi
-            inc		edi
-            dec		ecx
-            jne		memcpy_accel_mmx_loop2
-            memcpy_accel_mmx_end:
-            emms
+            if(!_stricmp(env, GetTierName((tier_t)t)))
+            {
+                if(t < tier) tier = (tier_t)t;
+                break;
+            }
         }
     }
-    else
-#endif
+
+    // The tiers only govern the flags from sse2 up, nothing dispatches on the mmx-era ones
+    static const int tierFlags[tier_count] =
     {
-        memcpy(dst, src, len);
+        0,
+        sse2 | sse3 | ssse3,
+        sse2 | sse3 | ssse3 | avx2,
+        sse2 | sse3 | ssse3 | avx2 | avx512bw,
+    };
+    mflags &= ~(sse2 | sse3 | ssse3 | avx2 | avx512bw) | tierFlags[tier];
+
+    // result
+    m_flags = (flag_t)mflags;
+    m_tier = tier;
+}
+
+LPCSTR CCpuID::GetTierName(tier_t tier)
+{
+    static const LPCSTR names[tier_count] = {"c", "sse2", "avx2", "avx512"};
+    return (tier >= tier_c && tier <= tier_avx512) ? names[tier] : "";
+}
+
+#ifndef _WIN64
+// 16-byte aligned, len >= 128
+static void memcpy_sse(void* dst, const void* src, size_t len)
+{
+    __asm
+    {
+        mov     esi, dword ptr [src]
+        mov     edi, dword ptr [dst]
+        mov     ecx, len
+        shr     ecx, 7
+        memcpy_accel_sse_loop:
+        prefetchnta	[esi+16*8]
+        movaps		xmm0, [esi]
+        movaps		xmm1, [esi+16*1]
+        movaps		xmm2, [esi+16*2]
+        movaps		xmm3, [esi+16*3]
+        movaps		xmm4, [esi+16*4]
+        movaps		xmm5, [esi+16*5]
+        movaps		xmm6, [esi+16*6]
+        movaps		xmm7, [esi+16*7]
+        movntps		[edi], xmm0
+        movntps		[edi+16*1], xmm1
+        movntps		[edi+16*2], xmm2
+        movntps		[edi+16*3], xmm3
+        movntps		[edi+16*4], xmm4
+        movntps		[edi+16*5], xmm5
+        movntps		[edi+16*6], xmm6
+        movntps		[edi+16*7], xmm7
+        add			esi, 128
+        add			edi, 128
+        dec			ecx
+        jne			memcpy_accel_sse_loop
+        mov     ecx, len
+        and     ecx, 127
+        cmp     ecx, 0
+        je		memcpy_accel_sse_end
+        memcpy_accel_sse_loop2:
+        mov		dl, byte ptr[esi]
+        mov		byte ptr[edi], dl
+        inc		esi
+        inc		edi
+        dec		ecx
+        jne		memcpy_accel_sse_loop2
+        memcpy_accel_sse_end:
+        emms
+        sfence
     }
 }
+#endif
 
 static void yuvtoyuy2row_c(BYTE* dst, BYTE* srcy, BYTE* srcu, BYTE* srcv, DWORD width)
 {
@@ -195,6 +197,167 @@ static void asm_blend_row_c(BYTE* dst, BYTE* src, DWORD w, DWORD srcpitch)
     while(w--);
 }
 
+static void AvgLine8_c(BYTE* tmp, DWORD pitch)
+{
+    for(ptrdiff_t i = pitch; i--; tmp++)
+    {
+        tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
+    }
+}
+
+#ifndef _WIN64
+extern "C" void asm_YUVtoRGB32_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+extern "C" void asm_YUVtoRGB24_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+extern "C" void asm_YUVtoRGB16_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+extern "C" void asm_YUVtoRGB32_row_ISSE(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+extern "C" void asm_YUVtoRGB24_row_ISSE(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+
+extern "C" void mmx_YUY2toRGB24(const BYTE* src, BYTE* dst, const BYTE* src_end, int src_pitch, int row_size, bool rec709);
+extern "C" void mmx_YUY2toRGB32(const BYTE* src, BYTE* dst, const BYTE* src_end, int src_pitch, int row_size, bool rec709);
+
+// 16-byte aligned rows and pitch
+static void AvgLine8_sse2(BYTE* tmp, DWORD pitch)
+{
+    __asm
+    {
+        mov		esi, tmp
+        mov		ebx, pitch
+
+        mov		ecx, ebx
+        shr		ecx, 4
+
+        AvgLines8_sse2_loop:
+        movdqa	xmm0, [esi]
+        pavgb	xmm0, [esi+ebx*2]
+        movdqa	[esi+ebx], xmm0
+        add		esi, 16
+
+        dec		ecx
+        jnz		AvgLines8_sse2_loop
+
+        mov		tmp, esi
+    }
+
+    for(ptrdiff_t i = pitch & 7; i--; tmp++)
+    {
+        tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
+    }
+}
+
+static void AvgLine8_MMX(BYTE* tmp, DWORD pitch)
+{
+    __asm
+    {
+        mov		esi, tmp
+        mov		ebx, pitch
+
+        mov		ecx, ebx
+        shr		ecx, 3
+
+        pxor	mm7, mm7
+        AvgLines8_mmx_loop:
+        movq	mm0, [esi]
+        movq	mm1, mm0
+
+        punpcklbw	mm0, mm7
+        punpckhbw	mm1, mm7
+
+        movq	mm2, [esi+ebx*2]
+        movq	mm3, mm2
+
+        punpcklbw	mm2, mm7
+        punpckhbw	mm3, mm7
+
+        paddw	mm0, mm2
+        psrlw	mm0, 1
+
+        paddw	mm1, mm3
+        psrlw	mm1, 1
+
+        packuswb	mm0, mm1
+
+        movq	[esi+ebx], mm0
+
+        lea		esi, [esi+8]
+
+        dec		ecx
+        jnz		AvgLines8_mmx_loop
+
+        mov		tmp, esi
+    }
+
+    for(ptrdiff_t i = pitch & 7; i--; tmp++)
+    {
+        tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
+    }
+}
+#endif
+
+typedef void (*MemcpyFunc)(void* dst, const void* src, size_t len);
+typedef void (*YUVtoRGBRowFunc)(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
+typedef void (*YV12toYUY2Func)(const BYTE* Y, const BYTE* U, const BYTE* V, int halfstride, unsigned halfwidth, unsigned height, BYTE* YUY2, int d_stride);
+typedef void (*YUVtoYUY2RowFunc)(BYTE* dst, BYTE* srcy, BYTE* srcu, BYTE* srcv, DWORD width);
+typedef void (*YUVtoYUY2RowAvgFunc)(BYTE* dst, BYTE* srcy, BYTE* srcu, BYTE* srcv, DWORD width, DWORD pitchuv);
+typedef void (*BlendRowFunc)(BYTE* dst, BYTE* src, DWORD w, DWORD srcpitch);
+typedef void (*AvgLine8Func)(BYTE* tmp, DWORD pitch);
+typedef void (*YUY2toRGBFunc)(const BYTE* src, BYTE* dst, const BYTE* src_end, int src_pitch, int row_size, bool rec709);
+
+// The vector conversion kernels of a tier, NULL where it has none and the C code runs.
+// They are 32-bit asm, x64 builds run the C code at every tier. The aligned kernels need
+// 16-byte aligned rows and pitches, the I420 ones rows of 8n pixels.
+//
+// The MMX asm stays where it is the only vector code: YUY2 to RGB, the 24/32-bit I420 to
+// RGB rows (integer SSE on MMX registers) and the rows the aligned SSE2 kernels can't take.
+// Every CPU of the sse2 tier has MMX, so they sit there and fEmms clears the MMX state
+// after them. AvgLines555/565 have no C body on 32-bit builds and stay MMX at every tier.
+// The MMX copy and the plain MMX I420 to RGB rows are gone, they only ran on CPUs with
+// MMX but not SSE, which are in the c tier now.
+struct CConvertFuncs
+{
+    MemcpyFunc memcpyAligned; // len >= 128
+    YUVtoRGBRowFunc yuvToRGB[3]; // 16, 24, 32 bpp
+    YV12toYUY2Func yv12ToYuy2Aligned, yv12ToYuy2AlignedInterlaced;
+    YUVtoYUY2RowFunc yuvToYuy2;
+    YUVtoYUY2RowAvgFunc yuvToYuy2Avg;
+    BlendRowFunc blendRowClippedAligned, blendRowAligned, blendRowClipped, blendRow;
+    AvgLine8Func avgLine8Aligned, avgLine8;
+    YUY2toRGBFunc yuy2ToRGB24, yuy2ToRGB32;
+    bool fEmms;
+};
+
+static const CConvertFuncs& GetConvertFuncs()
+{
+    static const CConvertFuncs c = {NULL};
+#ifndef _WIN64
+    static const CConvertFuncs sse2 =
+    {
+        memcpy_sse,
+        {asm_YUVtoRGB16_row/*_ISSE*/, asm_YUVtoRGB24_row_ISSE, asm_YUVtoRGB32_row_ISSE}, // TODO: fix _ISSE (555->565)
+        yv12_yuy2_sse2, yv12_yuy2_sse2_interlaced,
+        yuvtoyuy2row_MMX, yuvtoyuy2row_avg_MMX,
+        asm_blend_row_clipped_SSE2, asm_blend_row_SSE2, asm_blend_row_clipped_MMX, asm_blend_row_MMX,
+        AvgLine8_sse2, AvgLine8_MMX,
+        mmx_YUY2toRGB24, mmx_YUY2toRGB32,
+        true
+    };
+#else
+    static const CConvertFuncs& sse2 = c;
+#endif
+    static const CConvertFuncs* const tiers[CCpuID::tier_count] = {&c, &sse2, &sse2, &sse2};
+
+    return *SelectTier(tiers);
+}
+
+void memcpy_accel(void* dst, const void* src, size_t len)
+{
+    const CConvertFuncs& f = GetConvertFuncs();
+
+    if(f.memcpyAligned && len >= 128 && !((DWORD_PTR)src & 15) && !((DWORD_PTR)dst & 15))
+        f.memcpyAligned(dst, src, len);
+    else
+        memcpy(dst, src, len);
+}
+
 bool BitBltFromI420ToI420(int w, int h, BYTE* dsty, BYTE* dstu, BYTE* dstv, int dstpitch, BYTE* srcy, BYTE* srcu, BYTE* srcv, int srcpitch)
 {
     if((w & 1))
@@ -245,75 +408,21 @@ bool BitBltFromYUY2ToYUY2(int w, int h, BYTE* dst, int dstpitch, BYTE* src, int
     return(true);
 }
 
-#ifndef _WIN64
-extern "C" void asm_YUVtoRGB32_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB24_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB16_row(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB32_row_MMX(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB24_row_MMX(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB16_row_MMX(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB32_row_ISSE(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB24_row_ISSE(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-extern "C" void asm_YUVtoRGB16_row_ISSE(void* ARGB1, void* ARGB2, BYTE* Y1, BYTE* Y2, BYTE* U, BYTE* V, long width);
-#endif
-
 bool BitBltFromI420ToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE* srcy, BYTE* srcu, BYTE* srcv, int srcpitch)
 {
     if(w <= 0 || h <= 0 || (w & 1) || (h & 1))
         return(false);
 
 #ifndef _WIN64
-    void (*asm_YUVtoRGB_row)(void * ARGB1, void * ARGB2, BYTE * Y1, BYTE * Y2, BYTE * U, BYTE * V, long width) = NULL;;
+    const CConvertFuncs& f = GetConvertFuncs();
 
-    if((g_cpuid.m_flags & CCpuID::ssefpu) && !(w & 7))
-    {
-        switch(dbpp)
-        {
-        case 16:
-                asm_YUVtoRGB_row = asm_YUVtoRGB16_row/*_ISSE*/;
-            break; // TODO: fix _ISSE (555->565)
-        case 24:
-                asm_YUVtoRGB_row = asm_YUVtoRGB24_row_ISSE;
-            break;
-        case 32:
-                asm_YUVtoRGB_row = asm_YUVtoRGB32_row_ISSE;
-            break;
-        }
-    }
-    else if((g_cpuid.m_flags & CCpuID::mmx) && !(w & 7))
-    {
-        switch(dbpp)
-        {
-        case 16:
-                asm_YUVtoRGB_row = asm_YUVtoRGB16_row/*_MMX*/;
-            break; // TODO: fix _MMX (555->565)
-        case 24:
-                asm_YUVtoRGB_row = asm_YUVtoRGB24_row_MMX;
-            break;
-        case 32:
-                asm_YUVtoRGB_row = asm_YUVtoRGB32_row_MMX;
-            break;
-        }
-    }
-    else
-    {
-        switch(dbpp)
-        {
-        case 16:
-                asm_YUVtoRGB_row = asm_YUVtoRGB16_row;
-            break;
-        case 24:
-                asm_YUVtoRGB_row = asm_YUVtoRGB24_row;
-            break;
-        case 32:
-                asm_YUVtoRGB_row = asm_YUVtoRGB32_row;
-            break;
-        }
-    }
-
-    if(!asm_YUVtoRGB_row)
+    static const YUVtoRGBRowFunc rows[3] = {asm_YUVtoRGB16_row, asm_YUVtoRGB24_row, asm_YUVtoRGB32_row};
+    int i = dbpp == 16 ? 0 : dbpp == 24 ? 1 : dbpp == 32 ? 2 : -1;
+    if(i < 0)
         return(false);
 
+    YUVtoRGBRowFunc asm_YUVtoRGB_row = f.yuvToRGB[i] && !(w & 7) ? f.yuvToRGB[i] : rows[i];
+
     do
     {
         asm_YUVtoRGB_row(dst + dstpitch, dst, srcy + srcpitch, srcy, srcu, srcv, w / 2);
@@ -325,13 +434,13 @@ bool BitBltFromI420ToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE*
     }
     while(h -= 2);
 
-    if(g_cpuid.m_flags & CCpuID::mmx)
+    if(f.fEmms)
+    {
         __asm emms
+        __asm sfence
+    }
 
-        if(g_cpuid.m_flags & CCpuID::ssefpu)
-            __asm sfence
-
-            return(true);
+    return(true);
 #else
     ASSERT(FALSE);
     return(false);
@@ -345,37 +454,26 @@ bool BitBltFromI420ToYUY2(int w, int h, BYTE* dst, int dstpitch, BYTE* srcy, BYT
 
     if(srcpitch == 0) srcpitch = w;
 
-    void (*yuvtoyuy2row)(BYTE * dst, BYTE * srcy, BYTE * srcu, BYTE * srcv, DWORD width) = NULL;
-    void (*yuvtoyuy2row_avg)(BYTE * dst, BYTE * srcy, BYTE * srcu, BYTE * srcv, DWORD width, DWORD pitchuv) = NULL;
+    const CConvertFuncs& f = GetConvertFuncs();
 
 #ifndef _WIN64
-    if((g_cpuid.m_flags & CCpuID::sse2)
+    if(f.yv12ToYuy2Aligned
        && !((DWORD_PTR)srcy & 15) && !((DWORD_PTR)srcu & 15) && !((DWORD_PTR)srcv & 15) && !(srcpitch & 31)
        && !((DWORD_PTR)dst & 15) && !(dstpitch & 15))
     {
-        if(!fInterlaced) yv12_yuy2_sse2(srcy, srcu, srcv, srcpitch / 2, w / 2, h, dst, dstpitch);
-        else yv12_yuy2_sse2_interlaced(srcy, srcu, srcv, srcpitch / 2, w / 2, h, dst, dstpitch);
+        if(!fInterlaced) f.yv12ToYuy2Aligned(srcy, srcu, srcv, srcpitch / 2, w / 2, h, dst, dstpitch);
+        else f.yv12ToYuy2AlignedInterlaced(srcy, srcu, srcv, srcpitch / 2, w / 2, h, dst, dstpitch);
         return(true);
     }
     else
     {
         ASSERT(!fInterlaced);
     }
-
-    if((g_cpuid.m_flags & CCpuID::mmx) && !(w & 7))
-    {
-        yuvtoyuy2row = yuvtoyuy2row_MMX;
-        yuvtoyuy2row_avg = yuvtoyuy2row_avg_MMX;
-    }
-    else
 #endif
-    {
-        yuvtoyuy2row = yuvtoyuy2row_c;
-        yuvtoyuy2row_avg = yuvtoyuy2row_avg_c;
-    }
 
-    if(!yuvtoyuy2row)
-        return(false);
+    bool fVector = f.yuvToYuy2 && !(w & 7);
+    YUVtoYUY2RowFunc yuvtoyuy2row = fVector ? f.yuvToYuy2 : yuvtoyuy2row_c;
+    YUVtoYUY2RowAvgFunc yuvtoyuy2row_avg = fVector ? f.yuvToYuy2Avg : yuvtoyuy2row_avg_c;
 
     do
     {
@@ -393,11 +491,11 @@ bool BitBltFromI420ToYUY2(int w, int h, BYTE* dst, int dstpitch, BYTE* srcy, BYT
     yuvtoyuy2row(dst + dstpitch, srcy + srcpitch, srcu, srcv, w);
 
 #ifndef _WIN64
-    if(g_cpuid.m_flags & CCpuID::mmx)
+    if(fVector && f.fEmms)
         __asm emms
 #endif
 
-        return(true);
+    return(true);
 }
 
 bool BitBltFromRGBToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE* src, int srcpitch, int sbpp)
@@ -498,30 +596,22 @@ bool BitBltFromRGBToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE* s
 
 void DeinterlaceBlend(BYTE* dst, BYTE* src, DWORD rowbytes, DWORD h, DWORD dstpitch, DWORD srcpitch)
 {
-    void (*blend_row_clipped)(BYTE * dst, BYTE * src, DWORD w, DWORD srcpitch) = NULL;
-    void (*blend_row)(BYTE * dst, BYTE * src, DWORD w, DWORD srcpitch) = NULL;
+    const CConvertFuncs& f = GetConvertFuncs();
 
-#ifndef _WIN64
-    if((g_cpuid.m_flags & CCpuID::sse2) && !((DWORD)src & 0xf) && !((DWORD)dst & 0xf) && !(srcpitch & 0xf))
-    {
-        blend_row_clipped = asm_blend_row_clipped_SSE2;
-        blend_row = asm_blend_row_SSE2;
-    }
-    else if(g_cpuid.m_flags & CCpuID::mmx)
+    BlendRowFunc blend_row_clipped = asm_blend_row_clipped_c;
+    BlendRowFunc blend_row = asm_blend_row_c;
+
+    if(f.blendRowAligned && !((DWORD_PTR)src & 0xf) && !((DWORD_PTR)dst & 0xf) && !(srcpitch & 0xf))
     {
-        blend_row_clipped = asm_blend_row_clipped_MMX;
-        blend_row = asm_blend_row_MMX;
+        blend_row_clipped = f.blendRowClippedAligned;
+        blend_row = f.blendRowAligned;
     }
-    else
-#endif
+    else if(f.blendRow)
     {
-        blend_row_clipped = asm_blend_row_clipped_c;
-        blend_row = asm_blend_row_c;
+        blend_row_clipped = f.blendRowClipped;
+        blend_row = f.blendRow;
     }
 
-    if(!blend_row_clipped)
-        return;
-
     blend_row_clipped(dst, src, rowbytes, srcpitch);
 
     if((h -= 2) > 0) do
@@ -535,10 +625,10 @@ void DeinterlaceBlend(BYTE* dst, BYTE* src, DWORD rowbytes, DWORD h, DWORD dstpi
     blend_row_clipped(dst + dstpitch, src, rowbytes, srcpitch);
 
 #ifndef _WIN64
-    if(g_cpuid.m_flags & CCpuID::mmx)
+    if(f.fEmms)
         __asm emms
 #endif
-    }
+}
 
 void DeinterlaceBob(BYTE* dst, BYTE* src, DWORD rowbytes, DWORD h, DWORD dstpitch, DWORD srcpitch, bool topfield)
 {
@@ -559,96 +649,19 @@ void AvgLines8(BYTE* dst, DWORD h, DWORD pitch)
     if(h <= 1)
         return;
 
+    const CConvertFuncs& f = GetConvertFuncs();
+
     BYTE* s = dst;
     BYTE* d = dst + (h - 2) * pitch;
 
     for(; s < d; s += pitch * 2)
     {
-        BYTE* tmp = s;
-
-#ifndef _WIN64
-        if((g_cpuid.m_flags & CCpuID::sse2) && !((DWORD)tmp & 0xf) && !((DWORD)pitch & 0xf))
-        {
-            __asm
-            {
-                mov		esi, tmp
-                mov		ebx, pitch
-
-                mov		ecx, ebx
-                shr		ecx, 4
-
-                AvgLines8_sse2_loop:
-                movdqa	xmm0, [esi]
-                pavgb	xmm0, [esi+ebx*2]
-                movdqa	[esi+ebx], xmm0
-                add		esi, 16
-
-                dec		ecx
-                jnz		AvgLines8_sse2_loop
-
-                mov		tmp, esi
-            }
-
-            for(ptrdiff_t i = pitch & 7; i--; tmp++)
-            {
-                tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
-            }
-        }
-        else if(g_cpuid.m_flags & CCpuID::mmx)
-        {
-            __asm
-            {
-                mov		esi, tmp
-                mov		ebx, pitch
-
-                mov		ecx, ebx
-                shr		ecx, 3
-
-                pxor	mm7, mm7
-                AvgLines8_mmx_loop:
-                movq	mm0, [esi]
-                movq	mm1, mm0
-
-                punpcklbw	mm0, mm7
-                punpckhbw	mm1, mm7
-
-                movq	mm2, [esi+ebx*2]
-                movq	mm3, mm2
-
-                punpcklbw	mm2, mm7
-                punpckhbw	mm3, mm7
-
-                paddw	mm0, mm2
-                psrlw	mm0, 1
-
-                paddw	mm1, mm3
-                psrlw	mm1, 1
-
-                packuswb	mm0, mm1
-
-                movq	[esi+ebx], mm0
-
-                lea		esi, [esi+8]
-
-                dec		ecx
-                jnz		AvgLines8_mmx_loop
-
-                mov		tmp, esi
-            }
-
-            for(ptrdiff_t i = pitch & 7; i--; tmp++)
-            {
-                tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
-            }
-        }
+        if(f.avgLine8Aligned && !((DWORD_PTR)s & 0xf) && !((DWORD_PTR)pitch & 0xf))
+            f.avgLine8Aligned(s, pitch);
+        else if(f.avgLine8)
+            f.avgLine8(s, pitch);
         else
-#endif
-        {
-            for(ptrdiff_t i = pitch; i--; tmp++)
-            {
-                tmp[pitch] = (tmp[0] + tmp[pitch<<1] + 1) >> 1;
-            }
-        }
+            AvgLine8_c(s, pitch);
     }
 
     if(!(h & 1) && h >= 2)
@@ -658,7 +671,8 @@ void AvgLines8(BYTE* dst, DWORD h, DWORD pitch)
     }
 
 #ifndef _WIN64
-    __asm emms;
+    if(f.fEmms)
+        __asm emms
 #endif
 }
 
@@ -850,33 +864,18 @@ void AvgLines565(BYTE* dst, DWORD h, DWORD pitch)
 #endif
 }
 
-#ifndef _WIN64
-extern "C" void mmx_YUY2toRGB24(const BYTE* src, BYTE* dst, const BYTE* src_end, int src_pitch, int row_size, bool rec709);
-extern "C" void mmx_YUY2toRGB32(const BYTE* src, BYTE* dst, const BYTE* src_end, int src_pitch, int row_size, bool rec709);
-#endif
-
 bool BitBltFromYUY2ToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE* src, int srcpitch)
 {
-    void (* YUY2toRGB)(const BYTE * src, BYTE * dst, const BYTE * src_end, int src_pitch, int row_size, bool rec709) = NULL;
+    const CConvertFuncs& f = GetConvertFuncs();
 
-#ifndef _WIN64
-    if(g_cpuid.m_flags & CCpuID::mmx)
-    {
-        YUY2toRGB =
-            dbpp == 32 ? mmx_YUY2toRGB32 :
-            dbpp == 24 ? mmx_YUY2toRGB24 :
-            // dbpp == 16 ? mmx_YUY2toRGB16 : // TODO
-            NULL;
-    }
-    else
-#endif
-    {
-        ASSERT(FALSE);
-        // TODO
-    }
+    YUY2toRGBFunc YUY2toRGB =
+        dbpp == 32 ? f.yuy2ToRGB32 :
+        dbpp == 24 ? f.yuy2ToRGB24 :
+        // dbpp == 16 ? f.yuy2ToRGB16 : // TODO
+        NULL;
 
     if(!YUY2toRGB)
-        return(false);
+        return(false); // TODO: C conversion
 
     YUY2toRGB(src, dst, src + h * srcpitch, srcpitch, w, false);
 
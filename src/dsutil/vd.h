@@ -22,14 +22,28 @@
 
 #pragma once
 
+// Detected once at startup. The SIMD tier is the highest of the flags sse2 and up that the
+// kernels dispatch on; VSFILTER_SIMD=c|sse2|avx2|avx512 in the environment caps it
+// (and clears the flags above it) for benchmarking and testing the lower code paths.
 class CCpuID
 {
 public:
     CCpuID();
-    enum flag_t {mmx = 1, ssemmx = 2, ssefpu = 4, sse2 = 8, _3dnow = 16, sse3 = 32} m_flags;
+    enum flag_t {mmx = 1, ssemmx = 2, ssefpu = 4, sse2 = 8, _3dnow = 16, sse3 = 32, ssse3 = 64, avx2 = 128, avx512bw = 256} m_flags;
+    enum tier_t {tier_c, tier_sse2, tier_avx2, tier_avx512, tier_count} m_tier;
+
+    static LPCSTR GetTierName(tier_t tier);
 };
 extern CCpuID g_cpuid;
 
+// Kernels are dispatched from constant tables with one entry per tier, tier_c first,
+// a tier without kernels of its own repeats those of the tier below it
+template<class T>
+inline const T& SelectTier(const T (&tiers)[CCpuID::tier_count])
+{
+    return tiers[g_cpuid.m_tier];
+}
+
 extern bool BitBltFromI420ToI420(int w, int h, BYTE* dsty, BYTE* dstu, BYTE* dstv, int dstpitch, BYTE* srcy, BYTE* srcu, BYTE* srcv, int srcpitch);
 extern bool BitBltFromI420ToYUY2(int w, int h, BYTE* dst, int dstpitch, BYTE* srcy, BYTE* srcu, BYTE* srcv, int srcpitch, bool fInterlaced = false);
 extern bool BitBltFromI420ToRGB(int w, int h, BYTE* dst, int dstpitch, int dbpp, BYTE* srcy, BYTE* srcu, BYTE* srcv, int srcpitch /* TODO: , bool fInterlaced = false */);
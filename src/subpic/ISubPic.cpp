@@ -23,6 +23,61 @@
 #include "ISubPic.h"
 #include "..\DSUtil\DSUtil.h"
 
+//
+// Dirty rects
+//
+
+static __int64 RectArea(const CRect& r)
+{
+    return (__int64)r.Width() * r.Height();
+}
+
+void MergeDirtyRects(CAtlList<CRect>& rects)
+{
+    POSITION pos = rects.GetHeadPosition();
+    while(pos)
+    {
+        POSITION cur = pos;
+        if(rects.GetNext(pos).IsRectEmpty())
+            rects.RemoveAt(cur);
+    }
+
+    // Greedy: join the pair whose union wastes the least area, overlapping ones first, as long
+    // as the waste stays under a quarter of the union or a small fixed amount
+    while(rects.GetCount() > 1)
+    {
+        POSITION best1 = NULL, best2 = NULL;
+        __int64 bestWaste = 0;
+        CRect bestUnion;
+
+        for(POSITION pos1 = rects.GetHeadPosition(); pos1; rects.GetNext(pos1))
+        {
+            const CRect& r1 = rects.GetAt(pos1);
+            POSITION pos2 = pos1;
+            for(rects.GetNext(pos2); pos2; rects.GetNext(pos2))
+            {
+                const CRect& r2 = rects.GetAt(pos2);
+                CRect u, i;
+                u.UnionRect(r1, r2);
+                __int64 waste = i.IntersectRect(r1, r2) ? -1 : RectArea(u) - RectArea(r1) - RectArea(r2);
+                if(!best1 || waste < bestWaste)
+                {
+                    best1 = pos1, best2 = pos2;
+                    bestWaste = waste;
+                    bestUnion = u;
+                }
+            }
+        }
+
+        if(bestWaste >= 0 && rects.GetCount() <= MAX_DIRTY_RECTS
+           && bestWaste > max(RectArea(bestUnion) / 4, 64 * 64))
+            break;
+
+        rects.GetAt(best1) = bestUnion;
+        rects.RemoveAt(best2);
+    }
+}
+
 //
 // ISubPicImpl
 //
@@ -101,6 +156,8 @@ STDMETHODIMP ISubPicImpl::CopyTo(ISubPic* pSubPic)
     pSubPic->SetSegmentStart(m_rtSegmentStart);
     pSubPic->SetSegmentStop(m_rtSegmentStop);
     pSubPic->SetDirtyRect(m_rcDirty);
+    if(!m_rectListDirty.IsEmpty())
+        pSubPic->SetDirtyRects(m_rectListDirty);
     pSubPic->SetSize(m_size, m_vidrect);
     pSubPic->SetVirtualTextureSize(m_VirtualTextureSize, m_VirtualTextureTopLeft);
 
@@ -140,7 +197,51 @@ STDMETHODIMP ISubPicImpl::GetSourceAndDest(SIZE* pSize, RECT* pRcSource, RECT* p
 
 STDMETHODIMP ISubPicImpl::SetDirtyRect(RECT* pDirtyRect)
 {
-    return pDirtyRect ? m_rcDirty = *pDirtyRect, S_OK : E_POINTER;
+    if(!pDirtyRect)
+        return E_POINTER;
+
+    m_rcDirty = *pDirtyRect;
+    m_rectListDirty.RemoveAll();
+
+    return S_OK;
+}
+
+STDMETHODIMP ISubPicImpl::GetDirtyRects(CAtlList<CRect>& rects)
+{
+    rects.RemoveAll();
+
+    if(!m_rectListDirty.IsEmpty())
+        rects.AddTailList(&m_rectListDirty);
+    else if(!m_rcDirty.IsRectEmpty())
+        rects.AddTail(m_rcDirty);
+
+    return S_OK;
+}
+
+STDMETHODIMP ISubPicImpl::SetDirtyRects(const CAtlList<CRect>& rects)
+{
+    m_rcDirty.SetRectEmpty();
+    m_rectListDirty.RemoveAll();
+
+    for(POSITION pos = rects.GetHeadPosition(); pos; )
+        m_rcDirty |= rects.GetNext(pos);
+
+    if(rects.GetCount() > 1)
+        m_rectListDirty.AddTailList(&rects);
+
+    return S_OK;
+}
+
+// Subpics that can't keep the parts apart get their bounding box
+STDMETHODIMP ISubPicImpl::UnlockEx(const CAtlList<CRect>& dirtyRects)
+{
+    CRect r(0, 0, 0, 0);
+    for(POSITION pos = dirtyRects.GetHeadPosition(); pos; )
+        r |= dirtyRects.GetNext(pos);
+
+    m_rectListDirty.RemoveAll();
+
+    return Unlock(r);
 }
 
 STDMETHODIMP ISubPicImpl::GetMaxSize(SIZE* pMaxSize)
@@ -295,6 +396,18 @@ STDMETHODIMP ISubPicProviderImpl::Unlock()
     return m_pLock ? m_pLock->Unlock(), S_OK : E_FAIL;
 }
 
+STDMETHODIMP ISubPicProviderImpl::RenderEx(SubPicDesc& spd, REFERENCE_TIME rt, double fps, CAtlList<CRect>& rects)
+{
+    CRect r(0, 0, 0, 0);
+    HRESULT hr = Render(spd, rt, fps, r);
+
+    rects.RemoveAll();
+    if(!r.IsRectEmpty())
+        rects.AddTail(r);
+
+    return hr;
+}
+
 //
 // ISubPicQueueImpl
 //
@@ -392,13 +505,13 @@ HRESULT ISubPicQueueImpl::RenderTo(ISubPic* pSubPic, REFERENCE_TIME rtStart, REF
     if(SUCCEEDED(pSubPic->ClearDirtyRect(0xFF000000))
        && SUCCEEDED(pSubPic->Lock(spd)))
     {
-        CRect r(0, 0, 0, 0);
-        hr = pSubPicProvider->Render(spd, bIsAnimated ? rtStart : ((rtStart + rtStop) / 2), fps, r);
+        CAtlList<CRect> rects;
+        hr = pSubPicProvider->RenderEx(spd, bIsAnimated ? rtStart : ((rtStart + rtStop) / 2), fps, rects);
 
         pSubPic->SetStart(rtStart);
         pSubPic->SetStop(rtStop);
 
-        pSubPic->Unlock(r);
+        pSubPic->UnlockEx(rects);
     }
 
     pSubPicProvider->Unlock();
@@ -841,6 +954,12 @@ DWORD CSubPicQueue::ThreadProc()
 
 CSubPicQueueNoThread::CSubPicQueueNoThread(ISubPicAllocator* pAllocator, HRESULT* phr)
     : ISubPicQueueImpl(pAllocator, phr)
+    , m_cacheSize(0)
+    , m_cacheBudget(SUBPIC_CACHE_DEFAULT_BUDGET)
+    , m_nCacheHits(0)
+    , m_nCacheMisses(0)
+    , m_sizeAlloc(0, 0)
+    , m_sizeMaxTexture(0, 0)
 {
 }
 
@@ -848,6 +967,103 @@ CSubPicQueueNoThread::~CSubPicQueueNoThread()
 {
 }
 
+void CSubPicQueueNoThread::SetCacheBudget(size_t bytes)
+{
+    CAutoLock cAutoLock(&m_csLock);
+
+    m_cacheBudget = bytes;
+
+    TrimCache();
+}
+
+void CSubPicQueueNoThread::GetCacheStats(int& nHits, int& nMisses)
+{
+    CAutoLock cAutoLock(&m_csLock);
+
+    nHits = m_nCacheHits;
+    nMisses = m_nCacheMisses;
+}
+
+// private, m_csLock must be held
+
+CComPtr<ISubPic> CSubPicQueueNoThread::LookupCache(DWORD_PTR providerId, REFERENCE_TIME rtNow)
+{
+    for(POSITION pos = m_cache.GetHeadPosition(); pos; m_cache.GetNext(pos))
+    {
+        const CachedSubPic& e = m_cache.GetAt(pos);
+
+        if(e.providerId == providerId && e.rtStart <= rtNow && rtNow < e.rtStop)
+        {
+            m_cache.MoveToHead(pos);
+            return e.pSubPic;
+        }
+    }
+
+    return NULL;
+}
+
+void CSubPicQueueNoThread::AddToCache(ISubPic* pSubPic, DWORD_PTR providerId, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop)
+{
+    CSize size(0, 0);
+    pSubPic->GetMaxSize(&size);
+
+    CachedSubPic e;
+    e.pSubPic = pSubPic;
+    e.providerId = providerId;
+    e.rtStart = rtStart;
+    e.rtStop = rtStop;
+    e.size = (size_t)size.cx * size.cy * 4;
+
+    m_cache.AddHead(e);
+    m_cacheSize += e.size;
+
+    TrimCache();
+}
+
+// Whether the queue holds the only reference, that is no caller is still blending it
+static bool IsUnshared(ISubPic* pSubPic)
+{
+    pSubPic->AddRef();
+    return(pSubPic->Release() == 1);
+}
+
+CComPtr<ISubPic> CSubPicQueueNoThread::RecycleCacheEntry()
+{
+    size_t size = (size_t)m_sizeAlloc.cx * m_sizeAlloc.cy * 4;
+
+    // Allocate a new one while the budget allows it
+    if(m_cache.IsEmpty() || size == 0 || m_cacheSize + size <= m_cacheBudget)
+        return NULL;
+
+    CComPtr<ISubPic> pSubPic = m_cache.GetTail().pSubPic;
+
+    CSize maxSize(0, 0);
+    pSubPic->GetMaxSize(&maxSize);
+
+    // One of an older texture size is left for TrimCache
+    if(maxSize != m_sizeAlloc)
+        return NULL;
+
+    m_cacheSize -= m_cache.GetTail().size;
+    m_cache.RemoveTailNoReturn();
+
+    // One a caller is still blending goes when the caller lets go of it
+    if(!IsUnshared(pSubPic))
+        return NULL;
+
+    return pSubPic;
+}
+
+void CSubPicQueueNoThread::TrimCache()
+{
+    // the most recent one stays even if it alone is over the budget, it is what we are about to show
+    while(m_cacheSize > m_cacheBudget && m_cache.GetCount() > (m_cacheBudget > 0 ? 1u : 0u))
+    {
+        m_cacheSize -= m_cache.GetTail().size;
+        m_cache.RemoveTailNoReturn();
+    }
+}
+
 // ISubPicQueue
 
 STDMETHODIMP CSubPicQueueNoThread::Invalidate(REFERENCE_TIME rtInvalidate)
@@ -856,58 +1072,94 @@ STDMETHODIMP CSubPicQueueNoThread::Invalidate(REFERENCE_TIME rtInvalidate)
 
     m_pSubPic = NULL;
 
+    m_cache.RemoveAll();
+    m_cacheSize = 0;
+
     return S_OK;
 }
 
 STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, CComPtr<ISubPic> &ppSubPic)
 {
+    CComPtr<ISubPicProvider> pSubPicProvider;
+    GetSubPicProvider(&pSubPicProvider);
+
+    DWORD_PTR providerId = (DWORD_PTR)(ISubPicProvider*)pSubPicProvider;
 
     CComPtr<ISubPic> pSubPic;
+    bool fCache;
 
     {
         CAutoLock cAutoLock(&m_csLock);
 
-        if(!m_pSubPic)
+        if(m_pSubPic && m_pSubPic->GetStart() <= rtNow && rtNow < m_pSubPic->GetStop())
+            ppSubPic = m_pSubPic;
+        else
+            ppSubPic = LookupCache(providerId, rtNow);
+
+        if(ppSubPic)
         {
-            if(FAILED(m_pAllocator->AllocDynamic(&m_pSubPic)))
-                return(false);
+            m_nCacheHits++;
+            return(true);
         }
 
         pSubPic = m_pSubPic;
+        fCache = m_cacheBudget > 0;
     }
 
-    if(pSubPic->GetStart() <= rtNow && rtNow < pSubPic->GetStop())
+    if(pSubPicProvider && SUCCEEDED(pSubPicProvider->Lock()))
     {
-        ppSubPic = pSubPic;
-    }
-    else
-    {
-        CComPtr<ISubPicProvider> pSubPicProvider;
-        GetSubPicProvider(&pSubPicProvider); 
- 	    if (pSubPicProvider && SUCCEEDED(pSubPicProvider->Lock())) 
+        double fps = m_fps;
+
+        REFERENCE_TIME rtStart = 0, rtStop = 0;
+
+        POSITION pos = pSubPicProvider->GetStartPosition(rtNow, fps);
+        if(pos != 0)
         {
-            double fps = m_fps;
+            rtStart = pSubPicProvider->GetStart(pos, fps);
+            rtStop = pSubPicProvider->GetStop(pos, fps);
 
-            POSITION pos = pSubPicProvider->GetStartPosition(rtNow, fps); 
- 	        if(pos != 0) 
+            if(pSubPicProvider->IsAnimated(pos))
             {
-                REFERENCE_TIME rtStart = pSubPicProvider->GetStart(pos, fps);
-                REFERENCE_TIME rtStop = pSubPicProvider->GetStop(pos, fps);
+                rtStart = rtNow;
+                rtStop = rtNow + 1;
+
+                fCache = false;
+            }
+
+            if(rtStart <= rtNow && rtNow < rtStop)
+            {
+                SIZE	MaxTextureSize, VirtualSize;
+                POINT	VirtualTopLeft;
+                HRESULT	hr2;
+                if(SUCCEEDED(hr2 = pSubPicProvider->GetTextureSize(pos, MaxTextureSize, VirtualSize, VirtualTopLeft))
+                   && SUCCEEDED(m_pAllocator->SetMaxTextureSize(MaxTextureSize)))
+                {
+                    CAutoLock cAutoLock(&m_csLock);
+
+                    // what is in the cache no longer matches what the allocator gives out
+                    if(m_sizeMaxTexture != CSize(MaxTextureSize))
+                        m_sizeAlloc = CSize(0, 0);
+                    m_sizeMaxTexture = MaxTextureSize;
+                }
 
-                if(pSubPicProvider->IsAnimated(pos))
+                // Each cached interval has its own subpic, taken over from the least recently
+                // used one once the budget is reached
+                if(fCache)
                 {
-                    rtStart = rtNow;
-                    rtStop = rtNow + 1;
+                    CAutoLock cAutoLock(&m_csLock);
+
+                    pSubPic = RecycleCacheEntry();
                 }
 
-                if(rtStart <= rtNow && rtNow < rtStop)
+                if(!pSubPic && SUCCEEDED(m_pAllocator->AllocDynamic(&pSubPic)))
                 {
-                    SIZE	MaxTextureSize, VirtualSize;
-                    POINT	VirtualTopLeft;
-                    HRESULT	hr2;
-                    if(SUCCEEDED(hr2 = pSubPicProvider->GetTextureSize(pos, MaxTextureSize, VirtualSize, VirtualTopLeft)))
-                        m_pAllocator->SetMaxTextureSize(MaxTextureSize);
+                    CAutoLock cAutoLock(&m_csLock);
 
+                    pSubPic->GetMaxSize(&m_sizeAlloc);
+                }
+
+                if(pSubPic)
+                {
                     if(m_pAllocator->IsDynamicWriteOnly())
                     {
                         CComPtr<ISubPic> pStatic;
@@ -918,28 +1170,35 @@ STDMETHODIMP_(bool) CSubPicQueueNoThread::LookupSubPic(REFERENCE_TIME rtNow, CCo
                     }
                     else
                     {
-                        if(SUCCEEDED(RenderTo(m_pSubPic, rtStart, rtStop, fps, false)))
+                        if(SUCCEEDED(RenderTo(pSubPic, rtStart, rtStop, fps, false)))
                             ppSubPic = pSubPic;
                     }
                     if(SUCCEEDED(hr2))
                         pSubPic->SetVirtualTextureSize(VirtualSize, VirtualTopLeft);
                 }
             }
+        }
 
-            pSubPicProvider->Unlock();
+        pSubPicProvider->Unlock();
 
-            if(ppSubPic)
-            {
-                CAutoLock cAutoLock(&m_csLock);
+        if(ppSubPic)
+        {
+            CAutoLock cAutoLock(&m_csLock);
+
+            m_nCacheMisses++;
 
+            if(fCache)
+                AddToCache(ppSubPic, providerId, rtStart, rtStop);
+            else
                 m_pSubPic = ppSubPic;
-            }
         }
     }
 
     return(!!ppSubPic);
 }
 
+// the single animated/scratch subpic comes first, then the cached ones from the most recently used
+
 STDMETHODIMP CSubPicQueueNoThread::GetStats(int& nSubPics, REFERENCE_TIME& rtNow, REFERENCE_TIME& rtStart, REFERENCE_TIME& rtStop)
 {
     CAutoLock cAutoLock(&m_csLock);
@@ -955,6 +1214,16 @@ STDMETHODIMP CSubPicQueueNoThread::GetStats(int& nSubPics, REFERENCE_TIME& rtNow
         rtStop = m_pSubPic->GetStop();
     }
 
+    for(POSITION pos = m_cache.GetHeadPosition(); pos; )
+    {
+        const CachedSubPic& e = m_cache.GetNext(pos);
+
+        if(nSubPics++ == 0 || e.rtStart < rtStart)
+            rtStart = e.rtStart;
+        if(nSubPics == 1 || e.rtStop > rtStop)
+            rtStop = e.rtStop;
+    }
+
     return S_OK;
 }
 
@@ -962,11 +1231,24 @@ STDMETHODIMP CSubPicQueueNoThread::GetStats(int nSubPic, REFERENCE_TIME& rtStart
 {
     CAutoLock cAutoLock(&m_csLock);
 
-    if(!m_pSubPic || nSubPic != 0)
+    if(m_pSubPic)
+    {
+        if(nSubPic == 0)
+        {
+            rtStart = m_pSubPic->GetStart();
+            rtStop = m_pSubPic->GetStop();
+            return S_OK;
+        }
+
+        nSubPic--;
+    }
+
+    if(nSubPic < 0 || nSubPic >= (int)m_cache.GetCount())
         return E_INVALIDARG;
 
-    rtStart = m_pSubPic->GetStart();
-    rtStop = m_pSubPic->GetStop();
+    const CachedSubPic& e = m_cache.GetAt(m_cache.FindIndex(nSubPic));
+    rtStart = e.rtStart;
+    rtStop = e.rtStop;
 
     return S_OK;
 }
@@ -39,6 +39,15 @@ struct SubPicDesc
 };
 #pragma pack(pop)
 
+// A dirty region is kept as a few disjoint rectangles, so a sign at the top and a line of
+// dialogue at the bottom don't make every per-pixel pass walk the empty band between them
+
+#define MAX_DIRTY_RECTS 8
+
+// Drops empty rectangles and joins the rest until they are disjoint, there are no more than
+// MAX_DIRTY_RECTS of them, and no two are close enough to be cheaper to walk as one
+void MergeDirtyRects(CAtlList<CRect>& rects);
+
 //
 // ISubPic
 //
@@ -74,6 +83,11 @@ interface ISubPic : public IUnknown
 	STDMETHOD_(REFERENCE_TIME, GetSegmentStop) () PURE;
 	STDMETHOD_(void, SetSegmentStart) (REFERENCE_TIME rtStart) PURE;
 	STDMETHOD_(void, SetSegmentStop) (REFERENCE_TIME rtStop) PURE;
+
+	// the dirty rect is the bounding box of these
+	STDMETHOD (GetDirtyRects) (CAtlList<CRect>& rects /*[out]*/) PURE;
+	STDMETHOD (SetDirtyRects) (const CAtlList<CRect>& rects /*[in]*/) PURE;
+	STDMETHOD (UnlockEx) (const CAtlList<CRect>& dirtyRects /*[in]*/) PURE;
 };
 
 class ISubPicImpl : public CUnknown, public ISubPic
@@ -82,6 +96,7 @@ protected:
 	REFERENCE_TIME m_rtStart, m_rtStop;
 	REFERENCE_TIME m_rtSegmentStart, m_rtSegmentStop;
 	CRect	m_rcDirty;
+	CAtlList<CRect> m_rectListDirty; // disjoint parts of m_rcDirty, empty when it is a single one
 	CSize	m_maxsize;
 	CSize	m_size;
 	CRect	m_vidrect;
@@ -154,6 +169,9 @@ public:
 	STDMETHODIMP_(void) SetSegmentStart(REFERENCE_TIME rtStart);
 	STDMETHODIMP_(void) SetSegmentStop(REFERENCE_TIME rtStop);
 
+	STDMETHODIMP GetDirtyRects(CAtlList<CRect>& rects);
+	STDMETHODIMP SetDirtyRects(const CAtlList<CRect>& rects);
+	STDMETHODIMP UnlockEx(const CAtlList<CRect>& dirtyRects);
 };
 
 //
@@ -227,6 +245,7 @@ interface ISubPicProvider : public IUnknown
 
 	STDMETHOD (Render) (SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox) PURE;
 	STDMETHOD (GetTextureSize) (POSITION pos, SIZE& MaxTextureSize, SIZE& VirtualSize, POINT& VirtualTopLeft) PURE;
+	STDMETHOD (RenderEx) (SubPicDesc& spd, REFERENCE_TIME rt, double fps, CAtlList<CRect>& rects /*[out]*/) PURE;
 };
 
 class ISubPicProviderImpl : public CUnknown, public ISubPicProvider
@@ -254,6 +273,7 @@ public:
 
 	STDMETHODIMP Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox) = 0;
 	STDMETHODIMP GetTextureSize (POSITION pos, SIZE& MaxTextureSize, SIZE& VirtualSize, POINT& VirtualTopLeft) { return E_NOTIMPL; };
+	STDMETHODIMP RenderEx(SubPicDesc& spd, REFERENCE_TIME rt, double fps, CAtlList<CRect>& rects);
 };
 
 //
@@ -352,15 +372,39 @@ public:
 	STDMETHODIMP GetStats(int nSubPic, REFERENCE_TIME& rtStart, REFERENCE_TIME& rtStop);
 };
 
+#define SUBPIC_CACHE_DEFAULT_BUDGET (64 << 20)
+
 class CSubPicQueueNoThread : public ISubPicQueueImpl
 {
 	CCritSec m_csLock;
-	CComPtr<ISubPic> m_pSubPic;
+	CComPtr<ISubPic> m_pSubPic; // the last animated one, or scratch space when the cache is off
+
+	// rendered non-animated subpics, most recently used first
+	struct CachedSubPic
+	{
+		CComPtr<ISubPic> pSubPic;
+		DWORD_PTR providerId;
+		REFERENCE_TIME rtStart, rtStop;
+		size_t size;
+	};
+	CAtlList<CachedSubPic> m_cache;
+	size_t m_cacheSize, m_cacheBudget;
+	int m_nCacheHits, m_nCacheMisses;
+	CSize m_sizeAlloc, m_sizeMaxTexture; // of the last subpic allocated, and the texture size asked for then
+
+	CComPtr<ISubPic> LookupCache(DWORD_PTR providerId, REFERENCE_TIME rtNow);
+	CComPtr<ISubPic> RecycleCacheEntry();
+	void AddToCache(ISubPic* pSubPic, DWORD_PTR providerId, REFERENCE_TIME rtStart, REFERENCE_TIME rtStop);
+	void TrimCache();
 
 public:
 	CSubPicQueueNoThread(ISubPicAllocator* pAllocator, HRESULT* phr);
 	virtual ~CSubPicQueueNoThread();
 
+	// memory the already rendered non-animated subpics may keep around, 0 leaves a single subpic re-rendered in place
+	void SetCacheBudget(size_t bytes);
+	void GetCacheStats(int& nHits, int& nMisses);
+
 	// ISubPicQueue
 
 	STDMETHODIMP Invalidate(REFERENCE_TIME rtInvalidate = -1);
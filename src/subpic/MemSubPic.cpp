@@ -21,6 +21,10 @@
 
 #include "stdafx.h"
 #include "MemSubPic.h"
+// For CPUID usage
+#include "../dsutil/vd.h"
+#include <emmintrin.h>
+#include <immintrin.h>
 
 // color conv
 #define DEFINE_YUV_MATRIX(Kr,Kg,Kb) {                        \
@@ -199,13 +203,21 @@ STDMETHODIMP CMemSubPic::CopyTo(ISubPic* pSubPic)
     if(FAILED(GetDesc(src)) || FAILED(pSubPic->GetDesc(dst)))
         return E_FAIL;
 
-    int w = m_rcDirty.Width(), h = m_rcDirty.Height();
+    CAtlList<CRect> rects;
+    GetDirtyRects(rects);
 
-    BYTE* s = (BYTE*)src.bits + src.pitch * m_rcDirty.top + m_rcDirty.left * 4;
-    BYTE* d = (BYTE*)dst.bits + dst.pitch * m_rcDirty.top + m_rcDirty.left * 4;
+    for(POSITION pos = rects.GetHeadPosition(); pos; )
+    {
+        const CRect& r = rects.GetNext(pos);
 
-    for(ptrdiff_t j = 0; j < h; j++, s += src.pitch, d += dst.pitch)
-        memcpy(d, s, w * 4);
+        int w = r.Width(), h = r.Height();
+
+        BYTE* s = (BYTE*)src.bits + src.pitch * r.top + r.left * 4;
+        BYTE* d = (BYTE*)dst.bits + dst.pitch * r.top + r.left * 4;
+
+        for(ptrdiff_t j = 0; j < h; j++, s += src.pitch, d += dst.pitch)
+            memcpy(d, s, w * 4);
+    }
 
     return S_OK;
 }
@@ -215,27 +227,36 @@ STDMETHODIMP CMemSubPic::ClearDirtyRect(DWORD color)
     if(m_rcDirty.IsRectEmpty())
         return S_FALSE;
 
-    BYTE* p = (BYTE*)m_spd.bits + m_spd.pitch * m_rcDirty.top + m_rcDirty.left * (m_spd.bpp >> 3);
-    for(ptrdiff_t j = 0, h = m_rcDirty.Height(); j < h; j++, p += m_spd.pitch)
+    CAtlList<CRect> rects;
+    GetDirtyRects(rects);
+
+    for(POSITION pos = rects.GetHeadPosition(); pos; )
     {
+        const CRect& r = rects.GetNext(pos);
+
+        BYTE* p = (BYTE*)m_spd.bits + m_spd.pitch * r.top + r.left * (m_spd.bpp >> 3);
+        for(ptrdiff_t j = 0, h = r.Height(); j < h; j++, p += m_spd.pitch)
+        {
 //
 
-        int w = m_rcDirty.Width();
+            int w = r.Width();
 #ifdef _WIN64
-        memsetd(p, color, w * 4); // nya
+            memsetd(p, color, w * 4); // nya
 #else
-        __asm
-        {
-            mov eax, color
-            mov ecx, w
-            mov edi, p
-            cld
-            rep stosd
-        }
+            __asm
+            {
+                mov eax, color
+                mov ecx, w
+                mov edi, p
+                cld
+                rep stosd
+            }
 #endif
+        }
     }
 
     m_rcDirty.SetRectEmpty();
+    m_rectListDirty.RemoveAll();
 
     return S_OK;
 }
@@ -245,33 +266,266 @@ STDMETHODIMP CMemSubPic::Lock(SubPicDesc& spd)
     return GetDesc(spd);
 }
 
+// ARGB -> AxYU AxYV (YUY2 and the planar types) and ARGB -> AYUV, done in place on a row.
+// The simd rows read c2y_cyb/g/r as a pmaddwd matrix instead of the tables and give the
+// same bytes as the c rows for every matrix and range ColorConvInitOther sets up.
+
+static void ConvertPairRow_c(BYTE* s, int w)
+{
+    for(BYTE* e = s + w * 4; s < e; s += 8) // ARGB ARGB -> AxYU AxYV
+    {
+        if((s[3] + s[7]) < 0x1fe)
+        {
+            s[1] = (c2y_yb[s[0]] + c2y_yg[s[1]] + c2y_yr[s[2]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
+            s[5] = (c2y_yb[s[4]] + c2y_yg[s[5]] + c2y_yr[s[6]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
+
+            int scaled_y = (s[1] + s[5] - RANGE[0][3]*2) * cy_cy2;
+
+            s[0] = Clip[(((((s[0] + s[4]) << 15) - scaled_y) >> 10) * c2y_cu + (RANGE[1][3] << 16) + 0x8000) >> 16];
+            s[4] = Clip[(((((s[2] + s[6]) << 15) - scaled_y) >> 10) * c2y_cv + (RANGE[2][3] << 16) + 0x8000) >> 16];
+        }
+        else
+        {
+            s[1] = s[5] = RANGE[0][3];
+            s[0] = RANGE[1][3], s[4] = RANGE[2][3];
+        }
+    }
+}
+
+static void ConvertAyuvRow_c(BYTE* s, int w)
+{
+    for(BYTE* e = s + w * 4; s < e; s += 4) // ARGB -> AYUV
+    {
+        if(s[3] < 0xff)
+        {
+            int y = (c2y_yb[s[0]] + c2y_yg[s[1]] + c2y_yr[s[2]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
+            int scaled_y = (y - RANGE[0][3]*2) * cy_cy;
+            s[1] = Clip[((((s[0] << 16) - scaled_y) >> 10) * c2y_cu + (RANGE[1][3] << 16) + 0x8000) >> 16];
+            s[0] = Clip[((((s[2] << 16) - scaled_y) >> 10) * c2y_cv + (RANGE[2][3] << 16) + 0x8000) >> 16];
+            s[2] = y;
+        }
+        else
+        {
+            s[0] = RANGE[2][3], s[1] = RANGE[1][3];
+            s[2] = RANGE[0][3];
+        }
+    }
+}
+
+// Low 32 bits of a 32x32 multiply, signed or not
+static __forceinline __m128i MulLo32_sse2(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08), _mm_shuffle_epi32(odd, 0x08));
+}
+
+// What Clip[] does to an index, for dwords
+static __forceinline __m128i ClipByte_sse2(__m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    x = _mm_packus_epi16(_mm_packs_epi32(x, x), zero);
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(x, zero), zero);
+}
+
+struct ConvertConsts_sse2
+{
+    __m128i cy, cyhi; // c2y_cyb/g/r as words, cyhi flags the ones pmaddwd sees as negative
+    __m128i ybias, ubias, vbias;
+    __m128i cu, cv; // c2y_cu/cv fit a word, and so does what they multiply
+
+    ConvertConsts_sse2()
+    {
+        cy = _mm_setr_epi16((short)c2y_cyb, (short)c2y_cyg, (short)c2y_cyr, 0, (short)c2y_cyb, (short)c2y_cyg, (short)c2y_cyr, 0);
+        cyhi = _mm_srli_epi16(cy, 15);
+        ybias = _mm_set1_epi32((RANGE[0][3] << 16) + 0x8000);
+        ubias = _mm_set1_epi32((RANGE[1][3] << 16) + 0x8000);
+        vbias = _mm_set1_epi32((RANGE[2][3] << 16) + 0x8000);
+        cu = _mm_set1_epi32(c2y_cu);
+        cv = _mm_set1_epi32(c2y_cv);
+    }
+};
+
+// y of 4 pixels as dwords
+static __forceinline __m128i ConvertY_sse2(__m128i p, const ConvertConsts_sse2& k)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(p, zero);
+    __m128i hi = _mm_unpackhi_epi8(p, zero);
+    lo = _mm_add_epi32(_mm_madd_epi16(lo, k.cy), _mm_slli_epi32(_mm_madd_epi16(lo, k.cyhi), 16));
+    hi = _mm_add_epi32(_mm_madd_epi16(hi, k.cy), _mm_slli_epi32(_mm_madd_epi16(hi, k.cyhi), 16));
+    __m128i bg = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, 0x88), _mm_shuffle_epi32(hi, 0x88));
+    __m128i r = _mm_unpacklo_epi64(_mm_shuffle_epi32(lo, 0xdd), _mm_shuffle_epi32(hi, 0xdd));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(bg, r), k.ybias), 16);
+}
+
+static void ConvertPairRow_sse2(BYTE* s, int w)
+{
+    const ConvertConsts_sse2 k;
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i keep = _mm_set1_epi32(0xffff0000);
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i even = _mm_setr_epi32(-1, 0, -1, 0);
+    const __m128i black = _mm_setr_epi32(RANGE[0][3] << 8 | RANGE[1][3], RANGE[0][3] << 8 | RANGE[2][3],
+                                         RANGE[0][3] << 8 | RANGE[1][3], RANGE[0][3] << 8 | RANGE[2][3]);
+    const __m128i ry2 = _mm_set1_epi32(RANGE[0][3] * 2);
+    const __m128i cy2 = _mm_set1_epi32(cy_cy2);
+
+    int i = 0;
+    for(; i + 4 <= w; i += 4, s += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)s);
+        __m128i t = _mm_cmpeq_epi32(_mm_and_si128(p, alpha), alpha);
+        t = _mm_and_si128(t, _mm_shuffle_epi32(t, 0xb1)); // both pixels of the pair
+
+        if(_mm_movemask_epi8(t) != 0xffff)
+        {
+            __m128i y = ConvertY_sse2(p, k);
+
+            // pair sums end up in dwords 0 and 2, which is all pmuludq reads
+            __m128i scaled = _mm_mul_epu32(_mm_sub_epi32(_mm_add_epi32(y, _mm_srli_epi64(y, 32)), ry2), cy2);
+            __m128i b = _mm_and_si128(p, mask);
+            __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+            b = _mm_srai_epi32(_mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(b, _mm_srli_epi64(b, 32)), 15), scaled), 10);
+            r = _mm_srai_epi32(_mm_sub_epi32(_mm_slli_epi32(_mm_add_epi32(r, _mm_srli_epi64(r, 32)), 15), scaled), 10);
+            __m128i u = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(b, k.cu), k.ubias), 16);
+            __m128i v = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(r, k.cv), k.vbias), 16);
+            __m128i c = ClipByte_sse2(_mm_or_si128(_mm_and_si128(u, even), _mm_slli_epi64(v, 32)));
+
+            c = _mm_or_si128(c, _mm_slli_epi32(y, 8));
+            c = _mm_or_si128(_mm_and_si128(t, black), _mm_andnot_si128(t, c));
+            p = _mm_or_si128(_mm_and_si128(p, keep), c);
+        }
+        else
+        {
+            p = _mm_or_si128(_mm_and_si128(p, keep), black);
+        }
+
+        _mm_storeu_si128((__m128i*)s, p);
+    }
+
+    ConvertPairRow_c(s, w - i);
+}
+
+static void ConvertAyuvRow_sse2(BYTE* s, int w)
+{
+    const ConvertConsts_sse2 k;
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i black = _mm_set1_epi32(RANGE[0][3] << 16 | RANGE[1][3] << 8 | RANGE[2][3]);
+    const __m128i ry2 = _mm_set1_epi32(RANGE[0][3] * 2);
+    const __m128i cy = _mm_set1_epi32(cy_cy);
+
+    int i = 0;
+    for(; i + 4 <= w; i += 4, s += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)s);
+        __m128i t = _mm_cmpeq_epi32(_mm_and_si128(p, alpha), alpha);
+
+        if(_mm_movemask_epi8(t) != 0xffff)
+        {
+            __m128i y = ConvertY_sse2(p, k);
+
+            __m128i scaled = MulLo32_sse2(_mm_sub_epi32(y, ry2), cy);
+            __m128i b = _mm_srai_epi32(_mm_sub_epi32(_mm_slli_epi32(_mm_and_si128(p, mask), 16), scaled), 10);
+            __m128i r = _mm_srai_epi32(_mm_sub_epi32(_mm_and_si128(p, _mm_set1_epi32(0xff0000)), scaled), 10);
+            __m128i u = ClipByte_sse2(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(b, k.cu), k.ubias), 16));
+            __m128i v = ClipByte_sse2(_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(r, k.cv), k.vbias), 16));
+
+            __m128i c = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(y, 16), _mm_slli_epi32(u, 8)), v);
+            c = _mm_or_si128(_mm_and_si128(t, black), _mm_andnot_si128(t, c));
+            p = _mm_or_si128(_mm_and_si128(p, alpha), c);
+        }
+        else
+        {
+            p = _mm_or_si128(_mm_and_si128(p, alpha), black);
+        }
+
+        _mm_storeu_si128((__m128i*)s, p);
+    }
+
+    ConvertAyuvRow_c(s, w - i);
+}
+
+typedef void (*ConvertRowFunc)(BYTE* s, int w);
+
+struct CConvertRowFuncs
+{
+    ConvertRowFunc pair, ayuv;
+};
+
+static const CConvertRowFuncs& GetConvertRowFuncs()
+{
+    static const CConvertRowFuncs tiers[CCpuID::tier_count] =
+    {
+        {ConvertPairRow_c, ConvertAyuvRow_c},
+        {ConvertPairRow_sse2, ConvertAyuvRow_sse2},
+        {ConvertPairRow_sse2, ConvertAyuvRow_sse2},
+        {ConvertPairRow_sse2, ConvertAyuvRow_sse2},
+    };
+
+    return SelectTier(tiers);
+}
+
 STDMETHODIMP CMemSubPic::Unlock(RECT* pDirtyRect)
 {
-    m_rcDirty = pDirtyRect ? *pDirtyRect : CRect(0, 0, m_spd.w, m_spd.h);
+    CAtlList<CRect> rects;
+    rects.AddTail(pDirtyRect ? CRect(*pDirtyRect) : CRect(0, 0, m_spd.w, m_spd.h));
+    return UnlockEx(rects);
+}
 
-    if(m_rcDirty.IsRectEmpty())
-        return S_OK;
+STDMETHODIMP CMemSubPic::UnlockEx(const CAtlList<CRect>& dirtyRects)
+{
+    bool fPlanar = m_spd.type == MSP_YV12 || m_spd.type == MSP_IYUV
+                   || m_spd.type == MSP_YUV420P10 || m_spd.type == MSP_YUV420P16;
 
-    if(m_spd.type == MSP_YUY2 || m_spd.type == MSP_YV12 || m_spd.type == MSP_IYUV || m_spd.type == MSP_AYUV)
+    CAtlList<CRect> rects;
+    for(POSITION pos = dirtyRects.GetHeadPosition(); pos; )
     {
-        ColorConvInitOther(m_eYCbCrMatrix, m_eYCbCrRange);
+        CRect r = dirtyRects.GetNext(pos);
+        if(r.IsRectEmpty())
+            continue;
 
-        if(m_spd.type == MSP_YUY2 || m_spd.type == MSP_YV12 || m_spd.type == MSP_IYUV)
+        if(m_spd.type == MSP_YUY2 || fPlanar)
         {
-            m_rcDirty.left &= ~1;
-            m_rcDirty.right = (m_rcDirty.right + 1)&~1;
+            r.left &= ~1;
+            r.right = (r.right + 1)&~1;
 
-            if(m_spd.type == MSP_YV12 || m_spd.type == MSP_IYUV)
+            if(fPlanar)
             {
-                m_rcDirty.top &= ~1;
-                m_rcDirty.bottom = (m_rcDirty.bottom + 1)&~1;
+                r.top &= ~1;
+                r.bottom = (r.bottom + 1)&~1;
             }
         }
+
+        rects.AddTail(r);
     }
 
-    int w = m_rcDirty.Width(), h = m_rcDirty.Height();
+    // rounding to the chroma grid can make neighbours overlap, nothing may be converted twice
+    MergeDirtyRects(rects);
+    SetDirtyRects(rects);
+
+    if(m_rcDirty.IsRectEmpty())
+        return S_OK;
+
+    if(m_spd.type == MSP_YUY2 || fPlanar || m_spd.type == MSP_AYUV)
+    {
+        ColorConvInitOther(m_eYCbCrMatrix, m_eYCbCrRange);
+    }
 
-    BYTE* top = (BYTE*)m_spd.bits + m_spd.pitch * m_rcDirty.top + m_rcDirty.left * 4;
+    for(POSITION pos = rects.GetHeadPosition(); pos; )
+    {
+        ConvertRect(rects.GetNext(pos), fPlanar);
+    }
+
+    return S_OK;
+}
+
+void CMemSubPic::ConvertRect(const CRect& r, bool fPlanar)
+{
+    int w = r.Width(), h = r.Height();
+
+    BYTE* top = (BYTE*)m_spd.bits + m_spd.pitch * r.top + r.left * 4;
     BYTE* bottom = top + m_spd.pitch * h;
 
     if(m_spd.type == MSP_RGB16)
@@ -300,65 +554,439 @@ STDMETHODIMP CMemSubPic::Unlock(RECT* pDirtyRect)
             }
         }
     }
-    else if(m_spd.type == MSP_YUY2 || m_spd.type == MSP_YV12 || m_spd.type == MSP_IYUV)
+    else if(m_spd.type == MSP_YUY2 || fPlanar || m_spd.type == MSP_AYUV)
     {
+        const CConvertRowFuncs& f = GetConvertRowFuncs();
+        ConvertRowFunc pConvertRow = m_spd.type == MSP_AYUV ? f.ayuv : f.pair;
+
         for(; top < bottom ; top += m_spd.pitch)
         {
-            BYTE* s = top;
-            BYTE* e = s + w * 4;
-            for(; s < e; s += 8) // ARGB ARGB -> AxYU AxYV
-            {
-                if((s[3] + s[7]) < 0x1fe)
-                {
-                    s[1] = (c2y_yb[s[0]] + c2y_yg[s[1]] + c2y_yr[s[2]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
-                    s[5] = (c2y_yb[s[4]] + c2y_yg[s[5]] + c2y_yr[s[6]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
+            pConvertRow(top, w);
+        }
+    }
+}
 
-                    int scaled_y = (s[1] + s[5] - RANGE[0][3]*2) * cy_cy2;
+// YV12/IYUV rows. The subpicture has y in byte 1 and u (even pixels) or v (odd pixels)
+// in byte 0 of each pixel, byte 3 is the inverted alpha: 0xff leaves the target alone.
+// The simd rows skip runs where every alpha is 0xff and give the same bytes as the c rows,
+// (d - black) * a >> 8 fits a signed 16 bit mulhi as ((d - black) << 7) * (a << 1) >> 16
 
-                    s[0] = Clip[(((((s[0] + s[4]) << 15) - scaled_y) >> 10) * c2y_cu + (RANGE[1][3] << 16) + 0x8000) >> 16];
-                    s[4] = Clip[(((((s[2] + s[6]) << 15) - scaled_y) >> 10) * c2y_cv + (RANGE[2][3] << 16) + 0x8000) >> 16];
-                }
-                else
-                {
-                    s[1] = s[5] = RANGE[0][3];
-                    s[0] = RANGE[1][3], s[4] = RANGE[2][3];
-                }
-            }
+static void AlphaBltLumaRow_c(BYTE* d, const BYTE* s, int w, int black)
+{
+    for(const BYTE* send = s + w * 4; s < send; s += 4, d++)
+    {
+        if(s[3] < 0xff)
+        {
+            d[0] = (((d[0] - black) * s[3]) >> 8) + s[1];
         }
     }
-    else if(m_spd.type == MSP_AYUV)
+}
+
+static __forceinline __m128i AlphaBltMix_sse2(__m128i d, __m128i a, __m128i c, __m128i black)
+{
+    __m128i x = _mm_slli_epi16(_mm_sub_epi16(d, black), 7);
+    __m128i r = _mm_add_epi16(_mm_mulhi_epi16(x, _mm_slli_epi16(a, 1)), c);
+    return _mm_and_si128(r, _mm_set1_epi16(0xff));
+}
+
+// Alpha and y of 16 pixels, false when none of them is visible
+static __forceinline bool AlphaBltLoadLuma_sse2(const BYTE* s, __m128i& a, __m128i& y)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(s + 16));
+    __m128i s2 = _mm_loadu_si128((const __m128i*)(s + 32));
+    __m128i s3 = _mm_loadu_si128((const __m128i*)(s + 48));
+
+    a = _mm_packus_epi16(
+        _mm_packs_epi32(_mm_srli_epi32(s0, 24), _mm_srli_epi32(s1, 24)),
+        _mm_packs_epi32(_mm_srli_epi32(s2, 24), _mm_srli_epi32(s3, 24)));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_set1_epi8(-1))) == 0xffff) return false;
+
+    y = _mm_packus_epi16(
+        _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(s0, 8), mask), _mm_and_si128(_mm_srli_epi32(s1, 8), mask)),
+        _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(s2, 8), mask), _mm_and_si128(_mm_srli_epi32(s3, 8), mask)));
+    return true;
+}
+
+static void AlphaBltLumaRow_sse2(BYTE* d, const BYTE* s, int w, int black)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i b = _mm_set1_epi16((short)black);
+
+    int i = 0;
+    for(; i + 16 <= w; i += 16, s += 64)
     {
-        for(; top < bottom ; top += m_spd.pitch)
+        __m128i a, y;
+        if(!AlphaBltLoadLuma_sse2(s, a, y)) continue;
+
+        __m128i dd = _mm_loadu_si128((const __m128i*)(d + i));
+        __m128i keep = _mm_cmpeq_epi8(a, _mm_set1_epi8(-1));
+        __m128i lo = AlphaBltMix_sse2(_mm_unpacklo_epi8(dd, zero), _mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(y, zero), b);
+        __m128i hi = AlphaBltMix_sse2(_mm_unpackhi_epi8(dd, zero), _mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(y, zero), b);
+        __m128i r = _mm_packus_epi16(lo, hi);
+        r = _mm_or_si128(_mm_and_si128(keep, dd), _mm_andnot_si128(keep, r));
+        _mm_storeu_si128((__m128i*)(d + i), r);
+    }
+
+    AlphaBltLumaRow_c(d + i, s, w - i, black);
+}
+
+static __forceinline __m256i AlphaBltMix_avx2(__m256i d, __m256i a, __m256i c, __m256i black)
+{
+    __m256i x = _mm256_slli_epi16(_mm256_sub_epi16(d, black), 7);
+    __m256i r = _mm256_add_epi16(_mm256_mulhi_epi16(x, _mm256_slli_epi16(a, 1)), c);
+    return _mm256_and_si256(r, _mm256_set1_epi16(0xff));
+}
+
+static void AlphaBltLumaRow_avx2(BYTE* d, const BYTE* s, int w, int black)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ff = _mm256_set1_epi8(-1);
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i b = _mm256_set1_epi16((short)black);
+    // the in-lane packs leave groups of four pixels in the order 0 2 4 6 1 3 5 7
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int i = 0;
+    for(; i + 32 <= w; i += 32, s += 128)
+    {
+        __m256i s0 = _mm256_loadu_si256((const __m256i*)s);
+        __m256i s1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i s2 = _mm256_loadu_si256((const __m256i*)(s + 64));
+        __m256i s3 = _mm256_loadu_si256((const __m256i*)(s + 96));
+
+        __m256i a = _mm256_packus_epi16(
+            _mm256_packs_epi32(_mm256_srli_epi32(s0, 24), _mm256_srli_epi32(s1, 24)),
+            _mm256_packs_epi32(_mm256_srli_epi32(s2, 24), _mm256_srli_epi32(s3, 24)));
+        a = _mm256_permutevar8x32_epi32(a, order);
+        __m256i keep = _mm256_cmpeq_epi8(a, ff);
+        if(_mm256_movemask_epi8(keep) == -1) continue;
+
+        __m256i y = _mm256_packus_epi16(
+            _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(s0, 8), mask), _mm256_and_si256(_mm256_srli_epi32(s1, 8), mask)),
+            _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(s2, 8), mask), _mm256_and_si256(_mm256_srli_epi32(s3, 8), mask)));
+        y = _mm256_permutevar8x32_epi32(y, order);
+
+        __m256i dd = _mm256_loadu_si256((const __m256i*)(d + i));
+        __m256i lo = AlphaBltMix_avx2(_mm256_unpacklo_epi8(dd, zero), _mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(y, zero), b);
+        __m256i hi = AlphaBltMix_avx2(_mm256_unpackhi_epi8(dd, zero), _mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(y, zero), b);
+        __m256i r = _mm256_blendv_epi8(_mm256_packus_epi16(lo, hi), dd, keep);
+        _mm256_storeu_si256((__m256i*)(d + i), r);
+    }
+
+    AlphaBltLumaRow_sse2(d + i, s, w - i, black);
+}
+
+// Chroma averages two rows of pixel pairs starting at s, plane 0 takes byte 0 of the
+// even pixels (u), plane 1 that of the odd ones (v). The alpha is the mean of all four.
+
+static void AlphaBltChromaRow_c(BYTE* d, const BYTE* s, int pitch, int w, int plane, int black)
+{
+    const BYTE* is = s + 4 * (1 - plane);
+    const BYTE* send = s + 4 * plane + w * 4;
+    for(s += 4 * plane; s < send; s += 8, is += 8, d++)
+    {
+        unsigned int ia = (s[3] + s[3+pitch] + is[3] + is[3+pitch]) >> 2;
+        if(ia < 0xff)
         {
-            BYTE* s = top;
-            BYTE* e = s + w * 4;
-            for(; s < e; s += 4) // ARGB -> AYUV
-            {
-                if(s[3] < 0xff)
-                {
-                    int y = (c2y_yb[s[0]] + c2y_yg[s[1]] + c2y_yr[s[2]] + (RANGE[0][3] << 16) + 0x8000) >> 16;
-                    int scaled_y = (y - RANGE[0][3]*2) * cy_cy;
-                    s[1] = Clip[((((s[0] << 16) - scaled_y) >> 10) * c2y_cu + (RANGE[1][3] << 16) + 0x8000) >> 16];
-                    s[0] = Clip[((((s[2] << 16) - scaled_y) >> 10) * c2y_cv + (RANGE[2][3] << 16) + 0x8000) >> 16];
-                    s[2] = y;
-                }
-                else
-                {
-                    s[0] = RANGE[2][3], s[1] = RANGE[1][3];
-                    s[2] = RANGE[0][3];
-                }
-            }
+            *d = (((*d - black) * ia) >> 8) + ((s[0] + s[pitch]) >> 1);
         }
     }
+}
 
-    return S_OK;
+// Alpha and u or v of 8 samples as words, from 16 pixels on two rows, false when none is visible
+static __forceinline bool AlphaBltLoadChroma_sse2(const BYTE* s, int pitch, int plane, __m128i& a, __m128i& c)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(s + 16));
+    __m128i s2 = _mm_loadu_si128((const __m128i*)(s + 32));
+    __m128i s3 = _mm_loadu_si128((const __m128i*)(s + 48));
+    __m128i t0 = _mm_loadu_si128((const __m128i*)(s + pitch));
+    __m128i t1 = _mm_loadu_si128((const __m128i*)(s + pitch + 16));
+    __m128i t2 = _mm_loadu_si128((const __m128i*)(s + pitch + 32));
+    __m128i t3 = _mm_loadu_si128((const __m128i*)(s + pitch + 48));
+
+    __m128i all = _mm_and_si128(_mm_and_si128(_mm_and_si128(s0, s1), _mm_and_si128(s2, s3)),
+                                _mm_and_si128(_mm_and_si128(t0, t1), _mm_and_si128(t2, t3)));
+    if(_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(all, alpha), alpha)) == 0xffff) return false;
+
+    __m128i a0 = _mm_add_epi16(_mm_packs_epi32(_mm_srli_epi32(s0, 24), _mm_srli_epi32(s1, 24)),
+                               _mm_packs_epi32(_mm_srli_epi32(t0, 24), _mm_srli_epi32(t1, 24)));
+    __m128i a1 = _mm_add_epi16(_mm_packs_epi32(_mm_srli_epi32(s2, 24), _mm_srli_epi32(s3, 24)),
+                               _mm_packs_epi32(_mm_srli_epi32(t2, 24), _mm_srli_epi32(t3, 24)));
+    a = _mm_packs_epi32(_mm_srli_epi32(_mm_madd_epi16(a0, one), 2), _mm_srli_epi32(_mm_madd_epi16(a1, one), 2));
+
+    __m128i c0 = _mm_add_epi16(_mm_packs_epi32(_mm_and_si128(s0, mask), _mm_and_si128(s1, mask)),
+                               _mm_packs_epi32(_mm_and_si128(t0, mask), _mm_and_si128(t1, mask)));
+    __m128i c1 = _mm_add_epi16(_mm_packs_epi32(_mm_and_si128(s2, mask), _mm_and_si128(s3, mask)),
+                               _mm_packs_epi32(_mm_and_si128(t2, mask), _mm_and_si128(t3, mask)));
+    c = plane
+        ? _mm_packs_epi32(_mm_srli_epi32(c0, 16), _mm_srli_epi32(c1, 16))
+        : _mm_packs_epi32(_mm_srli_epi32(_mm_slli_epi32(c0, 16), 16), _mm_srli_epi32(_mm_slli_epi32(c1, 16), 16));
+    c = _mm_srli_epi16(c, 1);
+    return true;
+}
+
+static void AlphaBltChromaRow_sse2(BYTE* d, const BYTE* s, int pitch, int w, int plane, int black)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i b = _mm_set1_epi16((short)black);
+    const __m128i ff = _mm_set1_epi16(0xff);
+
+    int i = 0;
+    for(; i + 16 <= w; i += 16, s += 64)
+    {
+        __m128i a, c;
+        if(!AlphaBltLoadChroma_sse2(s, pitch, plane, a, c)) continue;
+
+        __m128i dd = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(d + (i >> 1))), zero);
+        __m128i keep = _mm_cmpeq_epi16(a, ff);
+        __m128i r = AlphaBltMix_sse2(dd, a, c, b);
+        r = _mm_or_si128(_mm_and_si128(keep, dd), _mm_andnot_si128(keep, r));
+        _mm_storel_epi64((__m128i*)(d + (i >> 1)), _mm_packus_epi16(r, r));
+    }
+
+    AlphaBltChromaRow_c(d + (i >> 1), s, pitch, w - i, plane, black);
+}
+
+static void AlphaBltChromaRow_avx2(BYTE* d, const BYTE* s, int pitch, int w, int plane, int black)
+{
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256i b = _mm256_set1_epi16((short)black);
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i ff = _mm256_set1_epi16(0xff);
+    // the in-lane packs leave pairs of samples in the order 0 2 4 6 1 3 5 7
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int i = 0;
+    for(; i + 32 <= w; i += 32, s += 128)
+    {
+        __m256i s0 = _mm256_loadu_si256((const __m256i*)s);
+        __m256i s1 = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i s2 = _mm256_loadu_si256((const __m256i*)(s + 64));
+        __m256i s3 = _mm256_loadu_si256((const __m256i*)(s + 96));
+        __m256i t0 = _mm256_loadu_si256((const __m256i*)(s + pitch));
+        __m256i t1 = _mm256_loadu_si256((const __m256i*)(s + pitch + 32));
+        __m256i t2 = _mm256_loadu_si256((const __m256i*)(s + pitch + 64));
+        __m256i t3 = _mm256_loadu_si256((const __m256i*)(s + pitch + 96));
+
+        __m256i all = _mm256_and_si256(_mm256_and_si256(_mm256_and_si256(s0, s1), _mm256_and_si256(s2, s3)),
+                                       _mm256_and_si256(_mm256_and_si256(t0, t1), _mm256_and_si256(t2, t3)));
+        if(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(all, alpha), alpha)) == -1) continue;
+
+        __m256i a0 = _mm256_add_epi16(_mm256_packs_epi32(_mm256_srli_epi32(s0, 24), _mm256_srli_epi32(s1, 24)),
+                                      _mm256_packs_epi32(_mm256_srli_epi32(t0, 24), _mm256_srli_epi32(t1, 24)));
+        __m256i a1 = _mm256_add_epi16(_mm256_packs_epi32(_mm256_srli_epi32(s2, 24), _mm256_srli_epi32(s3, 24)),
+                                      _mm256_packs_epi32(_mm256_srli_epi32(t2, 24), _mm256_srli_epi32(t3, 24)));
+        __m256i a = _mm256_packs_epi32(_mm256_srli_epi32(_mm256_madd_epi16(a0, one), 2), _mm256_srli_epi32(_mm256_madd_epi16(a1, one), 2));
+        a = _mm256_permutevar8x32_epi32(a, order);
+
+        __m256i c0 = _mm256_add_epi16(_mm256_packs_epi32(_mm256_and_si256(s0, mask), _mm256_and_si256(s1, mask)),
+                                      _mm256_packs_epi32(_mm256_and_si256(t0, mask), _mm256_and_si256(t1, mask)));
+        __m256i c1 = _mm256_add_epi16(_mm256_packs_epi32(_mm256_and_si256(s2, mask), _mm256_and_si256(s3, mask)),
+                                      _mm256_packs_epi32(_mm256_and_si256(t2, mask), _mm256_and_si256(t3, mask)));
+        __m256i c = plane
+                    ? _mm256_packs_epi32(_mm256_srli_epi32(c0, 16), _mm256_srli_epi32(c1, 16))
+                    : _mm256_packs_epi32(_mm256_srli_epi32(_mm256_slli_epi32(c0, 16), 16), _mm256_srli_epi32(_mm256_slli_epi32(c1, 16), 16));
+        c = _mm256_permutevar8x32_epi32(_mm256_srli_epi16(c, 1), order);
+
+        __m256i dd = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(d + (i >> 1))));
+        __m256i r = _mm256_blendv_epi8(AlphaBltMix_avx2(dd, a, c, b), dd, _mm256_cmpeq_epi16(a, ff));
+        _mm_storeu_si128((__m128i*)(d + (i >> 1)), _mm_packus_epi16(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1)));
+    }
+
+    AlphaBltChromaRow_sse2(d + (i >> 1), s, pitch, w - i, plane, black);
+}
+
+// 10 and 16 bit planar targets. The subpicture stays 8 bit, its y/u/v and black level are
+// scaled up by shift and the target keeps its full precision under the alpha. The result is
+// clamped to the sample range, where the 8 bit rows above wrap around.
+
+static void AlphaBltLumaRow16_c(WORD* d, const BYTE* s, int w, int black, int shift)
+{
+    const int maxv = (0x100 << shift) - 1;
+    black <<= shift;
+    for(const BYTE* send = s + w * 4; s < send; s += 4, d++)
+    {
+        if(s[3] < 0xff)
+        {
+            int v = (((d[0] - black) * s[3]) >> 8) + (s[1] << shift);
+            d[0] = (WORD)(v < 0 ? 0 : v > maxv ? maxv : v);
+        }
+    }
+}
+
+static void AlphaBltChromaRow16_c(WORD* d, const BYTE* s, int pitch, int w, int plane, int black, int shift)
+{
+    const int maxv = (0x100 << shift) - 1;
+    black <<= shift;
+    const BYTE* is = s + 4 * (1 - plane);
+    const BYTE* send = s + 4 * plane + w * 4;
+    for(s += 4 * plane; s < send; s += 8, is += 8, d++)
+    {
+        int ia = (s[3] + s[3+pitch] + is[3] + is[3+pitch]) >> 2;
+        if(ia < 0xff)
+        {
+            int v = (((*d - black) * ia) >> 8) + (((s[0] + s[pitch]) >> 1) << shift);
+            *d = (WORD)(v < 0 ? 0 : v > maxv ? maxv : v);
+        }
+    }
+}
+
+// (d - black) * a needs 32 bits, the products are rebuilt from the 16 bit halves
+static __forceinline __m128i AlphaBltMix16_sse2(__m128i d, __m128i a, __m128i c, __m128i black, __m128i maxv)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(0x8000);
+
+    __m128i dl = _mm_mullo_epi16(d, a), dh = _mm_mulhi_epu16(d, a);
+    __m128i bl = _mm_mullo_epi16(black, a), bh = _mm_mulhi_epu16(black, a);
+    __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(dl, dh), _mm_unpacklo_epi16(bl, bh));
+    __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(dl, dh), _mm_unpackhi_epi16(bl, bh));
+    lo = _mm_add_epi32(_mm_srai_epi32(lo, 8), _mm_unpacklo_epi16(c, zero));
+    hi = _mm_add_epi32(_mm_srai_epi32(hi, 8), _mm_unpackhi_epi16(c, zero));
+
+    // clamp to [0, maxv] and pack unsigned through the signed pack
+    lo = _mm_andnot_si128(_mm_srai_epi32(lo, 31), lo);
+    hi = _mm_andnot_si128(_mm_srai_epi32(hi, 31), hi);
+    __m128i m = _mm_cmpgt_epi32(lo, maxv);
+    lo = _mm_or_si128(_mm_and_si128(m, maxv), _mm_andnot_si128(m, lo));
+    m = _mm_cmpgt_epi32(hi, maxv);
+    hi = _mm_or_si128(_mm_and_si128(m, maxv), _mm_andnot_si128(m, hi));
+    __m128i r = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+    return _mm_xor_si128(r, _mm_set1_epi16(-0x8000));
+}
+
+static void AlphaBltLumaRow16_sse2(WORD* d, const BYTE* s, int w, int black, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ff = _mm_set1_epi16(0xff);
+    const __m128i cnt = _mm_cvtsi32_si128(shift);
+    const __m128i b = _mm_set1_epi16((short)(black << shift));
+    const __m128i maxv = _mm_set1_epi32((0x100 << shift) - 1);
+
+    int i = 0;
+    for(; i + 16 <= w; i += 16, s += 64)
+    {
+        __m128i a, y;
+        if(!AlphaBltLoadLuma_sse2(s, a, y)) continue;
+
+        for(int k = 0; k < 2; k++)
+        {
+            __m128i ak = k ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+            __m128i yk = k ? _mm_unpackhi_epi8(y, zero) : _mm_unpacklo_epi8(y, zero);
+            __m128i dd = _mm_loadu_si128((const __m128i*)(d + i + k * 8));
+            __m128i keep = _mm_cmpeq_epi16(ak, ff);
+            __m128i r = AlphaBltMix16_sse2(dd, ak, _mm_sll_epi16(yk, cnt), b, maxv);
+            r = _mm_or_si128(_mm_and_si128(keep, dd), _mm_andnot_si128(keep, r));
+            _mm_storeu_si128((__m128i*)(d + i + k * 8), r);
+        }
+    }
+
+    AlphaBltLumaRow16_c(d + i, s, w - i, black, shift);
+}
+
+static void AlphaBltChromaRow16_sse2(WORD* d, const BYTE* s, int pitch, int w, int plane, int black, int shift)
+{
+    const __m128i ff = _mm_set1_epi16(0xff);
+    const __m128i cnt = _mm_cvtsi32_si128(shift);
+    const __m128i b = _mm_set1_epi16((short)(black << shift));
+    const __m128i maxv = _mm_set1_epi32((0x100 << shift) - 1);
+
+    int i = 0;
+    for(; i + 16 <= w; i += 16, s += 64)
+    {
+        __m128i a, c;
+        if(!AlphaBltLoadChroma_sse2(s, pitch, plane, a, c)) continue;
+
+        __m128i dd = _mm_loadu_si128((const __m128i*)(d + (i >> 1)));
+        __m128i keep = _mm_cmpeq_epi16(a, ff);
+        __m128i r = AlphaBltMix16_sse2(dd, a, _mm_sll_epi16(c, cnt), b, maxv);
+        r = _mm_or_si128(_mm_and_si128(keep, dd), _mm_andnot_si128(keep, r));
+        _mm_storeu_si128((__m128i*)(d + (i >> 1)), r);
+    }
+
+    AlphaBltChromaRow16_c(d + (i >> 1), s, pitch, w - i, plane, black, shift);
+}
+
+// YUY2 rows, the two luma samples of a DWORD under their own alpha and the chroma under
+// the average of both. Replaces the 32-bit MMX asm, the sse2 row runs on both builds.
+
+static void AlphaBltYuy2Row_c(DWORD* d, const BYTE* s, int w)
+{
+    for(const BYTE* send = s + w * 4; s < send; s += 8, d++)
+    {
+        unsigned int ia = (s[3] + s[7]) >> 1;
+        if(ia < 0xff)
+        {
+            // YUY2 colorspace fix. rewrited from sse2 asm
+            DWORD y1 = (DWORD)(((((*d & 0xff) - 0x10) * (s[3] >> 1)) >> 7) + s[1]) & 0xff;	// y1
+            DWORD uu = (DWORD)((((((*d >> 8) & 0xff) - 0x80) * (ia >> 1)) >> 7) + s[0]) & 0xff;	// u
+            DWORD y2 = (DWORD)((((((*d >> 16) & 0xff) - 0x10) * (s[7] >> 1)) >> 7) + s[5]) & 0xff;	// y2
+            DWORD vv = (DWORD)((((((*d >> 24) & 0xff) - 0x80) * (ia >> 1)) >> 7) + s[4]) & 0xff;		// v
+            *d = (y1) | (uu << 8) | (y2 << 16) | (vv << 24);
+        }
+    }
+}
+
+static void AlphaBltYuy2Row_sse2(DWORD* d, const BYTE* s, int w)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_setr_epi16(0x10, 0x80, 0x10, 0x80, 0, 0, 0, 0);
+
+    for(const BYTE* send = s + w * 4; s < send; s += 8, d++)
+    {
+        unsigned int ia = (s[3] + s[7]) >> 1;
+        if(ia < 0xff)
+        {
+            DWORD c = (s[4] << 24) | (s[5] << 16) | (s[0] << 8) | s[1]; // (v<<24)|(y2<<16)|(u<<8)|y1;
+            ia = (ia << 24) | (s[7] << 16) | (ia << 8) | s[3];
+
+            __m128i mc = _mm_unpacklo_epi8(_mm_cvtsi32_si128(c), zero);
+            __m128i md = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*d), zero);
+            __m128i ma = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(ia), zero), 1);
+            md = _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(md, bias), ma), 7);
+            md = _mm_adds_epi16(md, mc);
+            *d = (DWORD)_mm_cvtsi128_si32(_mm_packus_epi16(md, md));
+        }
+    }
+}
+
+typedef void (*AlphaBltYuy2RowFunc)(DWORD* d, const BYTE* s, int w);
+typedef void (*AlphaBltLumaRowFunc)(BYTE* d, const BYTE* s, int w, int black);
+typedef void (*AlphaBltChromaRowFunc)(BYTE* d, const BYTE* s, int pitch, int w, int plane, int black);
+typedef void (*AlphaBltLumaRow16Func)(WORD* d, const BYTE* s, int w, int black, int shift);
+typedef void (*AlphaBltChromaRow16Func)(WORD* d, const BYTE* s, int pitch, int w, int plane, int black, int shift);
+
+struct CAlphaBltFuncs
+{
+    AlphaBltYuy2RowFunc yuy2Row;
+    AlphaBltLumaRowFunc luma;
+    AlphaBltChromaRowFunc chroma;
+    AlphaBltLumaRow16Func luma16;
+    AlphaBltChromaRow16Func chroma16;
+};
+
+static const CAlphaBltFuncs& GetAlphaBltFuncs()
+{
+    static const CAlphaBltFuncs tiers[CCpuID::tier_count] =
+    {
+        {AlphaBltYuy2Row_c, AlphaBltLumaRow_c, AlphaBltChromaRow_c, AlphaBltLumaRow16_c, AlphaBltChromaRow16_c},
+        {AlphaBltYuy2Row_sse2, AlphaBltLumaRow_sse2, AlphaBltChromaRow_sse2, AlphaBltLumaRow16_sse2, AlphaBltChromaRow16_sse2},
+        {AlphaBltYuy2Row_sse2, AlphaBltLumaRow_avx2, AlphaBltChromaRow_avx2, AlphaBltLumaRow16_sse2, AlphaBltChromaRow16_sse2},
+        {AlphaBltYuy2Row_sse2, AlphaBltLumaRow_avx2, AlphaBltChromaRow_avx2, AlphaBltLumaRow16_sse2, AlphaBltChromaRow16_sse2},
+    };
+
+    return SelectTier(tiers);
 }
 
-#ifdef _WIN64
-// For CPUID usage
-#include "../dsutil/vd.h"
-#include <emmintrin.h>
-#endif
 STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 {
     ASSERT(pTarget);
@@ -401,6 +1029,10 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         {
             d = (BYTE*)dst.bits + dst.pitch * (rd.top - 1) + (rd.left * 8 >> 3);
         }
+        else if(dst.type == MSP_YUV420P10 || dst.type == MSP_YUV420P16)
+        {
+            d = (BYTE*)dst.bits + dst.pitch * (rd.top - 1) + (rd.left * 16 >> 3);
+        }
         else
         {
             return E_NOTIMPL;
@@ -409,6 +1041,10 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         dst.pitch = -dst.pitch;
     }
 
+    const CAlphaBltFuncs& f = GetAlphaBltFuncs();
+
+    int shift = dst.type == MSP_YUV420P10 ? 2 : 8;
+
     for(ptrdiff_t j = 0; j < h; j++, s += src.pitch, d += dst.pitch)
     {
         if(dst.type == MSP_RGBA)
@@ -490,92 +1126,15 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         }
         else if(dst.type == MSP_YUY2)
         {
-            unsigned int ia, c;
-#ifdef _WIN64
-            // CPUID from VDub
-            bool fSSE2 = !!(g_cpuid.m_flags & CCpuID::sse2);
-#endif
-            DWORD* d2 = (DWORD*)d;
-
-            BYTE* s2 = s;
-            BYTE* s2end = s2 + w * 4;
-            static const __int64 _8181 = 0x0080001000800010i64;
-
-            for(; s2 < s2end; s2 += 8, d2++)
-            {
-                ia = (s2[3] + s2[7]) >> 1;
-                if(ia < 0xff)
-                {
-                    c = (s2[4] << 24) | (s2[5] << 16) | (s2[0] << 8) | s2[1]; // (v<<24)|(y2<<16)|(u<<8)|y1;
-#ifdef _WIN64
-                    if(fSSE2)
-                    {
-                        ia = (ia << 24) | (s2[7] << 16) | (ia << 8) | s2[3];
-                        // SSE2
-                        __m128i mm_zero = _mm_setzero_si128();
-                        __m128i mm_8181 = _mm_move_epi64(_mm_cvtsi64_si128(_8181));
-                        __m128i mm_c = _mm_cvtsi32_si128(c);
-                        mm_c = _mm_unpacklo_epi8(mm_c, mm_zero);
-                        __m128i mm_d = _mm_cvtsi32_si128(*d2);
-                        mm_d = _mm_unpacklo_epi8(mm_d, mm_zero);
-                        __m128i mm_a = _mm_cvtsi32_si128(ia);
-                        mm_a = _mm_unpacklo_epi8(mm_a, mm_zero);
-                        mm_a = _mm_srli_epi16(mm_a, 1);
-                        mm_d = _mm_sub_epi16(mm_d, mm_8181);
-                        mm_d = _mm_mullo_epi16(mm_d, mm_a);
-                        mm_d = _mm_srai_epi16(mm_d, 7);
-                        mm_d = _mm_adds_epi16(mm_d, mm_c);
-                        mm_d = _mm_packus_epi16(mm_d, mm_d);
-                        *d2 = (DWORD)_mm_cvtsi128_si32(mm_d);
-                    }
-                    else
-                    {
-                        // YUY2 colorspace fix. rewrited from sse2 asm
-                        DWORD y1 = (DWORD)(((((*d2 & 0xff) - 0x10) * (s2[3] >> 1)) >> 7) + s2[1]) & 0xff;	// y1
-                        DWORD uu = (DWORD)((((((*d2 >> 8) & 0xff) - 0x80) * (ia >> 1)) >> 7) + s2[0]) & 0xff;	// u
-                        DWORD y2 = (DWORD)((((((*d2 >> 16) & 0xff) - 0x10) * (s2[7] >> 1)) >> 7) + s2[5]) & 0xff;	// y2
-                        DWORD vv = (DWORD)((((((*d2 >> 24) & 0xff) - 0x80) * (ia >> 1)) >> 7) + s2[4]) & 0xff;		// v
-                        *d2 = (y1) | (uu << 8) | (y2 << 16) | (vv << 24);
-                    }
-
-#else
-                    ia = (ia << 24) | (s2[7] << 16) | (ia << 8) | s2[3];
-                    __asm
-                    {
-                        mov			esi, s2
-                        mov			edi, d2
-                        pxor		mm0, mm0
-                        movq		mm1, _8181
-                        movd		mm2, c
-                        punpcklbw	mm2, mm0
-                        movd		mm3, [edi]
-                        punpcklbw	mm3, mm0
-                        movd		mm4, ia
-                        punpcklbw	mm4, mm0
-                        psrlw		mm4, 1
-                        psubsw		mm3, mm1
-                        pmullw		mm3, mm4
-                        psraw		mm3, 7
-                        paddsw		mm3, mm2
-                        packuswb	mm3, mm3
-                        movd		[edi], mm3
-                    };
-#endif
-                }
-            }
+            f.yuy2Row((DWORD*)d, s, w);
         }
         else if(dst.type == MSP_YV12 || dst.type == MSP_IYUV)
         {
-            BYTE* s2 = s;
-            BYTE* s2end = s2 + w * 4;
-            BYTE* d2 = d;
-            for(; s2 < s2end; s2 += 4, d2++)
-            {
-                if(s2[3] < 0xff)
-                {
-                    d2[0] = (((d2[0] - RANGE[0][3]) * s2[3]) >> 8) + s2[1];
-                }
-            }
+            f.luma(d, s, w, RANGE[0][3]);
+        }
+        else if(dst.type == MSP_YUV420P10 || dst.type == MSP_YUV420P16)
+        {
+            f.luma16((WORD*)d, s, w, RANGE[0][3], shift);
         }
         else
         {
@@ -585,9 +1144,11 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 
     dst.pitch = abs(dst.pitch);
 
-    if(dst.type == MSP_YV12 || dst.type == MSP_IYUV)
+    if(dst.type == MSP_YV12 || dst.type == MSP_IYUV
+       || dst.type == MSP_YUV420P10 || dst.type == MSP_YUV420P16)
     {
         int h2 = h / 2;
+        int left = dst.type == MSP_YV12 || dst.type == MSP_IYUV ? rd.left / 2 : rd.left / 2 * 2;
 
         if(!dst.pitchUV)
         {
@@ -596,9 +1157,7 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
 
         int sizep4 = dst.pitchUV * dst.h / 2;
 
-        BYTE* ss[2];
-        ss[0] = (BYTE*)src.bits + src.pitch * rs.top + rs.left * 4;
-        ss[1] = ss[0] + 4;
+        BYTE* ss = (BYTE*)src.bits + src.pitch * rs.top + rs.left * 4;
 
         if(!dst.bitsU || !dst.bitsV)
         {
@@ -614,44 +1173,30 @@ STDMETHODIMP CMemSubPic::AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget)
         }
 
         BYTE* dd[2];
-        dd[0] = dst.bitsU + dst.pitchUV * rd.top / 2 + rd.left / 2;
-        dd[1] = dst.bitsV + dst.pitchUV * rd.top / 2 + rd.left / 2;
+        dd[0] = dst.bitsU + dst.pitchUV * rd.top / 2 + left;
+        dd[1] = dst.bitsV + dst.pitchUV * rd.top / 2 + left;
 
         if(rd.top > rd.bottom)
         {
-            dd[0] = dst.bitsU + dst.pitchUV * (rd.top / 2 - 1) + rd.left / 2;
-            dd[1] = dst.bitsV + dst.pitchUV * (rd.top / 2 - 1) + rd.left / 2;
+            dd[0] = dst.bitsU + dst.pitchUV * (rd.top / 2 - 1) + left;
+            dd[1] = dst.bitsV + dst.pitchUV * (rd.top / 2 - 1) + left;
             dst.pitchUV = -dst.pitchUV;
         }
 
         for(ptrdiff_t i = 0; i < 2; i++)
         {
-            s = ss[i];
+            s = ss;
             d = dd[i];
-            BYTE* is = ss[1-i];
-            for(ptrdiff_t j = 0; j < h2; j++, s += src.pitch * 2, d += dst.pitchUV, is += src.pitch * 2)
+            for(ptrdiff_t j = 0; j < h2; j++, s += src.pitch * 2, d += dst.pitchUV)
             {
-                BYTE* s2 = s;
-                BYTE* s2end = s2 + w * 4;
-                BYTE* d2 = d;
-                BYTE* is2 = is;
-                for(; s2 < s2end; s2 += 8, d2++, is2 += 8)
-                {
-                    unsigned int ia = (s2[3] + s2[3+src.pitch] + is2[3] + is2[3+src.pitch]) >> 2;
-                    if(ia < 0xff)
-                    {
-                        *d2 = (((*d2 - RANGE[i+1][3]) * ia) >> 8) + ((s2[0] + s2[src.pitch]) >> 1);
-                    }
-                }
+                if(dst.type == MSP_YUV420P10 || dst.type == MSP_YUV420P16)
+                    f.chroma16((WORD*)d, s, src.pitch, w, (int)i, RANGE[i+1][3], shift);
+                else
+                    f.chroma(d, s, src.pitch, w, (int)i, RANGE[i+1][3]);
             }
         }
     }
 
-
-#ifndef _WIN64
-    __asm emms;
-#endif
-
     return S_OK;
 }
 
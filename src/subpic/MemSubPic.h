@@ -23,7 +23,8 @@
 
 #include "ISubPic.h"
 
-enum {MSP_RGB32, MSP_RGB24, MSP_RGB16, MSP_RGB15, MSP_YUY2, MSP_YV12, MSP_IYUV, MSP_AYUV, MSP_RGBA};
+// MSP_YUV420P10/16: 4:2:0 planar like MSP_IYUV with 16 bit samples, bpp 16, pitches in bytes
+enum {MSP_RGB32, MSP_RGB24, MSP_RGB16, MSP_RGB15, MSP_YUY2, MSP_YV12, MSP_IYUV, MSP_AYUV, MSP_RGBA, MSP_YUV420P10, MSP_YUV420P16};
 enum YCbCrMatrix
 {
     YCbCrMatrix_BT601,
@@ -46,6 +47,8 @@ class CMemSubPic : public ISubPicImpl
     int    m_eYCbCrMatrix;
     int     m_eYCbCrRange;
 
+    void ConvertRect(const CRect& r, bool fPlanar);
+
 protected:
     STDMETHODIMP_(void*) GetObject(); // returns SubPicDesc*
 
@@ -59,6 +62,7 @@ public:
     STDMETHODIMP ClearDirtyRect(DWORD color);
     STDMETHODIMP Lock(SubPicDesc& spd);
     STDMETHODIMP Unlock(RECT* pDirtyRect);
+    STDMETHODIMP UnlockEx(const CAtlList<CRect>& dirtyRects);
     STDMETHODIMP AlphaBlt(RECT* pSrc, RECT* pDst, SubPicDesc* pTarget);
 };
 
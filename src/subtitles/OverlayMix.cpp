@@ -2,6 +2,9 @@
 #include "stdafx.h"
 #include "OverlayMix.h"
 #include <math.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#include "../dsutil/vd.h"
 
 static __forceinline DWORD blendMixColor(DWORD* dst, DWORD* color, MOD_BLEND mod_blendMode) {
     if (mod_blendMode == BLEND_NORMAL) {
@@ -131,44 +134,6 @@ DWORD COverlayMixer::SafeSubstract(DWORD a, DWORD b)
 #endif
 }
 
-// Draw
-void COverlayMixer::Draw(bool Body)
-{
-    int h = Info->h;
-
-    byte* s = Info->s;
-    DWORD* dst = Info->dst;
-    int gran = (Info->sw[1] == 0xffffffff) ? Info->w : min(Info->sw[3] + 1 - Info->xo, Info->w);
-
-    if (Body)
-    {
-        while (h--)
-        {
-            for (int wt = 0; wt < gran; ++wt)
-                PixMix(&dst[wt], Color->getcolor1(wt, h), s[wt * 2], Info->mod_blendMode);
-            for (int wt = gran; wt < Info->w; ++wt)
-                PixMix(&dst[wt], Color->getcolor2(wt, h), s[wt * 2], Info->mod_blendMode);
-
-            s += 2 * Info->overlayp;
-            dst = (DWORD*)((char*)dst + Info->pitch);
-        }
-    }
-    else
-    {
-        s = Info->src;
-        while (h--)
-        {
-            for (int wt = 0; wt < gran; ++wt)
-                PixMix(&dst[wt], Color->getcolor1(wt, h), SafeSubstract(s[wt * 2 + 1], s[wt * 2]), Info->mod_blendMode);
-            for (int wt = gran; wt < Info->w; ++wt)
-                PixMix(&dst[wt], Color->getcolor2(wt, h), SafeSubstract(s[wt * 2 + 1], s[wt * 2]), Info->mod_blendMode);
-
-            s += 2 * Info->overlayp;
-            dst = (DWORD*)((char*)dst + Info->pitch);
-        }
-    }
-}
-
 void COverlayMixerSSE2::PixMix(DWORD* dst, DWORD color, BYTE alpha, MOD_BLEND mod_blendMode = BLEND_NORMAL)
 {
     BYTE palpha = ((alpha * (color >> 24)) >> 6) & 0xff;
@@ -199,45 +164,1084 @@ DWORD COverlayMixerSSE2::SafeSubstract(DWORD a, DWORD b)
     return (DWORD)_mm_cvtsi128_si32(rp);
 }
 
+// Row kernels
+//
+// DrawOverlay mixes the overlay one run of covered tiles at a time, in stages that are
+// specialized at compile time and picked once per call:
+// - coverage: the body, or the border minus the body, times the clip mask if there is one
+// - colors: one per pixel for gradients and images, blended with the destination for blend
+//   modes other than BLEND_NORMAL
+// - mix: the alpha blend itself, 4 pixels per iteration with SSE2 and 8 with AVX2
+// A solid color with BLEND_NORMAL needs no color stage, and without a clip the body
+// coverage is mixed straight from the overlay plane.
+
+// Finds the next run [x, end) of row y that lies in tiles with coverage, false at the end of the row
+static __forceinline bool NextTileRun(const RasterizerNfo* Info, int y, int& x, int& end)
+{
+    int w = Info->w;
+    if(x >= w) return false;
+
+    if(!Info->tiles)
+    {
+        end = w;
+        return true;
+    }
+
+    const BYTE* tiles = Info->tiles + ((Info->yo + y) >> OVERLAY_TILE_SHIFT) * Info->tilesPitch;
+    int ox = Info->xo + x, oxend = Info->xo + w;
+
+    while(!(tiles[ox >> OVERLAY_TILE_SHIFT] & Info->tileMask))
+    {
+        ox = (ox | (OVERLAY_TILE_SIZE - 1)) + 1;
+        if(ox >= oxend) return false;
+    }
+
+    int oend = ox;
+    do
+    {
+        oend = (oend | (OVERLAY_TILE_SIZE - 1)) + 1;
+    }
+    while(oend < oxend && (tiles[oend >> OVERLAY_TILE_SHIFT] & Info->tileMask));
+
+    x = ox - Info->xo;
+    end = min(oend, oxend) - Info->xo;
+    return true;
+}
+
+// NextTileRun with the runs cut around Info->hole
+static __forceinline bool NextOverlayRun(const RasterizerNfo* Info, int y, int& x, int& end)
+{
+    const CRect& hole = Info->hole;
+
+    for(;;)
+    {
+        if(!NextTileRun(Info, y, x, end)) return false;
+
+        if(y < hole.top || y >= hole.bottom || end <= hole.left || x >= hole.right) return true;
+
+        if(x < hole.left)
+        {
+            end = hole.left;
+            return true;
+        }
+
+        x = hole.right;
+    }
+}
+
+// Coverage
+
+static void SubtractRow_c(BYTE* dst, const BYTE* border, const BYTE* body, int n)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = border[i] > body[i] ? border[i] - body[i] : 0;
+}
+
+static void SubtractRow_sse2(BYTE* dst, const BYTE* border, const BYTE* body, int n)
+{
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i*)(border + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(body + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_subs_epu8(b, s));
+    }
+
+    SubtractRow_c(dst + i, border + i, body + i, n - i);
+}
+
+// dst = coverage * mask / 64, both 6 bit, truncated to a byte like the mixers always did
+static void ClipRow_c(BYTE* dst, const BYTE* cov, const BYTE* mask, int n)
+{
+    for(int i = 0; i < n; i++)
+        dst[i] = (BYTE)((cov[i] * mask[i]) >> 6);
+}
+
+static void ClipRow_sse2(BYTE* dst, const BYTE* cov, const BYTE* mask, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lowbyte = _mm_set1_epi16(0xff);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i*)(cov + i));
+        __m128i m = _mm_loadu_si128((const __m128i*)(mask + i));
+        __m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(m, zero)), 6), lowbyte);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(m, zero)), 6), lowbyte);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    ClipRow_c(dst + i, cov + i, mask + i, n - i);
+}
+
+// Mixing
+
+// One pixel the way COverlayMixerSSE2::PixMix mixes it: the color's alpha scales the
+// coverage, its rgb (blended already) is mixed in and the destination alpha is faded
+static __forceinline void MixPixel(DWORD* dst, DWORD color, BYTE alpha)
+{
+    DWORD a = ((alpha * (color >> 24)) >> 6) & 0xff;
+    DWORD ia = 256 - a;
+    a += 1;
+
+    DWORD d = *dst;
+    *dst = ((((d & 0x00ff00ff) * ia + (color & 0x00ff00ff) * a) & 0xff00ff00) >> 8)
+           | ((((d & 0x0000ff00) * ia + (color & 0x0000ff00) * a) & 0x00ff0000) >> 8)
+           | ((((d >> 8) & 0x00ff0000) * ia) & 0xff000000);
+}
+
+static void MixSolidRow_c(DWORD* dst, const BYTE* alpha, int n, DWORD color)
+{
+    for(int i = 0; i < n; i++)
+        MixPixel(&dst[i], color, alpha[i]);
+}
+
+static void MixColorRow_c(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    for(int i = 0; i < n; i++)
+        MixPixel(&dst[i], colors[i], alpha[i]);
+}
+
+// Pixels unpacked to 16-bit lanes: d destination, s color rgb with zero alpha, ca the
+// color's alpha and a the coverage, each repeated over the four lanes of its pixel.
+// Every product fits 16 bits unsigned, (256 - pa) + (pa + 1) = 257 and 255 * 257 < 65536.
+static __forceinline __m128i MixPixels_sse2(__m128i d, __m128i s, __m128i ca, __m128i a)
+{
+    __m128i pa = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(a, ca), 6), _mm_set1_epi16(0xff));
+    __m128i r = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(256), pa)),
+                              _mm_mullo_epi16(s, _mm_add_epi16(pa, _mm_set1_epi16(1))));
+    return _mm_srli_epi16(r, 8);
+}
+
+static __forceinline __m256i MixPixels_avx2(__m256i d, __m256i s, __m256i ca, __m256i a)
+{
+    __m256i pa = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(a, ca), 6), _mm256_set1_epi16(0xff));
+    __m256i r = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(256), pa)),
+                                 _mm256_mullo_epi16(s, _mm256_add_epi16(pa, _mm256_set1_epi16(1))));
+    return _mm256_srli_epi16(r, 8);
+}
+
+// Coverage of pixels i..i+3 as a 16-bit lane pair per dword, ready for unpacklo/hi_epi32
+static __forceinline __m128i LoadAlpha4_sse2(const BYTE* alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(*(const int*)alpha), zero), zero);
+    return _mm_or_si128(a, _mm_slli_epi32(a, 16));
+}
+
+// The same for pixels i..i+7, 0-3 in the low and 4-7 in the high lane like the pixels
+static __forceinline __m256i LoadAlpha8_avx2(const BYTE* alpha)
+{
+    __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)alpha));
+    return _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+}
+
+// A solid color at a constant coverage mixes every pixel with the same factors: s is the
+// color's rgb times (pa + 1) and ia is 256 - pa, pa as in MixPixels_sse2
+static __forceinline __m128i MixConst4_sse2(__m128i d, __m128i s, __m128i ia)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia), s), 8);
+    __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia), s), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static __forceinline __m256i MixConst8_avx2(__m256i d, __m256i s, __m256i ia)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), ia), s), 8);
+    __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), ia), s), 8);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+// The mixed alpha of color at coverage alpha, 0 leaves the destination as it is
+static __forceinline DWORD MixConstAlpha(DWORD color, BYTE alpha)
+{
+    return ((alpha * (color >> 24)) >> 6) & 0xff;
+}
+
+static void MixConstRow_c(DWORD* dst, int n, DWORD color, BYTE alpha)
+{
+    if(!MixConstAlpha(color, alpha)) return;
+
+    for(int i = 0; i < n; i++)
+        MixPixel(&dst[i], color, alpha);
+}
+
+static void MixConstRow_sse2(DWORD* dst, int n, DWORD color, BYTE alpha)
+{
+    DWORD pa = MixConstAlpha(color, alpha);
+    if(!pa) return;
+
+    const __m128i s = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32(color & 0xffffff), _mm_setzero_si128()), _mm_set1_epi16((short)(pa + 1)));
+    const __m128i ia = _mm_set1_epi16((short)(256 - pa));
+
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), MixConst4_sse2(d, s, ia));
+    }
+
+    MixConstRow_c(dst + i, n - i, color, alpha);
+}
+
+static void MixConstRow_avx2(DWORD* dst, int n, DWORD color, BYTE alpha)
+{
+    DWORD pa = MixConstAlpha(color, alpha);
+    if(!pa) return;
+
+    const __m256i s = _mm256_mullo_epi16(_mm256_unpacklo_epi8(_mm256_set1_epi32(color & 0xffffff), _mm256_setzero_si256()), _mm256_set1_epi16((short)(pa + 1)));
+    const __m256i ia = _mm256_set1_epi16((short)(256 - pa));
+
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), MixConst8_avx2(d, s, ia));
+    }
+
+    MixConstRow_sse2(dst + i, n - i, color, alpha);
+}
+
+static void MixSolidRow_sse2(DWORD* dst, const BYTE* alpha, int n, DWORD color)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(color & 0xffffff), zero);
+    const __m128i ca = _mm_set1_epi16((short)(color >> 24));
+
+    // Fully covered pixels, the inside of opaque boxes and most of the glyphs
+    DWORD pa = MixConstAlpha(color, 0x40);
+    const __m128i sfull = _mm_mullo_epi16(s, _mm_set1_epi16((short)(pa + 1)));
+    const __m128i iafull = _mm_set1_epi16((short)(256 - pa));
+
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        // Transparent pixels are left alone by the mix anyway
+        int a4 = *(const int*)(alpha + i);
+        if(!a4) continue;
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+
+        if(a4 == 0x40404040)
+        {
+            _mm_storeu_si128((__m128i*)(dst + i), MixConst4_sse2(d, sfull, iafull));
+            continue;
+        }
+
+        __m128i a = LoadAlpha4_sse2(alpha + i);
+        __m128i lo = MixPixels_sse2(_mm_unpacklo_epi8(d, zero), s, ca, _mm_unpacklo_epi32(a, a));
+        __m128i hi = MixPixels_sse2(_mm_unpackhi_epi8(d, zero), s, ca, _mm_unpackhi_epi32(a, a));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    MixSolidRow_c(dst + i, alpha + i, n - i, color);
+}
+
+// Mixes 4 packed pixels d with the rgb of s at the alpha of c and the coverage a of LoadAlpha4_sse2
+static __forceinline __m128i MixColors4_sse2(__m128i d, __m128i s, __m128i c, __m128i a)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+
+    __m128i clo = _mm_unpacklo_epi8(c, zero);
+    __m128i chi = _mm_unpackhi_epi8(c, zero);
+    __m128i lo = MixPixels_sse2(_mm_unpacklo_epi8(d, zero), _mm_and_si128(_mm_unpacklo_epi8(s, zero), rgb),
+                                _mm_shufflehi_epi16(_mm_shufflelo_epi16(clo, 0xff), 0xff), _mm_unpacklo_epi32(a, a));
+    __m128i hi = MixPixels_sse2(_mm_unpackhi_epi8(d, zero), _mm_and_si128(_mm_unpackhi_epi8(s, zero), rgb),
+                                _mm_shufflehi_epi16(_mm_shufflelo_epi16(chi, 0xff), 0xff), _mm_unpackhi_epi32(a, a));
+    return _mm_packus_epi16(lo, hi);
+}
+
+static void MixColorRow_sse2(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        if(!*(const int*)(alpha + i)) continue;
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(colors + i));
+        _mm_storeu_si128((__m128i*)(dst + i), MixColors4_sse2(d, c, c, LoadAlpha4_sse2(alpha + i)));
+    }
+
+    MixColorRow_c(dst + i, alpha + i, colors + i, n - i);
+}
+
+static void MixSolidRow_avx2(DWORD* dst, const BYTE* alpha, int n, DWORD color)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i s = _mm256_unpacklo_epi8(_mm256_set1_epi32(color & 0xffffff), zero);
+    const __m256i ca = _mm256_set1_epi16((short)(color >> 24));
+
+    DWORD pa = MixConstAlpha(color, 0x40);
+    const __m256i sfull = _mm256_mullo_epi16(s, _mm256_set1_epi16((short)(pa + 1)));
+    const __m256i iafull = _mm256_set1_epi16((short)(256 - pa));
+
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        __int64 a8 = *(const __int64*)(alpha + i);
+        if(!a8) continue;
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+
+        if(a8 == 0x4040404040404040LL)
+        {
+            _mm256_storeu_si256((__m256i*)(dst + i), MixConst8_avx2(d, sfull, iafull));
+            continue;
+        }
+
+        __m256i a = LoadAlpha8_avx2(alpha + i);
+        __m256i lo = MixPixels_avx2(_mm256_unpacklo_epi8(d, zero), s, ca, _mm256_unpacklo_epi32(a, a));
+        __m256i hi = MixPixels_avx2(_mm256_unpackhi_epi8(d, zero), s, ca, _mm256_unpackhi_epi32(a, a));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    MixSolidRow_sse2(dst + i, alpha + i, n - i, color);
+}
+
+static void MixColorRow_avx2(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i rgb = _mm256_set_epi16(0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1, 0, -1, -1, -1);
+
+    int i = 0;
+    for(; i + 8 <= n; i += 8)
+    {
+        if(!*(const __int64*)(alpha + i)) continue;
+
+        __m256i a = LoadAlpha8_avx2(alpha + i);
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(colors + i));
+
+        __m256i clo = _mm256_unpacklo_epi8(c, zero);
+        __m256i chi = _mm256_unpackhi_epi8(c, zero);
+        __m256i lo = MixPixels_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_and_si256(clo, rgb),
+                                    _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(clo, 0xff), 0xff), _mm256_unpacklo_epi32(a, a));
+        __m256i hi = MixPixels_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_and_si256(chi, rgb),
+                                    _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(chi, 0xff), 0xff), _mm256_unpackhi_epi32(a, a));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    MixColorRow_sse2(dst + i, alpha + i, colors + i, n - i);
+}
+
+// AVX-512BW, 16 pixels per iteration laid out as 4 per 128-bit lane like the AVX2 rows
+
+static __forceinline __m512i MixPixels_avx512(__m512i d, __m512i s, __m512i ca, __m512i a)
+{
+    __m512i pa = _mm512_and_si512(_mm512_srli_epi16(_mm512_mullo_epi16(a, ca), 6), _mm512_set1_epi16(0xff));
+    __m512i r = _mm512_add_epi16(_mm512_mullo_epi16(d, _mm512_sub_epi16(_mm512_set1_epi16(256), pa)),
+                                 _mm512_mullo_epi16(s, _mm512_add_epi16(pa, _mm512_set1_epi16(1))));
+    return _mm512_srli_epi16(r, 8);
+}
+
+static __forceinline __m512i MixConst16_avx512(__m512i d, __m512i s, __m512i ia)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i lo = _mm512_srli_epi16(_mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpacklo_epi8(d, zero), ia), s), 8);
+    __m512i hi = _mm512_srli_epi16(_mm512_add_epi16(_mm512_mullo_epi16(_mm512_unpackhi_epi8(d, zero), ia), s), 8);
+    return _mm512_packus_epi16(lo, hi);
+}
+
+static __forceinline __m512i LoadAlpha16_avx512(__m128i alpha)
+{
+    __m512i a = _mm512_cvtepu8_epi32(alpha);
+    return _mm512_or_si512(a, _mm512_slli_epi32(a, 16));
+}
 
-template<class T> void COverlayAlphaMixer<T>::Draw(bool Body)
+static void MixConstRow_avx512(DWORD* dst, int n, DWORD color, BYTE alpha)
+{
+    DWORD pa = MixConstAlpha(color, alpha);
+    if(!pa) return;
+
+    const __m512i s = _mm512_mullo_epi16(_mm512_unpacklo_epi8(_mm512_set1_epi32(color & 0xffffff), _mm512_setzero_si512()), _mm512_set1_epi16((short)(pa + 1)));
+    const __m512i ia = _mm512_set1_epi16((short)(256 - pa));
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m512i d = _mm512_loadu_si512(dst + i);
+        _mm512_storeu_si512(dst + i, MixConst16_avx512(d, s, ia));
+    }
+
+    MixConstRow_avx2(dst + i, n - i, color, alpha);
+}
+
+static void MixSolidRow_avx512(DWORD* dst, const BYTE* alpha, int n, DWORD color)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i s = _mm512_unpacklo_epi8(_mm512_set1_epi32(color & 0xffffff), zero);
+    const __m512i ca = _mm512_set1_epi16((short)(color >> 24));
+
+    DWORD pa = MixConstAlpha(color, 0x40);
+    const __m512i sfull = _mm512_mullo_epi16(s, _mm512_set1_epi16((short)(pa + 1)));
+    const __m512i iafull = _mm512_set1_epi16((short)(256 - pa));
+    const __m128i full = _mm_set1_epi8(0x40);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i a16 = _mm_loadu_si128((const __m128i*)(alpha + i));
+        if(_mm_testz_si128(a16, a16)) continue;
+
+        __m512i d = _mm512_loadu_si512(dst + i);
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(a16, full)) == 0xffff)
+        {
+            _mm512_storeu_si512(dst + i, MixConst16_avx512(d, sfull, iafull));
+            continue;
+        }
+
+        __m512i a = LoadAlpha16_avx512(a16);
+        __m512i lo = MixPixels_avx512(_mm512_unpacklo_epi8(d, zero), s, ca, _mm512_unpacklo_epi32(a, a));
+        __m512i hi = MixPixels_avx512(_mm512_unpackhi_epi8(d, zero), s, ca, _mm512_unpackhi_epi32(a, a));
+        _mm512_storeu_si512(dst + i, _mm512_packus_epi16(lo, hi));
+    }
+
+    MixSolidRow_avx2(dst + i, alpha + i, n - i, color);
+}
+
+static void MixColorRow_avx512(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i rgb = _mm512_set1_epi64(0x0000ffffffffffffLL);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i a16 = _mm_loadu_si128((const __m128i*)(alpha + i));
+        if(_mm_testz_si128(a16, a16)) continue;
+
+        __m512i a = LoadAlpha16_avx512(a16);
+        __m512i d = _mm512_loadu_si512(dst + i);
+        __m512i c = _mm512_loadu_si512(colors + i);
+
+        __m512i clo = _mm512_unpacklo_epi8(c, zero);
+        __m512i chi = _mm512_unpackhi_epi8(c, zero);
+        __m512i lo = MixPixels_avx512(_mm512_unpacklo_epi8(d, zero), _mm512_and_si512(clo, rgb),
+                                      _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(clo, 0xff), 0xff), _mm512_unpacklo_epi32(a, a));
+        __m512i hi = MixPixels_avx512(_mm512_unpackhi_epi8(d, zero), _mm512_and_si512(chi, rgb),
+                                      _mm512_shufflehi_epi16(_mm512_shufflelo_epi16(chi, 0xff), 0xff), _mm512_unpackhi_epi32(a, a));
+        _mm512_storeu_si512(dst + i, _mm512_packus_epi16(lo, hi));
+    }
+
+    MixColorRow_avx2(dst + i, alpha + i, colors + i, n - i);
+}
+
+// Blend modes, mixed in the same pass: the color's rgb is replaced by its blend with
+// the destination before the mix, its alpha stays
+
+template<MOD_BLEND mode> static void MixBlendRow_c(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    for(int i = 0; i < n; i++)
+    {
+        DWORD c = colors[i] & 0xffffff;
+        MixPixel(&dst[i], (colors[i] & 0xff000000) | blendMixColor(&dst[i], &c, mode), alpha[i]);
+    }
+}
+
+// div_255_fast on 16-bit lanes, x <= 255 * 255
+static __forceinline __m128i Div255_sse2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(1));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// The channels of d and c multiplied and divided by 255, the screen blend with fInverse
+static __forceinline __m128i MulDiv255_sse2(__m128i d, __m128i c, bool fInverse)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ff = _mm_set1_epi8(-1);
+
+    if(fInverse)
+    {
+        d = _mm_xor_si128(d, ff);
+        c = _mm_xor_si128(c, ff);
+    }
+
+    __m128i lo = Div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(c, zero)));
+    __m128i hi = Div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(c, zero)));
+    __m128i r = _mm_packus_epi16(lo, hi);
+
+    return fInverse ? _mm_xor_si128(r, ff) : r;
+}
+
+// Twice the product of the channels of d and c divided by 255, or its screen version
+// for the channels of d >= 0x80 (select is 0xff there)
+static __forceinline __m128i Overlay_sse2(__m128i d, __m128i c, __m128i select)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    // 255 - x inverts both factors and the result, as in the scalar code
+    __m128i di = _mm_xor_si128(d, select), ci = _mm_xor_si128(c, select);
+    __m128i lo = Div255_sse2(_mm_mullo_epi16(_mm_unpacklo_epi8(di, zero), _mm_unpacklo_epi8(ci, zero)));
+    __m128i hi = Div255_sse2(_mm_mullo_epi16(_mm_unpackhi_epi8(di, zero), _mm_unpackhi_epi8(ci, zero)));
+    lo = _mm_add_epi16(lo, lo);
+    hi = _mm_add_epi16(hi, hi);
+
+    // One factor is below 0x80, so the pack doesn't saturate
+    __m128i r = _mm_packus_epi16(lo, hi);
+    return _mm_xor_si128(r, select);
+}
+
+// Blends 4 packed pixels, the alpha bytes of the result are undefined
+template<MOD_BLEND mode> static __forceinline __m128i Blend4_sse2(__m128i d, __m128i c)
+{
+    switch(mode)
+    {
+    case BLEND_OVERLAY: return Overlay_sse2(d, c, _mm_cmplt_epi8(d, _mm_setzero_si128()));
+    case BLEND_ADD: return _mm_adds_epu8(c, d);
+    case BLEND_SUBSTRACT: return _mm_subs_epu8(d, c);
+    case BLEND_MULTIPLY: return MulDiv255_sse2(d, c, false);
+    case BLEND_SCREEN: return MulDiv255_sse2(d, c, true);
+    case BLEND_DIFFERENCE: return _mm_or_si128(_mm_subs_epu8(c, d), _mm_subs_epu8(d, c));
+    case BLEND_SUBSTRACT_REVERSE: return _mm_subs_epu8(c, d);
+    case BLEND_SUBSTRACT_INVERSE: return _mm_subs_epu8(c, _mm_xor_si128(d, _mm_set1_epi8(-1)));
+    default: return c;
+    }
+}
+
+template<MOD_BLEND mode> static void MixBlendRow_sse2(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n)
+{
+    int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        if(!*(const int*)(alpha + i)) continue;
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i c = _mm_loadu_si128((const __m128i*)(colors + i));
+        _mm_storeu_si128((__m128i*)(dst + i), MixColors4_sse2(d, Blend4_sse2<mode>(d, c), c, LoadAlpha4_sse2(alpha + i)));
+    }
+
+    MixBlendRow_c<mode>(dst + i, alpha + i, colors + i, n - i);
+}
+
+COverlayRowFuncs MakeOverlayRowFuncs(MOD_BLEND mode, CCpuID::tier_t tier)
+{
+    COverlayRowFuncs f;
+
+    switch(tier)
+    {
+    case CCpuID::tier_avx512:
+        f.subtract = SubtractRow_sse2;
+        f.clip = ClipRow_sse2;
+        f.mixSolid = MixSolidRow_avx512;
+        f.mixColors = MixColorRow_avx512;
+        f.mixConst = MixConstRow_avx512;
+        break;
+    case CCpuID::tier_avx2:
+        f.subtract = SubtractRow_sse2;
+        f.clip = ClipRow_sse2;
+        f.mixSolid = MixSolidRow_avx2;
+        f.mixColors = MixColorRow_avx2;
+        f.mixConst = MixConstRow_avx2;
+        break;
+    case CCpuID::tier_sse2:
+        f.subtract = SubtractRow_sse2;
+        f.clip = ClipRow_sse2;
+        f.mixSolid = MixSolidRow_sse2;
+        f.mixColors = MixColorRow_sse2;
+        f.mixConst = MixConstRow_sse2;
+        break;
+    default:
+        f.subtract = SubtractRow_c;
+        f.clip = ClipRow_c;
+        f.mixSolid = MixSolidRow_c;
+        f.mixColors = MixColorRow_c;
+        f.mixConst = MixConstRow_c;
+        break;
+    }
+
+    f.fBlend = mode != BLEND_NORMAL;
+
+    bool fSSE2 = tier >= CCpuID::tier_sse2;
+
+#define BLEND_ROW(m) (fSSE2 ? MixBlendRow_sse2<m> : MixBlendRow_c<m>)
+    switch(mode)
+    {
+    case BLEND_OVERLAY: f.mixColors = BLEND_ROW(BLEND_OVERLAY); break;
+    case BLEND_ADD: f.mixColors = BLEND_ROW(BLEND_ADD); break;
+    case BLEND_SUBSTRACT: f.mixColors = BLEND_ROW(BLEND_SUBSTRACT); break;
+    case BLEND_MULTIPLY: f.mixColors = BLEND_ROW(BLEND_MULTIPLY); break;
+    case BLEND_SCREEN: f.mixColors = BLEND_ROW(BLEND_SCREEN); break;
+    case BLEND_DIFFERENCE: f.mixColors = BLEND_ROW(BLEND_DIFFERENCE); break;
+    case BLEND_SUBSTRACT_REVERSE: f.mixColors = BLEND_ROW(BLEND_SUBSTRACT_REVERSE); break;
+    case BLEND_SUBSTRACT_INVERSE: f.mixColors = BLEND_ROW(BLEND_SUBSTRACT_INVERSE); break;
+    default: break;
+    }
+#undef BLEND_ROW
+
+    return f;
+}
+
+// Dispatch table of every blend mode for the tier g_cpuid settled on, filled once on first use
+struct COverlayRowFuncTable
+{
+    COverlayRowFuncs modes[BLEND_SUBSTRACT_INVERSE + 1];
+
+    COverlayRowFuncTable()
+    {
+        for(int m = BLEND_NORMAL; m <= BLEND_SUBSTRACT_INVERSE; m++)
+            modes[m] = MakeOverlayRowFuncs((MOD_BLEND)m, g_cpuid.m_tier);
+    }
+};
+
+static const COverlayRowFuncs& GetOverlayRowFuncs(MOD_BLEND mode)
+{
+    static const COverlayRowFuncTable table;
+    return table.modes[(unsigned)mode <= BLEND_SUBSTRACT_INVERSE ? mode : BLEND_NORMAL];
+}
+
+// Color sources, Row fills colors[x, end) of the row the getters call y and Mix mixes
+// the run [x, end) of dst with the coverage cov
+
+template<class Color>
+static __forceinline void MixColorRun(Color& color, const COverlayRowFuncs& f, DWORD* dst, const BYTE* cov, DWORD* colors, int x, int end, int gran, int y)
+{
+    color.Row(colors, x, end, gran, y);
+    f.mixColors(dst + x, cov + x, colors + x, end - x);
+}
+
+// Solid colors, c1 left of the karaoke switch point and c2 right of it
+struct COverlaySolidColor
+{
+    DWORD c1, c2;
+
+    COverlaySolidColor(DWORD c1, DWORD c2) : c1(c1), c2(c2) {}
+
+    void Row(DWORD* colors, int x, int end, int gran, int y)
+    {
+        for(int i = x, iend = min(gran, end); i < iend; i++) colors[i] = c1;
+        for(int i = max(gran, x); i < end; i++) colors[i] = c2;
+    }
+
+    void Mix(const COverlayRowFuncs& f, DWORD* dst, const BYTE* cov, DWORD* colors, int x, int end, int gran, int y)
+    {
+        // Without a blend mode the colors don't depend on dst and need no row of their own
+        if(f.fBlend)
+        {
+            MixColorRun(*this, f, dst, cov, colors, x, end, gran, y);
+            return;
+        }
+
+        int split = max(x, min(gran, end));
+        if(split > x) f.mixSolid(dst + x, cov + x, split - x, c1);
+        if(end > split) f.mixSolid(dst + split, cov + split, end - split, c2);
+    }
+};
+
+#ifdef _VSMOD
+static __forceinline DWORD GradientPixel(const int* v, int fade)
+{
+    int c[4];
+    for(int j = 0; j < 4; j++) c[j] = max(0, min(v[j] >> 16, 0xff));
+
+    return ((((0xff - c[3]) * fade) >> 8) << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
+}
+
+// Fills colors[x, end) with the \vc/\va gradient i of row y like MOD_GRADIENT::getmixcolor.
+// Along a row the bilinear blend is linear in x, so each channel is a 16.16 fixed point
+// start value plus a step per pixel, within 1 LSB of the double math.
+template<bool fSSE2>
+static void GradientRow(const MOD_GRADIENT& grad, DWORD* colors, int x, int end, int y, int i)
+{
+    double fy = (double)y / (double)grad.height;
+    int tx = x + grad.xoffset;
+
+    int v[4], dv[4];
+    for(int j = 0; j < 4; j++)
+    {
+        double c[4];
+        for(int k = 0; k < 4; k++) c[k] = j < 3 ? (grad.color[i][k] >> (8 * j)) & 0xff : grad.alpha[i][k];
+
+        double left = c[0] * fy + c[2] * (1 - fy);
+        double slope = ((c[1] - c[0]) * fy + (c[3] - c[2]) * (1 - fy)) / (double)grad.width;
+
+        v[j] = (int)floor((left + slope * tx) * 65536 + 0.5);
+        dv[j] = (int)floor(slope * 65536 + 0.5);
+    }
+
+    int fade = 0xff - grad.fadalpha;
+
+    if(fSSE2)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ff = _mm_set1_epi16(0xff);
+        const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i fade16 = _mm_set1_epi16((short)fade);
+
+        __m128i step = _mm_setr_epi32(dv[0], dv[1], dv[2], dv[3]);
+        __m128i v0 = _mm_setr_epi32(v[0], v[1], v[2], v[3]);
+        __m128i v1 = _mm_add_epi32(v0, step);
+        __m128i v2 = _mm_add_epi32(v1, step);
+        __m128i v3 = _mm_add_epi32(v2, step);
+        step = _mm_slli_epi32(step, 2);
+
+        for(; x + 4 <= end; x += 4)
+        {
+            __m128i p01 = _mm_packs_epi32(_mm_srai_epi32(v0, 16), _mm_srai_epi32(v1, 16));
+            __m128i p23 = _mm_packs_epi32(_mm_srai_epi32(v2, 16), _mm_srai_epi32(v3, 16));
+            p01 = _mm_min_epi16(_mm_max_epi16(p01, zero), ff);
+            p23 = _mm_min_epi16(_mm_max_epi16(p23, zero), ff);
+
+            // The alpha lanes become (0xff - al) * fade >> 8
+            __m128i a01 = _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(ff, p01), fade16), 8);
+            __m128i a23 = _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(ff, p23), fade16), 8);
+            p01 = _mm_or_si128(_mm_and_si128(p01, rgb), _mm_andnot_si128(rgb, a01));
+            p23 = _mm_or_si128(_mm_and_si128(p23, rgb), _mm_andnot_si128(rgb, a23));
+
+            _mm_storeu_si128((__m128i*)(colors + x), _mm_packus_epi16(p01, p23));
+
+            v0 = _mm_add_epi32(v0, step);
+            v1 = _mm_add_epi32(v1, step);
+            v2 = _mm_add_epi32(v2, step);
+            v3 = _mm_add_epi32(v3, step);
+        }
+
+        _mm_storeu_si128((__m128i*)v, v0);
+    }
+
+    for(; x < end; x++)
+    {
+        colors[x] = GradientPixel(v, fade);
+        for(int j = 0; j < 4; j++) v[j] += dv[j];
+    }
+}
+
+// Samples texels [0, n) of the texture rows r1 and r2 (the next one) like getmixcolor: each
+// row blended with the texel left of it by sx / 8, then r2 over r1 by sy / 8 and the alpha
+// scaled by the image alpha and fade
+template<bool fSSE2>
+static void TextureSpan(DWORD* colors, const DWORD* r1, const DWORD* r2, int n, int sx, int sy, int alpha, int fade)
+{
+    int i = 0;
+
+    if(fSSE2)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i wx1 = _mm_set1_epi16((short)(8 - sx)), wx0 = _mm_set1_epi16((short)sx);
+        const __m128i wy2 = _mm_set1_epi16((short)sy), wy1 = _mm_set1_epi16((short)(8 - sy));
+        const __m128i alpha16 = _mm_set1_epi16((short)alpha), fade16 = _mm_set1_epi16((short)fade);
+
+        for(; i + 4 <= n; i += 4)
+        {
+            __m128i p1 = _mm_loadu_si128((const __m128i*)(r1 + i)), q1 = _mm_loadu_si128((const __m128i*)(r1 + i - 1));
+            __m128i p2 = _mm_loadu_si128((const __m128i*)(r2 + i)), q2 = _mm_loadu_si128((const __m128i*)(r2 + i - 1));
+
+            __m128i v[2];
+            for(int k = 0; k < 2; k++)
+            {
+                __m128i a1 = k ? _mm_unpackhi_epi8(p1, zero) : _mm_unpacklo_epi8(p1, zero);
+                __m128i b1 = k ? _mm_unpackhi_epi8(q1, zero) : _mm_unpacklo_epi8(q1, zero);
+                __m128i a2 = k ? _mm_unpackhi_epi8(p2, zero) : _mm_unpacklo_epi8(p2, zero);
+                __m128i b2 = k ? _mm_unpackhi_epi8(q2, zero) : _mm_unpacklo_epi8(q2, zero);
+
+                __m128i x1 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a1, wx1), _mm_mullo_epi16(b1, wx0)), 3);
+                __m128i x2 = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a2, wx1), _mm_mullo_epi16(b2, wx0)), 3);
+                __m128i c = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(x2, wy2), _mm_mullo_epi16(x1, wy1)), 3);
+
+                __m128i a = Div255_sse2(_mm_mullo_epi16(Div255_sse2(_mm_mullo_epi16(c, alpha16)), fade16));
+                v[k] = _mm_or_si128(_mm_and_si128(c, rgb), _mm_andnot_si128(rgb, a));
+            }
+
+            _mm_storeu_si128((__m128i*)(colors + i), _mm_packus_epi16(v[0], v[1]));
+        }
+    }
+
+    for(; i < n; i++)
+    {
+        DWORD c = 0;
+        for(int j = 0; j < 32; j += 8)
+        {
+            DWORD x1 = (((r1[i] >> j) & 0xff) * (8 - sx) + ((r1[i - 1] >> j) & 0xff) * sx) >> 3;
+            DWORD x2 = (((r2[i] >> j) & 0xff) * (8 - sx) + ((r2[i - 1] >> j) & 0xff) * sx) >> 3;
+            c |= ((x2 * sy + x1 * (8 - sy)) >> 3) << j;
+        }
+
+        DWORD a = div_255_fast(div_255_fast((c >> 24) * alpha) * fade);
+        colors[i] = (a << 24) | (c & 0xffffff);
+    }
+}
+
+// Fills colors[x, end) with the \1img texture i of row y like MOD_GRADIENT::getmixcolor,
+// in runs that don't cross the right edge of the texture
+template<bool fSSE2>
+static void TextureRow(const MOD_GRADIENT& grad, DWORD* colors, int x, int end, int y, int i)
+{
+    const MOD_PNGIMAGE& img = grad.b_images[i];
+    int w = img.width, h = img.height;
+
+    int tx = (x + grad.xoffset + img.xoffset) % w;
+    if(tx < 0) tx += w;
+    int ty = (y + img.yoffset + grad.clipDiff) % h;
+    if(ty < 0) ty += h;
+
+    // The last row is blended with itself, that is not at all
+    const DWORD* r1 = img.texture + img.texturePitch * ty + 1;
+    const DWORD* r2 = ty < h - 1 ? r1 + img.texturePitch : r1;
+
+    int sx = grad.subpixx, sy = grad.subpixy;
+    int alpha = img.alpha, fade = 0xff - grad.fadalpha;
+
+    while(x < end)
+    {
+        if(tx == w) tx = 0;
+
+        // getmixcolor swaps the row weights of the first column
+        if(tx == 0 && r2 != r1)
+        {
+            TextureSpan<fSSE2>(colors + x, r1, r2, 1, sx, 8 - sy, alpha, fade);
+            x++;
+            tx++;
+            continue;
+        }
+
+        int n = min(end - x, w - tx);
+        TextureSpan<fSSE2>(colors + x, r1 + tx, r2 + tx, n, sx, sy, alpha, fade);
+        x += n;
+        tx += n;
+    }
+}
+
+typedef void (*GradientRowFunc)(const MOD_GRADIENT& grad, DWORD* colors, int x, int end, int y, int i);
+
+struct CGradientRowFuncs
+{
+    GradientRowFunc gradient, texture;
+};
+
+static const CGradientRowFuncs& GetGradientRowFuncs()
+{
+    static const CGradientRowFuncs tiers[CCpuID::tier_count] =
+    {
+        {GradientRow<false>, TextureRow<false>},
+        {GradientRow<true>, TextureRow<true>},
+        {GradientRow<true>, TextureRow<true>},
+        {GradientRow<true>, TextureRow<true>},
+    };
+
+    return SelectTier(tiers);
+}
+
+// Gradients and images a row at a time, plain colors pixel by pixel
+struct COverlayGradientColor
+{
+    MOD_GRADIENT& grad;
+    int typ;
+    const CGradientRowFuncs& fill;
+
+    COverlayGradientColor(MOD_GRADIENT& grad, int typ) : grad(grad), typ(typ), fill(GetGradientRowFuncs()) {}
+
+    void Span(DWORD* colors, int x, int end, int y, int i)
+    {
+        if(grad.mode[i] == 1 && grad.width > 0 && grad.height > 0)
+        {
+            if(x < end) fill.gradient(grad, colors, x, end, y, i);
+            return;
+        }
+        if(grad.mode[i] == 2 && grad.b_images[i].texture && grad.b_images[i].width > 0 && grad.b_images[i].height > 0)
+        {
+            if(x < end) fill.texture(grad, colors, x, end, y, i);
+            return;
+        }
+
+        for(; x < end; x++) colors[x] = grad.getmixcolor(x, y, i);
+    }
+
+    void Row(DWORD* colors, int x, int end, int gran, int y)
+    {
+        Span(colors, x, min(gran, end), y, typ);
+        Span(colors, max(gran, x), end, y, 1);
+    }
+
+    void Mix(const COverlayRowFuncs& f, DWORD* dst, const BYTE* cov, DWORD* colors, int x, int end, int gran, int y)
+    {
+        MixColorRun(*this, f, dst, cov, colors, x, end, gran, y);
+    }
+};
+#endif
+
+// Clip sources, they scale cov[x, end) by the clip mask (0 - 0x40) of the row the getters call y
+
+struct COverlayNoClip
+{
+    enum {none = 1};
+
+    void Row(BYTE* dst, const BYTE* cov, int x, int end, int y, ClipRowFunc clip) {}
+};
+
+// Scales cov[0, n) by a mask value that is the same for every pixel
+static void ClipRowConst(BYTE* dst, const BYTE* cov, BYTE a, int n)
+{
+    if(a == 0) memset(dst, 0, n);
+    else if(a == 0x40) {if(dst != cov) memcpy(dst, cov, n);}
+    else for(int i = 0; i < n; i++) dst[i] = (BYTE)((cov[i] * a) >> 6);
+}
+
+// The mask under the overlay, MOD_MOVEVC::GetAlphaValue (or COverlayAlpha) without \movevc.
+// Only the part of the row inside the bounding box of the mask goes through the clip kernel.
+struct COverlayMaskClip
+{
+    enum {none = 0};
+
+    const CClipMask* mask;
+    int left, top;	// frame position of the overlay
+    int width, height, hfull;
+
+#ifdef _VSMOD
+    COverlayMaskClip(const MOD_MOVEVC& vc) : mask(vc.mask), left(vc.curpos.x), top(vc.curpos.y), width(vc.spd.cx), height(vc.spd.cy), hfull(vc.hfull) {}
+#else
+    COverlayMaskClip(const RasterizerNfo* Info) : mask(Info->am), left(Info->ampos.x), top(Info->ampos.y), width(INT_MAX), height(INT_MAX), hfull(Info->h) {}
+#endif
+
+    void Row(BYTE* dst, const BYTE* cov, int x, int end, int y, ClipRowFunc clip)
+    {
+        int mend = (y <= 0 || y > height) ? x : max(x, min(end, width));
+
+        // [ml, mr) is the part of [x, mend) over the stored rows of the mask
+        int fy = top + hfull - y;
+        int ml = mend, mr = mend;
+        if(fy >= mask->rect.top && fy < mask->rect.bottom)
+        {
+            ml = min(max(x, mask->rect.left - left), mend);
+            mr = max(ml, min(mask->rect.right - left, mend));
+        }
+
+        if(ml > x) ClipRowConst(dst + x, cov + x, mask->outside, ml - x);
+        if(mr > ml) clip(dst + ml, cov + ml, mask->bits + (fy - mask->rect.top) * mask->pitch + (left + ml - mask->rect.left), mr - ml);
+        if(mend > mr) ClipRowConst(dst + mr, cov + mr, mask->outside, mend - mr);
+        if(end > mend) memset(dst + mend, 0, end - mend);
+    }
+};
+
+#ifdef _VSMOD
+// A \movevc mask, looked up pixel by pixel
+struct COverlayMoveVCClip
+{
+    enum {none = 0};
+
+    MOD_MOVEVC& vc;
+
+    COverlayMoveVCClip(MOD_MOVEVC& vc) : vc(vc) {}
+
+    void Row(BYTE* dst, const BYTE* cov, int x, int end, int y, ClipRowFunc clip)
+    {
+        for(int i = x; i < end; i++)
+            dst[i] = (BYTE)((cov[i] * vc.GetAlphaValue(i, y)) >> 6);
+    }
+};
+#endif
+
+// The kernel: fBorderOnly draws the border minus the body, as COverlayMixer::Draw(false) did
+template<class Color, class Clip, bool fBorderOnly>
+static void MixOverlay(const RasterizerNfo* Info, Color& color, Clip& clip, const COverlayRowFuncs& f, BYTE* covRow, DWORD* colorRow)
 {
     int h = Info->h;
+    int gran = (Info->sw[1] == 0xffffffff) ? Info->w : min(Info->sw[3] + 1 - Info->xo, Info->w);
 
-    byte* s = Info->s;
+    const BYTE* s = fBorderOnly ? Info->src : Info->s;
+    const BYTE* b = Info->srcBorder;
     DWORD* dst = Info->dst;
-    int gran = (Info->sw[1] == 0xffffffff) ? Info->w : min(Info->sw[3] + 1 - Info->xo, Info->w);
 
-    if (Body)
+    for(int y = 0; y < h; y++)
     {
-        while (h--)
+        // The color and clip getters count rows from the bottom, starting at h - 1
+        int gy = h - 1 - y;
+
+        for(int x = 0, end; NextOverlayRun(Info, y, x, end); x = end)
         {
-            for (int wt = 0; wt < gran; ++wt)
-                PixMix(&dst[wt], Color->getcolor1(wt, h), s[wt * 2] * Alpha->getcolor1(wt, h) >> 6, Info->mod_blendMode);
-            for (int wt = gran; wt < Info->w; ++wt)
-                PixMix(&dst[wt], Color->getcolor2(wt, h), s[wt * 2] * Alpha->getcolor2(wt, h) >> 6, Info->mod_blendMode);
+            const BYTE* cov = s;
+            if(fBorderOnly)
+            {
+                f.subtract(covRow + x, b + x, s + x, end - x);
+                cov = covRow;
+            }
+            if(!Clip::none)
+            {
+                clip.Row(covRow, cov, x, end, gy, f.clip);
+                cov = covRow;
+            }
 
-            s += 2 * Info->overlayp;
-            dst = (DWORD*)((char*)dst + Info->pitch);
+            color.Mix(f, dst, cov, colorRow, x, end, gran, gy);
         }
+
+        s += Info->overlayp;
+        b += Info->overlayp;
+        dst = (DWORD*)((char*)dst + Info->pitch);
+    }
+}
+
+template<class Color, class Clip>
+static void MixOverlayLayer(const RasterizerNfo* Info, Color& color, Clip& clip, bool fBody, const COverlayRowFuncs& f, BYTE* covRow, DWORD* colorRow)
+{
+    if(fBody) MixOverlay<Color, Clip, false>(Info, color, clip, f, covRow, colorRow);
+    else MixOverlay<Color, Clip, true>(Info, color, clip, f, covRow, colorRow);
+}
+
+template<class Color>
+static void MixOverlayClipped(RasterizerNfo* Info, Color& color, bool fClip, bool fBody, const COverlayRowFuncs& f, BYTE* covRow, DWORD* colorRow)
+{
+    if(!fClip)
+    {
+        COverlayNoClip clip;
+        MixOverlayLayer(Info, color, clip, fBody, f, covRow, colorRow);
+    }
+#ifdef _VSMOD
+    else if(Info->mod_vc.enable)
+    {
+        COverlayMoveVCClip clip(Info->mod_vc);
+        MixOverlayLayer(Info, color, clip, fBody, f, covRow, colorRow);
     }
     else
     {
-        while (h--)
-        {
-            for (int wt = 0; wt < gran; ++wt)
-                PixMix(&dst[wt], Color->getcolor1(wt, h), SafeSubstract(s[wt * 2 + 1], s[wt * 2]) * Alpha->getcolor1(wt, h) >> 6, Info->mod_blendMode);
-            for (int wt = gran; wt < Info->w; ++wt)
-                PixMix(&dst[wt], Color->getcolor2(wt, h), SafeSubstract(s[wt * 2 + 1], s[wt * 2]) * Alpha->getcolor2(wt, h) >> 6, Info->mod_blendMode);
+        COverlayMaskClip clip(Info->mod_vc);
+        MixOverlayLayer(Info, color, clip, fBody, f, covRow, colorRow);
+    }
+#else
+    else
+    {
+        COverlayMaskClip clip(Info);
+        MixOverlayLayer(Info, color, clip, fBody, f, covRow, colorRow);
+    }
+#endif
+}
 
-            s += 2 * Info->overlayp;
-            dst = (DWORD*)((char*)dst + Info->pitch);
-        }
+void DrawOverlay(RasterizerNfo* Info, bool fClip, bool fBody)
+{
+    const COverlayRowFuncs& f = GetOverlayRowFuncs(Info->mod_blendMode);
+
+    CRasterizerArenaScope scratch;
+    BYTE* covRow = scratch.Alloc<BYTE>(Info->w);
+    DWORD* colorRow = scratch.Alloc<DWORD>(Info->w);
+    if(!covRow || !colorRow) return;
+
+#ifdef _VSMOD // patch m004. gradient colors
+    int typ = Info->typ;
+    const int* mode = Info->mod_grad.mode;
+    if(typ == 0 ? (mode[0] != 0 || mode[1] != 0) : mode[typ] != 0)
+    {
+        COverlayGradientColor color(Info->mod_grad, typ);
+        MixOverlayClipped(Info, color, fClip, fBody, f, covRow, colorRow);
+        return;
     }
+#endif
+
+    COverlaySolidColor color(Info->sw[0], Info->sw[2]);
+    MixOverlayClipped(Info, color, fClip, fBody, f, covRow, colorRow);
 }
 
-template void COverlayAlphaMixer<COverlayMixer>::Draw(bool Body);
-template void COverlayAlphaMixer<COverlayMixerSSE2>::Draw(bool Body);
+void MixSolidRect(DWORD* dst, int pitch, int w, int h, DWORD color, BYTE alpha)
+{
+    MixConstRowFunc mix = GetOverlayRowFuncs(BLEND_NORMAL).mixConst;
+
+    for(int y = 0; y < h; y++, dst = (DWORD*)((char*)dst + pitch))
+        mix(dst, w, color, alpha);
+}
 
 #if defined(_VSMOD) && defined(_LUA)
 int lua_Error(lua_State* L, CStringA Text)
@@ -277,9 +1281,10 @@ template<class T> int lua_RendererGet(lua_State* L)
     int Alpha = 0;
     int Color = 0xff000000;
     if (((x < Mix->Info->w) && (x >= 0)) &&
-        ((y < Mix->Info->h) && (y >= 0)))
+        ((y < Mix->Info->h) && (y >= 0)) &&
+        !Mix->Info->hole.PtInRect(CPoint(x, Mix->Info->h - y - 1)))
     {
-        Alpha = Mix->Info->s[x * 2 + 2 * Mix->Info->overlayp * (Mix->Info->h - y - 1)];
+        Alpha = Mix->Info->s[x + Mix->Info->overlayp * (Mix->Info->h - y - 1)];
         Color = *(DWORD*)((char*)&Mix->Info->dst[0] + Mix->Info->pitch * (Mix->Info->h - y - 1));
     }
 
@@ -310,11 +1315,12 @@ template<class T> int lua_RendererMix(lua_State* L)
     color |= (alpha << 24);
 
     if (((x < Mix->Info->w) && (x >= 0)) &&
-        ((y < Mix->Info->h) && (y >= 0)))
+        ((y < Mix->Info->h) && (y >= 0)) &&
+        !Mix->Info->hole.PtInRect(CPoint(x, Mix->Info->h - y - 1)))
     {
         DWORD* dst = (DWORD*)((char*)&Mix->Info->dst[0] + Mix->Info->pitch * (Mix->Info->h - y - 1));
-        byte* src = &Mix->Info->s[2 * Mix->Info->overlayp * (Mix->Info->h - y - 1)];
-        byte A = (Mix->m_body) ? src[x * 2] : Mix->SafeSubstract(src[x * 2 + 1], src[x * 2]);
+        int ofs = Mix->Info->overlayp * (Mix->Info->h - y - 1) + x;
+        byte A = (Mix->m_body) ? Mix->Info->s[ofs] : Mix->SafeSubstract(Mix->Info->srcBorder[ofs], Mix->Info->src[ofs]);
 
         if (Mix->Alpha) A = (A * Mix->Alpha->getcolor1(x, y)) >> 6;
 
@@ -326,22 +1332,73 @@ template<class T> int lua_RendererMix(lua_State* L)
     return 0;
 }
 
+// Mix a span of a row, local r:mix_row(row, x, n[, color, alpha])
+// Rows count from the top here, like the coverage and dst buffers. Without a color the
+// span is mixed with r.colors[x, x + n), which hold one ARGB color per pixel.
+// 1: renderer
+// 2: row
+// 3: x
+// 4: n
+// 5: color (optional)
+// 6: alpha (optional)
+template<class T> int lua_RendererMixRow(lua_State* L)
+{
+    if (!lua_istable(L, 1)) return lua_Error(L, "Argument #1 is invalid (need table 'renderer')");
+    if (!lua_isnumber(L, 2)) return lua_Error(L, "Argument #2 is invalid (need number 'row')");
+    if (!lua_isnumber(L, 3)) return lua_Error(L, "Argument #3 is invalid (need number 'x')");
+    if (!lua_isnumber(L, 4)) return lua_Error(L, "Argument #4 is invalid (need number 'n')");
+
+    bool fSolid = !lua_isnoneornil(L, 5);
+    if (fSolid && !lua_isnumber(L, 5)) return lua_Error(L, "Argument #5 is invalid (need number 'color')");
+    if (fSolid && !lua_isnumber(L, 6)) return lua_Error(L, "Argument #6 is invalid (need number 'alpha')");
+
+    COverlayLuaMixer<T>* Mix = (COverlayLuaMixer<T> *)l_CheckMix(L);
+    RasterizerNfo* Info = Mix->Info;
+
+    int row = (int)lua_tointeger(L, 2);
+    int x = (int)lua_tointeger(L, 3);
+    int end = min(x + (int)lua_tointeger(L, 4), Info->w);
+    x = max(x, 0);
+    if (row < 0 || row >= Info->h || x >= end || !Mix->m_coverage) return 0;
+
+    const COverlayRowFuncs& f = GetOverlayRowFuncs(Info->mod_blendMode);
+    DWORD* dst = (DWORD*)((char*)Info->dst + Info->pitch * row);
+    const BYTE* cov = Mix->m_coverage + Info->w * row;
+
+    if (!fSolid)
+    {
+        f.mixColors(dst + x, cov + x, Mix->m_colors + x, end - x);
+        return 0;
+    }
+
+    DWORD color = ((DWORD)lua_tointeger(L, 5) & 0xFFFFFF) | (((DWORD)lua_tointeger(L, 6) & 0xFF) << 24);
+
+    if (f.fBlend)
+    {
+        for (int i = x; i < end; i++) Mix->m_colors[i] = color;
+        f.mixColors(dst + x, cov + x, Mix->m_colors + x, end - x);
+    }
+    else
+        f.mixSolid(dst + x, cov + x, end - x, color);
+
+    return 0;
+}
+
 template int lua_RendererGet<COverlayMixer>(lua_State* L);
 template int lua_RendererGet<COverlayMixerSSE2>(lua_State* L);
 
 template int lua_RendererMix<COverlayMixer>(lua_State* L);
 template int lua_RendererMix<COverlayMixerSSE2>(lua_State* L);
 
+template int lua_RendererMixRow<COverlayMixer>(lua_State* L);
+template int lua_RendererMixRow<COverlayMixerSSE2>(lua_State* L);
+
 template<class T> void COverlayLuaMixer<T>::Draw(bool Body)
 {
     m_body = Body;
 
-    CStringA Func(Function);
-    if (LuaHasFunction(L, Function))
+    if (LuaPushFunction(L, Function))
     {
-        // Find function =D
-        lua_getglobal(L, Func);
-
         // Create line table
         lua_newtable(L);
         LuaAddIntegerField(L, "id", m_entry);
@@ -358,14 +1415,38 @@ template<class T> void COverlayLuaMixer<T>::Draw(bool Body)
         LuaAddIntegerField(L, "a2", (Info->sw[2] >> 24) & 0xff);
 
         // Saved user data
+        LuaSetUserField(L, m_entry);
+
+        // Coverage of this layer with the clip applied, the same alpha mix() starts from
+        CRasterizerArenaScope scratch;
+        m_coverage = scratch.Alloc<BYTE>(Info->w * Info->h);
+        m_colors = scratch.Alloc<DWORD>(Info->w);
+        if (m_coverage && m_colors)
+        {
+            const COverlayRowFuncs& f = GetOverlayRowFuncs(Info->mod_blendMode);
+
+            for (int y = 0; y < Info->h; y++)
+            {
+                BYTE* cov = m_coverage + Info->w * y;
+                int ofs = Info->overlayp * y;
+
+                if (Body) memcpy(cov, Info->s + ofs, Info->w);
+                else f.subtract(cov, Info->srcBorder + ofs, Info->src + ofs, Info->w);
+
+                if (Alpha)
+                    for (int x = 0; x < Info->w; x++)
+                        cov[x] = (BYTE)((cov[x] * Alpha->getcolor1(x, Info->h - y - 1)) >> 6);
+
+                if (y >= Info->hole.top && y < Info->hole.bottom)
+                    memset(cov + Info->hole.left, 0, Info->hole.Width());
+            }
+
+            memset(m_colors, 0, sizeof(DWORD) * Info->w);
+        }
+        else
         {
-            CStringA index;
-            index.Format("sub_%d", m_entry);
-            lua_getglobal(L, index);
-            if (lua_istable(L, -1))
-                lua_setfield(L, -2, "user");
-            else
-                lua_pop(L, 1);
+            m_coverage = NULL;
+            m_colors = NULL;
         }
 
         // Create renderer
@@ -374,8 +1455,23 @@ template<class T> void COverlayLuaMixer<T>::Draw(bool Body)
         LuaAddFunctionField(L, "get", &lua_RendererGet<T>);
         LuaAddFunctionField(L, "mix", &lua_RendererMix<T>);
 
+        // Row access for LuaJIT's FFI, e.g. ffi.cast("uint32_t*", r.dst): the rows of
+        // coverage (bytes, 0x40 is full) and dst (ARGB) run top down, pitches in bytes,
+        // and mix_row mixes a span of a row with r.colors or a single color
+        if (m_coverage)
+        {
+            LuaAddUserField(L, "coverage", m_coverage);
+            LuaAddIntegerField(L, "coverage_pitch", Info->w);
+            LuaAddUserField(L, "dst", Info->dst);
+            LuaAddIntegerField(L, "pitch", Info->pitch);
+            LuaAddUserField(L, "colors", m_colors);
+            LuaAddIntegerField(L, "width", Info->w);
+            LuaAddIntegerField(L, "height", Info->h);
+            LuaAddFunctionField(L, "mix_row", &lua_RendererMixRow<T>);
+        }
+
         // function(line, rend)
-        if (lua_pcall(L, 2, 0, 0) != 0)
+        if (LuaCall(L, 2, 0) != 0)
         {
             // error
             CString ErrorText = L"Error: ";
@@ -383,6 +1479,9 @@ template<class T> void COverlayLuaMixer<T>::Draw(bool Body)
 
             LuaError(ErrorText + LuaErrorText);
         }
+
+        m_coverage = NULL;
+        m_colors = NULL;
     }
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Rasterizer.h"
+#include "../dsutil/vd.h"
 
 // Overlay mixer
 class COverlayGetter
@@ -84,8 +85,6 @@ public:
     // Mixer
     virtual void PixMix(DWORD* dst, DWORD color, BYTE alpha, MOD_BLEND mod_blendMode);
     virtual DWORD SafeSubstract(DWORD a, DWORD b);
-
-    virtual void Draw(bool Body);
 };
 
 class COverlayMixerSSE2 : public COverlayMixer
@@ -99,22 +98,35 @@ public:
     DWORD SafeSubstract(DWORD a, DWORD b);
 };
 
-// Mix with clip
-template<class T> class COverlayAlphaMixer : public T
-{
-private:
-    // Alpha of layers
-    COverlayGetter* Alpha;
+// Row kernels, coverage and alpha are 6 bit (0 - 0x40)
+typedef void (*SubtractRowFunc)(BYTE* dst, const BYTE* border, const BYTE* body, int n);
+typedef void (*ClipRowFunc)(BYTE* dst, const BYTE* cov, const BYTE* mask, int n);
+typedef void (*MixSolidRowFunc)(DWORD* dst, const BYTE* alpha, int n, DWORD color);
+typedef void (*MixColorRowFunc)(DWORD* dst, const BYTE* alpha, const DWORD* colors, int n);
 
-public:
-    COverlayAlphaMixer(RasterizerNfo* Info, COverlayGetter* Color, COverlayGetter* Alpha)
-        : T(Info, Color) {
-        this->Alpha = Alpha;
-    }
+typedef void (*MixConstRowFunc)(DWORD* dst, int n, DWORD color, BYTE alpha);
 
-    void Draw(bool Body);
+struct COverlayRowFuncs
+{
+    SubtractRowFunc subtract;
+    ClipRowFunc clip;
+    MixSolidRowFunc mixSolid;
+    MixColorRowFunc mixColors; // blends too, unless fBlend is false
+    MixConstRowFunc mixConst;
+    bool fBlend;
 };
 
+// The kernels of one blend mode at a SIMD tier, which the CPU must support. The mixer
+// uses those of g_cpuid.m_tier, every tier must give the same result as tier_c.
+COverlayRowFuncs MakeOverlayRowFuncs(MOD_BLEND mode, CCpuID::tier_t tier);
+
+// Mixes the overlay into Info->dst with row kernels specialized for the color source, the
+// clip and the blend mode, fClip: Info's clip mask applies, fBody: see Rasterizer::Draw
+void DrawOverlay(RasterizerNfo* Info, bool fClip, bool fBody);
+
+// Mixes color at the same coverage alpha (0 - 0x40) into every pixel of a w x h rectangle
+void MixSolidRect(DWORD* dst, int pitch, int w, int h, DWORD color, BYTE alpha);
+
 #if defined(_VSMOD) && defined(_LUA)
 // Error
 int lua_Error(lua_State* L, CStringA Text);
@@ -124,6 +136,7 @@ void* l_CheckMix(lua_State* L);
 
 template<class T> int lua_RendererGet(lua_State* L);
 template<class T> int lua_RendererMix(lua_State* L);
+template<class T> int lua_RendererMixRow(lua_State* L);
 
 // Mix with clip
 template<class T> class COverlayLuaMixer : public T, public CMyLua
@@ -138,9 +151,16 @@ public:
     COverlayGetter* Alpha;
     bool    m_body;
 
+    // Buffers handed to the handler for the duration of Draw: the coverage of the layer
+    // being drawn with the clip applied (pitch w) and a row of colors for mix_row
+    BYTE*   m_coverage;
+    DWORD*  m_colors;
+
     COverlayLuaMixer(RasterizerNfo* Info, COverlayGetter* Color, COverlayGetter* Alpha)
         : T(Info, Color) {
         this->Alpha = Alpha;
+        m_coverage = NULL;
+        m_colors = NULL;
     }
 
     void Draw(bool Body);
@@ -24,8 +24,10 @@
 #include <memory>
 #include <math.h>
 #include <time.h>
+#include <ppl.h>
 #include "RTS.h"
 #include "RenderingCache.h"
+#include "SeparableFilter.h"
 
 #if defined (_VSMOD) && defined(_LUA)
 // path m012. Lua animation
@@ -108,9 +110,10 @@ CWord::CWord(STSStyle& style, CStringW str, int ktype, int kstart, int kend, dou
     , m_width(0), m_ascent(0), m_descent(0)
     , m_ktype(ktype), m_kstart(kstart), m_kend(kend)
     , m_scalex(scalex), m_scaley(scaley)
-    , m_fDrawn(false), m_p(INT_MAX, INT_MAX)
+    , m_fDrawn(false), m_fOutlined(false), m_p(INT_MAX, INT_MAX)
     , m_fLineBreak(false), m_fWhiteSpaceChar(false)
     , m_pOpaqueBox(NULL), isOpaqueBox(false)
+    , m_pOverlayCache(NULL)
 {
     if(str.IsEmpty())
     {
@@ -138,12 +141,149 @@ bool CWord::Append(CWord* w)
     m_str += w->m_str;
     m_width += w->m_width;
 
-    m_fDrawn = false;
+    m_fDrawn = m_fOutlined = false;
     m_p = CPoint(INT_MAX, INT_MAX);
 
     return(true);
 }
 
+bool CWord::IsOverlayCacheable()
+{
+    if(!m_pOverlayCache) return(false);
+#ifdef _VSMOD
+    // random points are drawn from a shared generator
+    if(m_style.mod_rand.X || m_style.mod_rand.Y || m_style.mod_rand.Z) return(false);
+#ifdef _LUA
+    if(m_style.LuaBeforeTransformHandler.GetLength() > 0
+       || m_style.LuaCustomTransformHandler.GetLength() > 0
+       || m_style.LuaAfterTransformHandler.GetLength() > 0) return(false);
+#endif
+#endif
+    return(true);
+}
+
+// The key holds everything CreatePath, Transform and Rasterize read, morg included: Transform
+// moves every point around it, and even without a rotation the rounding depends on it
+COverlayKey CWord::GetOverlayKey(CPoint p, CPoint morg)
+{
+    bool fPolygon;
+    int baseline;
+    GetPathKind(fPolygon, baseline);
+
+    return(COverlayKey(m_str, fPolygon, baseline, m_style, m_scalex, m_scaley, isOpaqueBox,
+                       morg, p.x & 7, p.y & 7));
+}
+
+void CWord::StoreOverlay(const COverlayKey& key)
+{
+    COverlayBitmapSharedPtr overlay = std::make_shared<COverlayBitmap>();
+    overlay->width = mOverlayWidth;
+    overlay->height = mOverlayHeight;
+    overlay->offsetX = mOffsetX;
+    overlay->offsetY = mOffsetY;
+    overlay->buffer.assign(mpOverlayBuffer, mpOverlayBuffer + GetOverlaySize());
+    m_pOverlayCache->SetAt(key, overlay, sizeof(COverlayBitmap) + overlay->buffer.size());
+}
+
+// Turns the path into outlines, morg is the origin relative to the word
+bool CWord::BuildOutline(CPoint morg)
+{
+#if defined (_VSMOD) && defined(_LUA)
+    if(m_style.LuaBeforeTransformHandler.GetLength() > 0) CustomTransform(morg, m_style.LuaBeforeTransformHandler, m_layer);
+    if(m_style.LuaCustomTransformHandler.GetLength() > 0)
+        CustomTransform(morg, m_style.LuaCustomTransformHandler, m_layer);
+    else
+        Transform(morg);
+    if(m_style.LuaAfterTransformHandler.GetLength() > 0) CustomTransform(morg, m_style.LuaAfterTransformHandler, m_layer);
+#else
+    Transform(morg);
+#endif
+
+    if(!ScanConvert()) return(false);
+
+    if(m_style.borderStyle == 0 && (m_style.outlineWidthX + m_style.outlineWidthY > 0))
+    {
+        if(!CreateWidenedRegion((int)(m_style.outlineWidthX + 0.5), (int)(m_style.outlineWidthY + 0.5))) return(false);
+    }
+
+    m_fOutlined = true;
+
+    return(true);
+}
+
+// Builds the outlines on first use and rasterizes them at the subpixel phase of p
+bool CWord::RasterizeOverlay(CPoint p, CPoint morg)
+{
+    if(!m_fOutlined && !(CreatePath() && BuildOutline(morg))) return(false);
+
+    return(Rasterize(p.x & 7, p.y & 7, m_style.fBlur, m_style.fGaussianBlurX, m_style.fGaussianBlurY));
+}
+
+// Whether everything after CreatePath only touches this word, so that it can run on any thread
+bool CWord::CanRasterizeAhead()
+{
+#ifdef _VSMOD
+    // Render would have to draw the jitter offset from rand() to know where the word goes
+    if(m_style.mod_jitter.enabled) return(false);
+#ifdef _LUA
+    // there is one Lua state
+    if(m_style.LuaBeforeTransformHandler.GetLength() > 0
+       || m_style.LuaCustomTransformHandler.GetLength() > 0
+       || m_style.LuaAfterTransformHandler.GetLength() > 0) return(false);
+#endif
+#endif
+    return(true);
+}
+
+void CWord::PreparePaint(CPoint p, CPoint org, CAtlArray<CWordRasterJob>& jobs)
+{
+    if(!m_str || !CanRasterizeAhead()) return;
+
+    if(!m_fDrawn && m_style.borderStyle == 1)
+    {
+        if(!CreateOpaqueBox()) return;
+    }
+
+    if(!m_fDrawn || (m_p.x & 7) != (p.x & 7) || (m_p.y & 7) != (p.y & 7))
+    {
+        CPoint morg = CPoint((org.x - p.x) * 8, (org.y - p.y) * 8);
+
+        COverlayBitmapSharedPtr overlay;
+        if(IsOverlayCacheable() && m_pOverlayCache->Lookup(GetOverlayKey(p, morg), overlay))
+        {
+            SetOverlay(overlay->width, overlay->height, overlay->offsetX, overlay->offsetY, overlay->buffer.data());
+            m_fDrawn = true;
+            m_p = p;
+        }
+        else if(m_fOutlined || CreatePath())
+        {
+            CWordRasterJob job = {this, p, morg, false};
+            jobs.Add(job);
+        }
+    }
+
+    if(m_pOpaqueBox)
+        m_pOpaqueBox->PreparePaint(p, org, jobs);
+}
+
+void CWord::RasterizeAhead(CWordRasterJob& job)
+{
+    job.fOk = (m_fOutlined || BuildOutline(job.morg))
+              && Rasterize(job.p.x & 7, job.p.y & 7, m_style.fBlur, m_style.fGaussianBlurX, m_style.fGaussianBlurY);
+}
+
+void CWord::FinishPaint(const CWordRasterJob& job)
+{
+    // Paint tries again when this failed, and fails the same way
+    if(!job.fOk) return;
+
+    if(IsOverlayCacheable())
+        StoreOverlay(GetOverlayKey(job.p, job.morg));
+
+    m_fDrawn = true;
+    m_p = job.p;
+}
+
 #if defined (_VSMOD) && defined(_LUA)
 void CWord::Paint(CPoint p, CPoint org, int Layer)
 #else
@@ -155,40 +295,37 @@ void CWord::Paint(CPoint p, CPoint org)
 #endif
     if(!m_str) return;
 
-    if(!m_fDrawn)
+    if(!m_fDrawn && m_style.borderStyle == 1)
     {
-        if(!CreatePath()) return;
+        if(!CreateOpaqueBox()) return;
+    }
 
+    if(!m_fDrawn || (m_p.x & 7) != (p.x & 7) || (m_p.y & 7) != (p.y & 7))
+    {
         CPoint morg = CPoint((org.x - p.x) * 8, (org.y - p.y) * 8);
-#if defined (_VSMOD) && defined(_LUA)
-        if(m_style.LuaBeforeTransformHandler.GetLength() > 0) CustomTransform(morg, m_style.LuaBeforeTransformHandler, Layer);
-        if(m_style.LuaCustomTransformHandler.GetLength() > 0)
-            CustomTransform(morg, m_style.LuaCustomTransformHandler, Layer);
-        else
-            Transform(morg);
-        if(m_style.LuaAfterTransformHandler.GetLength() > 0) CustomTransform(morg, m_style.LuaAfterTransformHandler, Layer);
-#else
-        Transform(CPoint((org.x - p.x) * 8, (org.y - p.y) * 8));
-#endif
-
-        if(!ScanConvert()) return;
 
-        if(m_style.borderStyle == 0 && (m_style.outlineWidthX + m_style.outlineWidthY > 0))
+        if(IsOverlayCacheable())
         {
-            if(!CreateWidenedRegion((int)(m_style.outlineWidthX + 0.5), (int)(m_style.outlineWidthY + 0.5))) return;
+            COverlayKey key = GetOverlayKey(p, morg);
+
+            COverlayBitmapSharedPtr overlay;
+            if(m_pOverlayCache->Lookup(key, overlay))
+            {
+                SetOverlay(overlay->width, overlay->height, overlay->offsetX, overlay->offsetY, overlay->buffer.data());
+            }
+            else
+            {
+                if(!RasterizeOverlay(p, morg)) return;
+
+                StoreOverlay(key);
+            }
         }
-        else if(m_style.borderStyle == 1)
+        else if(!RasterizeOverlay(p, morg))
         {
-            if(!CreateOpaqueBox()) return;
+            return;
         }
 
         m_fDrawn = true;
-
-        if(!Rasterize(p.x & 7, p.y & 7, m_style.fBlur, m_style.fGaussianBlurX, m_style.fGaussianBlurY)) return;
-    }
-    else if((m_p.x & 7) != (p.x & 7) || (m_p.y & 7) != (p.y & 7))
-    {
-        Rasterize(p.x & 7, p.y & 7, m_style.fBlur, m_style.fGaussianBlurX, m_style.fGaussianBlurY);
     }
 
     m_p = p;
@@ -207,7 +344,17 @@ void CWord::Paint(CPoint p, CPoint org)
 #ifdef _LUA
 void CWord::CustomTransform(CPoint org, CString F, int Layer)
 {
-    CStringA Func(F);
+    // The handler and the user table are looked up once for all the points
+    if(!LuaPushFunction(L, F)) return;
+    int func = lua_gettop(L);
+
+    {
+        CStringA index;
+        index.Format("sub_%d", m_entry);
+        lua_getglobal(L, index);
+    }
+    int user = lua_gettop(L);
+
     // Calculate size:
     int minx = INT_MAX, miny = INT_MAX, maxx = -INT_MAX, maxy = -INT_MAX;
 
@@ -229,8 +376,7 @@ void CWord::CustomTransform(CPoint org, CString F, int Layer)
         x = mpPathPoints[i].x;
         y = mpPathPoints[i].y;
 
-        // Find function =D
-        lua_getglobal(L, Func);
+        lua_pushvalue(L, func);
 
         // Create line table
         lua_newtable(L);
@@ -277,17 +423,13 @@ void CWord::CustomTransform(CPoint org, CString F, int Layer)
         lua_setfield(L, -2, "org");
 
         // User table
+        if(lua_istable(L, user))
         {
-            CStringA index;
-            index.Format("sub_%d", m_entry);
-            lua_getglobal(L, index);
-            if(lua_istable(L, -1))
-                lua_setfield(L, -2, "user");
-            else
-                lua_pop(L, 1);
+            lua_pushvalue(L, user);
+            lua_setfield(L, -2, "user");
         }
 
-        if (lua_pcall(L, 1, 1, 0) != 0)
+        if (LuaCall(L, 1, 1) != 0)
         {
 	        // error
 	        CString ErrorText = L"Error: ";
@@ -308,6 +450,8 @@ void CWord::CustomTransform(CPoint org, CString F, int Layer)
             lua_pop(L, 1);
         }
     }
+
+    lua_pop(L, 2);
 }
 #endif
 #endif
@@ -712,6 +856,7 @@ bool CWord::CreateOpaqueBox()
 
     m_pOpaqueBox = DNew CPolygon(style, str, 0, 0, 0, 1.0 / 8, 1.0 / 8, 0);
     m_pOpaqueBox->isOpaqueBox = true;
+    m_pOpaqueBox->m_pOverlayCache = m_pOverlayCache;
 
     return(!!m_pOpaqueBox);
 }
@@ -869,6 +1014,7 @@ CPolygon::~CPolygon()
 CWord* CPolygon::Copy()
 {
     CWord* T = DNew CPolygon(m_style, m_str, m_ktype, m_kstart, m_kend, m_scalex, m_scaley, m_baseline);
+    T->m_pOverlayCache = m_pOverlayCache;
 #if defined(_VSMOD) && defined(_LUA)
     T->L = L;
     T->LuaLog = LuaLog;
@@ -1195,49 +1341,47 @@ void CClipper::ParseLuaTable(STSStyle& style, CPoint & pos, CPoint & org)
 #endif
 
 #if defined (_VSMOD) && defined(_LUA)
-    CClipper::CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CString LuaStyle, lua_State * L, std::wofstream * LuaLog, int entry)
+    CClipper::CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CString LuaStyle, lua_State * L, std::wofstream * LuaLog, int entry, CClipMaskCache* pCache)
 #else
-    CClipper::CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse)
+    CClipper::CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CClipMaskCache* pCache)
 #endif
     : CPolygon(STSStyle(), str, 0, 0, 0, scalex, scaley, 0)
 {
     m_size.cx = m_size.cy = 0;
-    m_pAlphaMask = NULL;
+    m_inverse = inverse;
 
-    if(size.cx < 0 || size.cy < 0 || !(m_pAlphaMask = DNew BYTE[size.cx*size.cy])) return;
+    if(size.cx < 0 || size.cy < 0) return;
+
+    m_size = size;
 
 #if defined (_VSMOD) && defined(_LUA)
     this->L = L;
     this->LuaLog = LuaLog;
     this->LuaStyle = LuaStyle;
 
+    m_entry = entry;
+
+    // a clip style handler may return something else for every line
+    if(LuaStyle.GetLength() > 0) pCache = NULL;
+#endif
+
+    CClipMaskKey key(str, scalex, scaley, inverse, size);
+    if(pCache && pCache->Lookup(key, m_pMask)) return;
+
+#if defined (_VSMOD) && defined(_LUA)
     CPoint org(0, 0);
     CPoint pos(0, 0);
 
-    m_entry = entry;
     if(LuaStyle.GetLength() > 0)
     {
-        CStringA Func(LuaStyle);
-        if(LuaHasFunction(L, LuaStyle))
+        if(LuaPushFunction(L, LuaStyle))
         {
-            // Find function =D
-            lua_getglobal(L, Func);
-
             // Create line table
             lua_newtable(L);
             LuaAddIntegerField(L, "id", m_entry);
+            LuaSetUserField(L, m_entry);
 
-            // Saved user data
-            {
-                CStringA index;
-                index.Format("sub_%d", m_entry);
-                lua_getglobal(L, index);
-                if(lua_istable(L, -1))
-                    lua_setfield(L, -2, "user");
-                else
-                    lua_pop(L, 1);
-            }
-            if (lua_pcall(L, 1, 1, 0) != 0)
+            if (LuaCall(L, 1, 1) != 0)
             {
                 // error
                 CString ErrorText = L"Error: ";
@@ -1259,14 +1403,7 @@ void CClipper::ParseLuaTable(STSStyle& style, CPoint & pos, CPoint & org)
             }
         }
     }
-#endif
-
-    m_size = size;
-    m_inverse = inverse;
 
-    memset(m_pAlphaMask, 0, size.cx * size.cy);
-
-#if defined (_VSMOD) && defined(_LUA)
     Paint(pos, org, 6);
 #else
     Paint(CPoint(0, 0), CPoint(0, 0));
@@ -1291,40 +1428,65 @@ void CClipper::ParseLuaTable(STSStyle& style, CPoint & pos, CPoint & org)
     if(x + w > m_size.cx) w = m_size.cx - x;
     if(y + h > m_size.cy) h = m_size.cy - y;
 
-    if(w <= 0 || h <= 0) return;
+    // only the drawing's bounding box is stored, the rest of the frame reads as outside
+    m_pMask = std::make_shared<CClipMask>(CRect(x, y, x + max(w, 0), y + max(h, 0)), inverse ? 0x40 : 0); // mask is 6 bit
 
-    const BYTE* src = mpOverlayBuffer + 2 * (mOverlayWidth * yo + xo);
-    BYTE* dst = m_pAlphaMask + m_size.cx * y + x;
+    const BYTE* src = mpOverlayBuffer + mOverlayPitch * yo + xo;
+    BYTE* dst = m_pMask->bits;
 
-    while(h--)
+    for(int j = 0, n = m_pMask->rect.Height(); j < n; j++)
     {
-        for(ptrdiff_t wt = 0; wt < w; ++wt)
-            dst[wt] = src[wt*2];
+        if(inverse)
+        {
+            for(int i = 0; i < w; i++)
+                dst[i] = 0x40 - src[i];
+        }
+        else
+        {
+            memcpy(dst, src, w);
+        }
 
-        src += 2 * mOverlayWidth;
-        dst += m_size.cx;
+        src += mOverlayPitch;
+        dst += m_pMask->pitch;
     }
 
-    if(inverse)
-    {
-        BYTE* dst = m_pAlphaMask;
-        for(ptrdiff_t i = size.cx * size.cy; i > 0; --i, ++dst)
-            *dst = 0x40 - *dst; // mask is 6 bit
-    }
+    if(pCache) pCache->SetAt(key, m_pMask, sizeof(CClipMask) + m_pMask->GetSize());
 }
 
 CClipper::~CClipper()
 {
-    if(m_pAlphaMask) delete [] m_pAlphaMask;
-    m_pAlphaMask = NULL;
+}
+
+BYTE* CClipper::GetFullFrameMask()
+{
+    CRect frame(CPoint(0, 0), m_size);
+
+    if(!m_pMask || m_pMask->rect != frame || m_pMask.use_count() > 1)
+    {
+        CClipMaskSharedPtr pMask = std::make_shared<CClipMask>(frame, 0);
+        CRect r(0, 0, 0, 0);
+
+        if(m_pMask && pMask->bits)
+        {
+            memset(pMask->bits, m_pMask->outside, pMask->GetSize());
+            r.IntersectRect(m_pMask->rect, frame);
+        }
+
+        for(int y = r.top; y < r.bottom; y++)
+            memcpy(pMask->bits + pMask->pitch * y + r.left, m_pMask->bits + m_pMask->pitch * (y - m_pMask->rect.top) + (r.left - m_pMask->rect.left), r.Width());
+
+        m_pMask = pMask;
+    }
+
+    return m_pMask->bits;
 }
 
 CWord* CClipper::Copy()
 {
 #if defined (_VSMOD) && defined(_LUA)
-    return(DNew CClipper(m_str, m_size, m_scalex, m_scaley, m_inverse, LuaStyle, L, LuaLog, m_entry));
+    return(DNew CClipper(m_str, m_size, m_scalex, m_scaley, m_inverse, LuaStyle, L, LuaLog, m_entry, NULL));
 #else
-    return(DNew CClipper(m_str, m_size, m_scalex, m_scaley, m_inverse));
+    return(DNew CClipper(m_str, m_size, m_scalex, m_scaley, m_inverse, NULL));
 #endif
 }
 
@@ -1396,10 +1558,48 @@ void CLine::Compact()
     }
 }
 
+// Where the word w of the line starting at p is painted, before any jitter, fShadow adds
+// the shadow offset. PreparePaint and the Paint passes must agree on it to the subpixel.
+CPoint CLine::GetWordPos(const CWord* w, CPoint p, bool fShadow) const
+{
+#ifdef _VSMOD
+    // vpatch v002. Horizontal fontspacing, patch m001. Vertical fontspacing
+    double x = p.x - w->m_style.mod_horizontalSpace;
+    double y = p.y - w->m_style.mod_verticalSpace + m_ascent - w->m_ascent;
+#else
+    int x = p.x;
+    int y = p.y + m_ascent - w->m_ascent;
+#endif
+    if(fShadow)
+    {
+        x += (int)(w->m_style.shadowDepthX + 0.5);
+        y += (int)(w->m_style.shadowDepthY + 0.5);
+    }
+
+    return(CPoint((int)x, (int)y));
+}
+
+// Queues the words of the line at the position of their first Paint in the frame, which
+// is PaintShadow's when they have a shadow and PaintOutline's and PaintBody's otherwise
+void CLine::PreparePaint(CPoint p, CPoint org, CAtlArray<CWordRasterJob>& jobs)
+{
+    POSITION pos = GetHeadPosition();
+    while(pos)
+    {
+        CWord* w = GetNext(pos);
+
+        if(w->m_fLineBreak) return;
+
+        w->PreparePaint(GetWordPos(w, p, w->m_style.shadowDepthX != 0 || w->m_style.shadowDepthY != 0), org, jobs);
+
+        p.x += w->m_width;
+    }
+}
+
 #ifdef _VSMOD // patch m006. moveable vector clip
-CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
+CRect CLine::PaintShadow(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
 #else
-CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha)
+CRect CLine::PaintShadow(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha)
 #endif
 {
     CRect bbox(0, 0, 0, 0);
@@ -1413,15 +1613,8 @@ CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPo
 
         if(w->m_style.shadowDepthX != 0 || w->m_style.shadowDepthY != 0)
         {
-#ifdef _VSMOD
-            // vpatch v002. Horizontal fontspacing
-            int x = p.x - w->m_style.mod_horizontalSpace + (int)(w->m_style.shadowDepthX + 0.5);
-            // patch m001. Vertical fontspacing
-            int y = p.y - w->m_style.mod_verticalSpace + m_ascent - w->m_ascent + (int)(w->m_style.shadowDepthY + 0.5);
-#else
-            int x = p.x + (int)(w->m_style.shadowDepthX + 0.5);
-            int y = p.y + m_ascent - w->m_ascent + (int)(w->m_style.shadowDepthY + 0.5);
-#endif
+            CPoint wp = GetWordPos(w, p, true);
+            int x = wp.x, y = wp.y;
             DWORD a = 0xff - w->m_style.alpha[3];
             if(alpha > 0) a = MulDiv(a, 0xff - alpha, 0xff);
             COLORREF shadow = revcolor(w->m_style.colors[3]) | (a << 24);
@@ -1445,11 +1638,11 @@ CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPo
             if(w->m_style.borderStyle == 0)
             {
 #ifdef _VSMOD // patch m004. gradient colors
-                bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw,
+                bbox |= w->Draw(spd, clip, pClipMask, x, y, sw,
                                 w->m_ktype > 0 || w->m_style.alpha[0] < 0xff,
                                 (w->m_style.outlineWidthX + w->m_style.outlineWidthY > 0) && !(w->m_ktype == 2 && time < w->m_kstart), 3, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
 #else
-                bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw,
+                bbox |= w->Draw(spd, clip, pClipMask, x, y, sw,
                                 w->m_ktype > 0 || w->m_style.alpha[0] < 0xff,
                                 (w->m_style.outlineWidthX + w->m_style.outlineWidthY > 0) && !(w->m_ktype == 2 && time < w->m_kstart));
 #endif
@@ -1457,9 +1650,9 @@ CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPo
             else if(w->m_style.borderStyle == 1 && w->m_pOpaqueBox)
             {
 #ifdef _VSMOD // patch m004. gradient colors
-                bbox |= w->m_pOpaqueBox->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false, 3, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
+                bbox |= w->m_pOpaqueBox->Draw(spd, clip, pClipMask, x, y, sw, true, false, 3, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
 #else
-                bbox |= w->m_pOpaqueBox->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false);
+                bbox |= w->m_pOpaqueBox->Draw(spd, clip, pClipMask, x, y, sw, true, false);
 #endif
             }
         }
@@ -1471,9 +1664,9 @@ CRect CLine::PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPo
 }
 
 #ifdef _VSMOD // patch m006. moveable vector clip
-CRect CLine::PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
+CRect CLine::PaintOutline(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
 #else
-CRect CLine::PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha)
+CRect CLine::PaintOutline(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha)
 #endif
 {
     CRect bbox(0, 0, 0, 0);
@@ -1487,14 +1680,8 @@ CRect CLine::PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CP
 
         if(w->m_style.outlineWidthX + w->m_style.outlineWidthY > 0 && !(w->m_ktype == 2 && time < w->m_kstart))
         {
-#ifdef _VSMOD // vpatch v002. Horizontal fontspacing
-            int x = p.x - w->m_style.mod_horizontalSpace;
-            // patch m001. Vertical fontspacing
-            int y = p.y - w->m_style.mod_verticalSpace + m_ascent - w->m_ascent;
-#else
-            int x = p.x;
-            int y = p.y + m_ascent - w->m_ascent;
-#endif
+            CPoint wp = GetWordPos(w, p, false);
+            int x = wp.x, y = wp.y;
             DWORD aoutline = w->m_style.alpha[2];
             if(alpha > 0) aoutline += MulDiv(alpha, 0xff - w->m_style.alpha[2], 0xff);
             COLORREF outline = revcolor(w->m_style.colors[2]) | ((0xff - aoutline) << 24);
@@ -1520,17 +1707,17 @@ CRect CLine::PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CP
             if(w->m_style.borderStyle == 0)
             {
 #ifdef _VSMOD // patch m004. gradient colors
-                bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw, !w->m_style.alpha[0] && !w->m_style.alpha[1] && !alpha && !w->m_style.mod_grad.bodyIsGradAlpha, true, 2, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
+                bbox |= w->Draw(spd, clip, pClipMask, x, y, sw, !w->m_style.alpha[0] && !w->m_style.alpha[1] && !alpha && !w->m_style.mod_grad.bodyIsGradAlpha, true, 2, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
 #else
-                bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw, !w->m_style.alpha[0] && !w->m_style.alpha[1] && !alpha, true);
+                bbox |= w->Draw(spd, clip, pClipMask, x, y, sw, !w->m_style.alpha[0] && !w->m_style.alpha[1] && !alpha, true);
 #endif
             }
             else if(w->m_style.borderStyle == 1 && w->m_pOpaqueBox)
             {
 #ifdef _VSMOD // patch m004. gradient colors
-                bbox |= w->m_pOpaqueBox->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false, 2, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
+                bbox |= w->m_pOpaqueBox->Draw(spd, clip, pClipMask, x, y, sw, true, false, 2, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
 #else
-                bbox |= w->m_pOpaqueBox->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false);
+                bbox |= w->m_pOpaqueBox->Draw(spd, clip, pClipMask, x, y, sw, true, false);
 #endif
             }
         }
@@ -1542,9 +1729,9 @@ CRect CLine::PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CP
 }
 
 #ifdef _VSMOD // patch m006. moveable vector clip
-CRect CLine::PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
+CRect CLine::PaintBody(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt)
 #else
-CRect CLine::PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha)
+CRect CLine::PaintBody(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha)
 #endif
 {
     CRect bbox(0, 0, 0, 0);
@@ -1555,15 +1742,9 @@ CRect CLine::PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoin
         CWord* w = GetNext(pos);
 
         if(w->m_fLineBreak) return(bbox); // should not happen since this class is just a line of text without any breaks
-#ifdef _VSMOD
-        // vpatch v002. Horizontal fontspacing
-        int x = p.x - w->m_style.mod_horizontalSpace;
-        // patch m001. Vertical fontspacing
-        int y = p.y - w->m_style.mod_verticalSpace + m_ascent - w->m_ascent;
-#else
-        int x = p.x;
-        int y = p.y + m_ascent - w->m_ascent;
-#endif
+        CPoint wp = GetWordPos(w, p, false);
+        int x = wp.x, y = wp.y;
+
         // colors
 
         DWORD aprimary = w->m_style.alpha[0];
@@ -1639,9 +1820,9 @@ CRect CLine::PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoin
         sw[3] = (int)(w->m_style.outlineWidthX + t * w->getOverlayWidth() + t * bluradjust) >> 3;
 
 #ifdef _VSMOD // patch m004. gradient colors
-        bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false, 0, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
+        bbox |= w->Draw(spd, clip, pClipMask, x, y, sw, true, false, 0, w->m_style.mod_grad, mod_vc, w->m_style.mod_blendMode);
 #else
-        bbox |= w->Draw(spd, clipRect, pAlphaMask, x, y, sw, true, false);
+        bbox |= w->Draw(spd, clip, pClipMask, x, y, sw, true, false);
 #endif
         p.x += w->m_width;
     }
@@ -1841,15 +2022,15 @@ void CSubtitle::CreateClippers(CSize size)
             CStringW str;
             str.Format(L"m %d %d l %d %d %d %d %d %d", 0, 0, w, 0, w, h, 0, h);
 #if defined (_VSMOD) && defined(_LUA)
-            m_pClipper = DNew CClipper(str, size, 1, 1, false, L"", L, LuaLog, 0);
+            m_pClipper = DNew CClipper(str, size, 1, 1, false, L"", L, LuaLog, 0, NULL);
 #else
-            m_pClipper = DNew CClipper(str, size, 1, 1, false);
+            m_pClipper = DNew CClipper(str, size, 1, 1, false, NULL);
 #endif
             if(!m_pClipper) return;
         }
 
         int da = (64 << 8) / width;
-        BYTE* am = m_pClipper->m_pAlphaMask;
+        BYTE* am = m_pClipper->GetFullFrameMask();
 
         for(ptrdiff_t j = 0; j < h; j++, am += w)
         {
@@ -1883,9 +2064,9 @@ void CSubtitle::CreateClippers(CSize size)
             CStringW str;
             str.Format(L"m %d %d l %d %d %d %d %d %d", 0, 0, w, 0, w, h, 0, h);
 #if defined (_VSMOD) && defined(_LUA)
-            m_pClipper = DNew CClipper(str, size, 1, 1, false, L"", L, LuaLog, 0);
+            m_pClipper = DNew CClipper(str, size, 1, 1, false, L"", L, LuaLog, 0, NULL);
 #else
-            m_pClipper = DNew CClipper(str, size, 1, 1, false);
+            m_pClipper = DNew CClipper(str, size, 1, 1, false, NULL);
 #endif
             if(!m_pClipper) return;
         }
@@ -1904,11 +2085,13 @@ void CSubtitle::CreateClippers(CSize size)
             l = h;
         }
 
+        BYTE* mask = m_pClipper->GetFullFrameMask();
+
         if(k < h)
         {
-            BYTE* am = &m_pClipper->m_pAlphaMask[k*w];
+            BYTE* am = &mask[k*w];
 
-            memset(m_pClipper->m_pAlphaMask, 0, am - m_pClipper->m_pAlphaMask);
+            memset(mask, 0, am - mask);
 
             for(ptrdiff_t j = k; j < l; j++, a += da)
             {
@@ -1933,7 +2116,7 @@ void CSubtitle::CreateClippers(CSize size)
 
         if(k < h)
         {
-            BYTE* am = &m_pClipper->m_pAlphaMask[k*w];
+            BYTE* am = &mask[k*w];
 
             int j = k;
             for(; j < l; j++, a += da)
@@ -2083,7 +2266,16 @@ CRect CScreenLayoutAllocator::AllocRect(CSubtitle* s, int segment, int entry, in
 
 CRenderedTextSubtitle::CRenderedTextSubtitle(CCritSec* pLock, STSStyle *styleOverride, bool doOverride)
     : ISubPicProviderImpl(pLock), m_doOverrideStyle(doOverride), m_pStyleOverride(styleOverride)
+    , m_overlayCache(OVERLAY_CACHE_DEFAULT_BUDGET)
+    , m_clipMaskCache(CLIP_MASK_CACHE_DEFAULT_BUDGET)
+    , m_tilesSkipped(0), m_tilesVisited(0)
+    , m_fParallelRasterize(true)
 {
+#if defined(_VSMOD) && defined(_LUA)
+    m_luaCalls = 0;
+    m_luaTime = 0;
+#endif
+
     m_size = CSize(0, 0);
 
     if(g_hDC_refcnt == 0)
@@ -2169,6 +2361,8 @@ void CRenderedTextSubtitle::Deinit()
     }
 
     m_subtitleCache.RemoveAll();
+    m_overlayCache.Clear();
+    m_clipMaskCache.Clear();
 
     m_sla.Empty();
 
@@ -2248,6 +2442,7 @@ void CRenderedTextSubtitle::ParseString(CSubtitle* sub, CStringW str, STSStyle&
         {
             if(CWord* w = DNew CText(style, str.Mid(i, j - i), m_ktype, m_kstart, m_kend, sub->m_scalex, sub->m_scaley))
             {
+                w->m_pOverlayCache = &m_overlayCache;
 #if defined (_VSMOD) && defined(_LUA)
                 w->L = L;
                 w->LuaLog = LuaLog;
@@ -2263,6 +2458,7 @@ void CRenderedTextSubtitle::ParseString(CSubtitle* sub, CStringW str, STSStyle&
         {
             if(CWord* w = DNew CText(style, CStringW(), m_ktype, m_kstart, m_kend, sub->m_scalex, sub->m_scaley))
             {
+                w->m_pOverlayCache = &m_overlayCache;
 #if defined (_VSMOD) && defined(_LUA)
                 w->L = L;
                 w->LuaLog = LuaLog;
@@ -2277,6 +2473,7 @@ void CRenderedTextSubtitle::ParseString(CSubtitle* sub, CStringW str, STSStyle&
         {
             if(CWord* w = DNew CText(style, CStringW(c), m_ktype, m_kstart, m_kend, sub->m_scalex, sub->m_scaley))
             {
+                w->m_pOverlayCache = &m_overlayCache;
 #if defined (_VSMOD) && defined(_LUA)
                 w->L = L;
                 w->LuaLog = LuaLog;
@@ -2300,6 +2497,7 @@ void CRenderedTextSubtitle::ParsePolygon(CSubtitle* sub, CStringW str, STSStyle&
 
     if(CWord* w = DNew CPolygon(style, str, m_ktype, m_kstart, m_kend, sub->m_scalex / (1 << (m_nPolygon - 1)), sub->m_scaley / (1 << (m_nPolygon - 1)), m_polygonBaselineOffset))
     {
+        w->m_pOverlayCache = &m_overlayCache;
 #if defined (_VSMOD) && defined(_LUA)
         w->L = L;
         w->LuaLog = LuaLog;
@@ -2312,6 +2510,23 @@ void CRenderedTextSubtitle::ParsePolygon(CSubtitle* sub, CStringW str, STSStyle&
 }
 
 #ifdef _LUA
+void CRenderedTextSubtitle::PushLuaLineTable(bool fAnimate)
+{
+    LuaPushLineTable(L, m_entry);
+    LuaAddIntegerField(L, "time", m_time);
+    LuaAddIntegerField(L, "start", m_start);
+    LuaAddIntegerField(L, "end", m_end);
+    LuaAddIntegerField(L, "length", m_delay);
+    if(fAnimate)
+        LuaAddNumberField(L, "animate", CalcAnimation(1.0, 0.0, true));
+    else
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, "animate");
+    }
+    LuaSetUserField(L, m_entry);
+}
+
 void CRenderedTextSubtitle::ParseLuaTable(CSubtitle* sub, STSStyle& style)
 {
     // Check "style" table:
@@ -2531,39 +2746,17 @@ bool CRenderedTextSubtitle::ParseSSATag(CSubtitle* sub, CStringW str, STSStyle&
 
 #ifdef _LUA
         // Direct function call!
-        CStringA Func(cmd);
-        if(LuaHasFunction(L, cmd))
+        if(LuaPushFunction(L, cmd))
         {
-            // Find function =D
-            lua_getglobal(L, Func);
+            PushLuaLineTable(fAnimate);
 
-            // Create line table
-            lua_newtable(L);
-            LuaAddIntegerField(L, "time", m_time);
-            LuaAddIntegerField(L, "start", m_start);
-            LuaAddIntegerField(L, "end", m_end);
-            LuaAddIntegerField(L, "length", m_delay);
-            LuaAddIntegerField(L, "id", m_entry);
-            if(fAnimate)
-                LuaAddNumberField(L, "animate", CalcAnimation(1.0, 0.0, true));
-
-            // Saved user data
-            {
-                CStringA index;
-                index.Format("sub_%d", m_entry);
-                lua_getglobal(L, index);
-                if(lua_istable(L, -1))
-                    lua_setfield(L, -2, "user");
-                else
-                    lua_pop(L, 1);
-            }
             // Push arguments
             for(int arg = 0; arg < params.GetCount(); arg++)
             {
                 CStringA Param(params[arg]);
                 lua_pushstring(L, Param); 
             }
-            if (lua_pcall(L, params.GetCount() + 1, 1, 0) != 0)
+            if (LuaCall(L, params.GetCount() + 1, 1) != 0)
             {
                 // error
                 CString ErrorText = L"Error: ";
@@ -3023,18 +3216,18 @@ bool CRenderedTextSubtitle::ParseSSATag(CSubtitle* sub, CStringW str, STSStyle&
             if(params.GetCount() == 1 && !sub->m_pClipper)
             {
 #if defined (_VSMOD) && defined(_LUA)
-                sub->m_pClipper = DNew CClipper(params[0], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex, sub->m_scaley, invert, style.LuaClipStyleHandler, L, LuaLog, m_entry);
+                sub->m_pClipper = DNew CClipper(params[0], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex, sub->m_scaley, invert, style.LuaClipStyleHandler, L, LuaLog, m_entry, &m_clipMaskCache);
 #else
-                sub->m_pClipper = DNew CClipper(params[0], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex, sub->m_scaley, invert);
+                sub->m_pClipper = DNew CClipper(params[0], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex, sub->m_scaley, invert, &m_clipMaskCache);
 #endif           
             }
             else if(params.GetCount() == 2 && !sub->m_pClipper)
             {
                 int scale = max(wcstol(p, NULL, 10), 1);
 #if defined (_VSMOD) && defined(_LUA)
-                sub->m_pClipper = DNew CClipper(params[1], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex / (1 << (scale - 1)), sub->m_scaley / (1 << (scale - 1)), invert, style.LuaClipStyleHandler, L, LuaLog, m_entry);
+                sub->m_pClipper = DNew CClipper(params[1], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex / (1 << (scale - 1)), sub->m_scaley / (1 << (scale - 1)), invert, style.LuaClipStyleHandler, L, LuaLog, m_entry, &m_clipMaskCache);
 #else
-                sub->m_pClipper = DNew CClipper(params[1], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex / (1 << (scale - 1)), sub->m_scaley / (1 << (scale - 1)), invert);
+                sub->m_pClipper = DNew CClipper(params[1], CSize(m_size.cx >> 3, m_size.cy >> 3), sub->m_scalex / (1 << (scale - 1)), sub->m_scaley / (1 << (scale - 1)), invert, &m_clipMaskCache);
 #endif       
             }
             else if(params.GetCount() == 4)
@@ -3342,37 +3535,17 @@ bool CRenderedTextSubtitle::ParseSSATag(CSubtitle* sub, CStringW str, STSStyle&
         {
             if(params.GetCount() > 0)
             {
-                CStringA Func(params[0]);
-                if(LuaHasFunction(L, params[0]))
+                if(LuaPushFunction(L, params[0]))
                 {
-                    CStringA Func(params[0]);
-                    lua_getglobal(L, Func);
-                    // Create line table
-                    lua_newtable(L);
-                    LuaAddIntegerField(L, "time", m_time);
-                    LuaAddIntegerField(L, "start", m_start);
-                    LuaAddIntegerField(L, "end", m_end);
-                    LuaAddIntegerField(L, "length", m_delay);
-                    LuaAddIntegerField(L, "id", m_entry);
-                    if(fAnimate)
-                        LuaAddNumberField(L, "animate", CalcAnimation(1.0, 0.0, true));
-                    // Saved user data
-                    {
-                        CStringA index;
-                        index.Format("sub_%d", m_entry);
-                        lua_getglobal(L, index);
-                        if(lua_istable(L, -1))
-                            lua_setfield(L, -2, "user");
-                        else
-                            lua_pop(L, 1);
-                    }
+                    PushLuaLineTable(fAnimate);
+
                     // Push arguments
                     for(int arg = 1; arg < params.GetCount(); arg++)
                     {
                         CStringA Param(params[arg]);
                         lua_pushstring(L, Param); 
                     }
-                    if (lua_pcall(L, params.GetCount(), 1, 0) != 0)
+                    if (LuaCall(L, params.GetCount(), 1) != 0)
                     {
                         // error
                         CString ErrorText = L"Error: ";
@@ -4201,9 +4374,79 @@ static int lscomp(const void* ls1, const void* ls2)
     return(ret);
 }
 
+// What the painting passes need of a subtitle, worked out for all of them before any is painted
+struct LSubPlacement
+{
+    int entry;
+    CSubtitle* s;
+    int time, alpha;
+    CRect clipRect;
+    const CClipMask* pClipMask;
+    CPoint org, org2, p2;
+#ifdef _VSMOD // patch m006. moveable vector clip
+    MOD_MOVEVC mod_vc;
+#endif
+};
+
+// Rasterizes the words of the frame at the position where the painting passes first need them.
+// Creating the paths and the overlay cache stay on this thread, the rest goes to the task pool,
+// whose work stealing evens out words of very different cost (long lines, large blurs).
+static void RasterizeWordsAhead(CAtlArray<LSubPlacement>& placements)
+{
+    CAtlArray<CWordRasterJob> jobs;
+
+    for(size_t i = 0; i < placements.GetCount(); i++)
+    {
+        const LSubPlacement& sp = placements[i];
+        CSubtitle* s = sp.s;
+        CPoint p = sp.p2;
+
+        POSITION pos = s->GetHeadPosition();
+        while(pos)
+        {
+            CLine* l = s->GetNext(pos);
+
+            p.x = (s->m_scrAlignment % 3) == 1 ? sp.org.x
+                  : (s->m_scrAlignment % 3) == 0 ? sp.org.x - l->m_width
+                  :							   sp.org.x - (l->m_width / 2);
+
+            l->PreparePaint(p, sp.org2, jobs);
+
+            p.y += l->m_ascent + l->m_descent;
+        }
+    }
+
+    concurrency::parallel_for(size_t(0), jobs.GetCount(), [&jobs](size_t i)
+    {
+        // The pool keeps the cores busy already, a blur must not start an OpenMP team on top
+        bool& fSerial = SeparableFilterSerial();
+        bool fWasSerial = fSerial;
+        fSerial = true;
+        jobs[i].w->RasterizeAhead(jobs[i]);
+        fSerial = fWasSerial;
+    });
+
+    for(size_t i = 0; i < jobs.GetCount(); i++)
+        jobs[i].w->FinishPaint(jobs[i]);
+}
+
 STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox)
 {
+    CAtlList<CRect> rects;
+    HRESULT hr = RenderEx(spd, rt, fps, rects);
+
     CRect bbox2(0, 0, 0, 0);
+    for(POSITION pos = rects.GetHeadPosition(); pos; )
+        bbox2 |= rects.GetNext(pos);
+    bbox = bbox2;
+
+    return hr;
+}
+
+// Every subtitle reports its own box, MergeDirtyRects joins the ones that are close
+STDMETHODIMP CRenderedTextSubtitle::RenderEx(SubPicDesc& spd, REFERENCE_TIME rt, double fps, CAtlList<CRect>& rects)
+{
+    rects.RemoveAll();
 
     if(m_size != CSize(spd.w * 8, spd.h * 8) || m_vidrect != CRect(spd.vidrect.left * 8, spd.vidrect.top * 8, spd.vidrect.right * 8, spd.vidrect.bottom * 8))
         Init(CSize(spd.w, spd.h), spd.vidrect);
@@ -4216,6 +4459,13 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
 //    TRACE(_T("search complete: %d"), t);
     if(!stss) return S_FALSE;
 
+    // Scratch memory of the previous frame is reused, not freed
+    CRasterizerArena::GetThreadArena().Reset();
+    Rasterizer::ResetTileStats();
+#if defined(_VSMOD) && defined(_LUA)
+    ResetLuaStats();
+#endif
+
     // clear any cached subs that current position is not in its bounds
     {
         POSITION pos = m_subtitleCache.GetStartPosition();
@@ -4250,6 +4500,8 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
 
     qsort(subs.GetData(), subs.GetCount(), sizeof(LSub), lscomp);
 
+    CAtlArray<LSubPlacement> placements;
+
     for(ptrdiff_t i = 0, j = subs.GetCount(); i < j; i++)
     {
         int entry = subs[i].idx;
@@ -4282,12 +4534,12 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
 
         CPoint org2;
 
-        BYTE* pAlphaMask = s->m_pClipper ? s->m_pClipper->m_pAlphaMask : NULL;
+        const CClipMask* pClipMask = s->m_pClipper ? s->m_pClipper->m_pMask.get() : NULL;
 
 #ifdef _VSMOD // patch m006. moveable vector clip
         MOD_MOVEVC mod_vc;
         mod_vc.spd = CSize(spd.w, spd.h);
-        //mod_vc.alphamask = pAlphaMask;
+        //mod_vc.mask = pClipMask;
         mod_vc.size = s->m_pClipper ? s->m_pClipper->m_size : CSize(0, 0);
 #endif
 
@@ -4603,18 +4855,51 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
 
         if(!fOrgOverride) org2 = org;
 
-        CPoint p, p2(0, r.top);
+        LSubPlacement sp;
+        sp.entry = entry;
+        sp.s = s;
+        sp.time = m_time;
+        sp.alpha = alpha;
+        sp.clipRect = clipRect;
+        sp.pClipMask = pClipMask;
+        sp.org = org;
+        sp.org2 = org2;
+        sp.p2 = CPoint(0, r.top);
+#ifdef _VSMOD // patch m006. moveable vector clip
+        sp.mod_vc = mod_vc;
+#endif
+        placements.Add(sp);
+    }
+
+    // Only the compositing below has to be serial and in order. The passes rasterize again
+    // when they need a word at another subpixel phase than the one it was prepared at.
+    if(m_fParallelRasterize)
+        RasterizeWordsAhead(placements);
+
+    for(size_t i = 0; i < placements.GetCount(); i++)
+    {
+        LSubPlacement& sp = placements[i];
+
+        CSubtitle* s = sp.s;
+        CRect& clipRect = sp.clipRect;
+        const CClipMask* pClipMask = sp.pClipMask;
+        int alpha = sp.alpha;
+        CPoint org = sp.org, org2 = sp.org2;
+#ifdef _VSMOD // patch m006. moveable vector clip
+        MOD_MOVEVC& mod_vc = sp.mod_vc;
+#endif
+        m_time = sp.time;
+
+        CPoint p, p2 = sp.p2;
 
         POSITION pos;
 
         p = p2;
 
-        // Rectangles for inverse clip
-        CRect iclipRect[4];
-        iclipRect[0] = CRect(0, 0, spd.w, clipRect.top);
-        iclipRect[1] = CRect(0, clipRect.top, clipRect.left, clipRect.bottom);
-        iclipRect[2] = CRect(clipRect.right, clipRect.top, spd.w, clipRect.bottom);
-        iclipRect[3] = CRect(0, clipRect.bottom, spd.w, spd.h);
+        // Inverse clip draws the whole frame but the rectangle, in one pass
+        CClipRegion clip = s->m_clipInverse ? CClipRegion(CRect(0, 0, spd.w, spd.h), clipRect) : CClipRegion(clipRect);
+
+        CRect bboxSub(0, 0, 0, 0);
 
         pos = s->GetHeadPosition();
         while(pos)
@@ -4626,29 +4911,9 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
                   :							   org.x - (l->m_width / 2);
 
 #ifdef _VSMOD // patch m006. moveable vector clip
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintShadow(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintShadow(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintShadow(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintShadow(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
-            else
-            {
-                bbox2 |= l->PaintShadow(spd, clipRect, pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
+            bboxSub |= l->PaintShadow(spd, clip, pClipMask, p, org2, m_time, alpha, mod_vc, rt);
 #else
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintShadow(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintShadow(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintShadow(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintShadow(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha);
-            }
-            else
-            {
-                bbox2 |= l->PaintShadow(spd, clipRect, pAlphaMask, p, org2, m_time, alpha);
-            }
+            bboxSub |= l->PaintShadow(spd, clip, pClipMask, p, org2, m_time, alpha);
 #endif
             p.y += l->m_ascent + l->m_descent;
         }
@@ -4665,29 +4930,9 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
                   :							   org.x - (l->m_width / 2);
 
 #ifdef _VSMOD // patch m006. moveable vector clip
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintOutline(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintOutline(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintOutline(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintOutline(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
-            else
-            {
-                bbox2 |= l->PaintOutline(spd, clipRect, pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
+            bboxSub |= l->PaintOutline(spd, clip, pClipMask, p, org2, m_time, alpha, mod_vc, rt);
 #else
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintOutline(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintOutline(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintOutline(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintOutline(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha);
-            }
-            else
-            {
-                bbox2 |= l->PaintOutline(spd, clipRect, pAlphaMask, p, org2, m_time, alpha);
-            }
+            bboxSub |= l->PaintOutline(spd, clip, pClipMask, p, org2, m_time, alpha);
 #endif
             p.y += l->m_ascent + l->m_descent;
         }
@@ -4704,46 +4949,34 @@ STDMETHODIMP CRenderedTextSubtitle::Render(SubPicDesc& spd, REFERENCE_TIME rt, d
                   :							   org.x - (l->m_width / 2);
 
 #ifdef _VSMOD // patch m006. moveable vector clip
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintBody(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintBody(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintBody(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-                bbox2 |= l->PaintBody(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
-            else
-            {
-                bbox2 |= l->PaintBody(spd, clipRect, pAlphaMask, p, org2, m_time, alpha, mod_vc, rt);
-            }
+            bboxSub |= l->PaintBody(spd, clip, pClipMask, p, org2, m_time, alpha, mod_vc, rt);
 #else
-            if(s->m_clipInverse)
-            {
-                bbox2 |= l->PaintBody(spd, iclipRect[0], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintBody(spd, iclipRect[1], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintBody(spd, iclipRect[2], pAlphaMask, p, org2, m_time, alpha);
-                bbox2 |= l->PaintBody(spd, iclipRect[3], pAlphaMask, p, org2, m_time, alpha);
-            }
-            else
-            {
-                bbox2 |= l->PaintBody(spd, clipRect, pAlphaMask, p, org2, m_time, alpha);
-            }
+            bboxSub |= l->PaintBody(spd, clip, pClipMask, p, org2, m_time, alpha);
 #endif
             p.y += l->m_ascent + l->m_descent;
         }
+
+        if(!bboxSub.IsRectEmpty())
+            rects.AddTail(bboxSub);
 #if defined (_VSMOD) && defined(_LUA)
         // Remove user data
         {
             CStringA index;
-            index.Format("sub_%d", m_entry);
+            index.Format("sub_%d", sp.entry);
             lua_pushnil(L);
             lua_setglobal(L, index);
         }
 #endif
     }
 
-    bbox = bbox2;
+    MergeDirtyRects(rects);
+
+    Rasterizer::GetTileStats(m_tilesSkipped, m_tilesVisited);
+#if defined(_VSMOD) && defined(_LUA)
+    CMyLua::GetLuaStats(m_luaCalls, m_luaTime);
+#endif
 
-    return (subs.GetCount() && !bbox2.IsRectEmpty()) ? S_OK : S_FALSE;
+    return (subs.GetCount() && !rects.IsEmpty()) ? S_OK : S_FALSE;
 }
 
 // IPersist
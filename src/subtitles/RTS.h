@@ -23,6 +23,7 @@
 
 #include "STS.h"
 #include "Rasterizer.h"
+#include "RenderingCache.h"
 #include "..\SubPic\ISubPic.h"
 
 class CMyFont : public CFont
@@ -34,10 +35,20 @@ public:
 };
 
 class CPolygon;
+class CWord;
+
+// A word rasterized ahead of the painting passes, possibly on another thread
+struct CWordRasterJob
+{
+    CWord* w;
+    CPoint p, morg;
+    bool fOk;
+};
 
 class CWord : public Rasterizer
 {
     bool m_fDrawn;
+    bool m_fOutlined; // the outlines exist, the overlay may have come from the cache without them
     CPoint m_p;
     
 #if defined (_VSMOD) && defined(_LUA)
@@ -48,11 +59,19 @@ class CWord : public Rasterizer
 
     bool CreateOpaqueBox();
 
+    bool IsOverlayCacheable();
+    COverlayKey GetOverlayKey(CPoint p, CPoint morg);
+    void StoreOverlay(const COverlayKey& key);
+    bool BuildOutline(CPoint morg);
+    bool RasterizeOverlay(CPoint p, CPoint morg);
+    bool CanRasterizeAhead();
+
 protected:
     double m_scalex, m_scaley;
     CStringW m_str;
 
     virtual bool CreatePath() = 0;
+    virtual void GetPathKind(bool& fPolygon, int& baseline) { fPolygon = false; baseline = 0; }
 
 public:
     bool m_fWhiteSpaceChar, m_fLineBreak;
@@ -63,6 +82,8 @@ public:
 
     bool isOpaqueBox;
 
+    COverlayCache* m_pOverlayCache; // shared by the words of a CRenderedTextSubtitle, NULL: no caching
+
     int m_ktype, m_kstart, m_kend;
 
     int m_width, m_ascent, m_descent;
@@ -78,6 +99,13 @@ public:
 #else
     void Paint(CPoint p, CPoint org);
 #endif
+
+    // Paint in three steps, for rasterizing the words of a frame in parallel: PreparePaint does
+    // what has to stay serial (GDI paths, the overlay cache) and queues the rest, RasterizeAhead
+    // may run on any thread, FinishPaint takes the result back before the word is painted
+    void PreparePaint(CPoint p, CPoint org, CAtlArray<CWordRasterJob>& jobs);
+    void RasterizeAhead(CWordRasterJob& job);
+    void FinishPaint(const CWordRasterJob& job);
 };
 
 class CText : public CWord
@@ -107,6 +135,7 @@ protected:
     CAtlArray<CPoint> m_pathPointsOrg;
 
     virtual bool CreatePath();
+    virtual void GetPathKind(bool& fPolygon, int& baseline) { fPolygon = true; baseline = m_baseline; }
 
 public:
     CPolygon(STSStyle& style, CStringW str, int ktype, int kstart, int kend, double scalex, double scaley, int baseline);
@@ -125,17 +154,21 @@ private:
 public:
 #if defined (_VSMOD) && defined(_LUA)
     CString LuaStyle;
-    CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CString LuaStyle, lua_State * L, std::wofstream * LuaLog, int entry);
+    CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CString LuaStyle, lua_State * L, std::wofstream * LuaLog, int entry, CClipMaskCache* pCache);
 
     void ParseLuaTable(STSStyle& style, CPoint & pos, CPoint & org);
 #else
-    CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse);
+    CClipper(CStringW str, CSize size, double scalex, double scaley, bool inverse, CClipMaskCache* pCache);
 #endif
     virtual ~CClipper();
 
+    // Replaces the mask with a private one covering the whole frame (pitch m_size.cx),
+    // for the effects that fade it in place
+    BYTE* GetFullFrameMask();
+
     CSize m_size;
     bool m_inverse;
-    BYTE* m_pAlphaMask;
+    CClipMaskSharedPtr m_pMask;	// may be shared with other clippers through the cache
 };
 
 class CLine : public CAtlList<CWord*>
@@ -147,14 +180,17 @@ public:
 
     void Compact();
 
+    CPoint GetWordPos(const CWord* w, CPoint p, bool fShadow) const;
+    void PreparePaint(CPoint p, CPoint org, CAtlArray<CWordRasterJob>& jobs);
+
 #ifdef _VSMOD // patch m006. moveable vector clip
-    CRect PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
-    CRect PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
-    CRect PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
+    CRect PaintShadow(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
+    CRect PaintOutline(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
+    CRect PaintBody(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha, MOD_MOVEVC& mod_vc, REFERENCE_TIME rt);
 #else
-    CRect PaintShadow(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha);
-    CRect PaintOutline(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha);
-    CRect PaintBody(SubPicDesc& spd, CRect& clipRect, BYTE* pAlphaMask, CPoint p, CPoint org, int time, int alpha);
+    CRect PaintShadow(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha);
+    CRect PaintOutline(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha);
+    CRect PaintBody(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, CPoint p, CPoint org, int time, int alpha);
 #endif
 };
 
@@ -247,6 +283,17 @@ class CRenderedTextSubtitle : public CSimpleTextSubtitle, public ISubPicProvider
 
     CScreenLayoutAllocator m_sla;
 
+    COverlayCache m_overlayCache;
+    CClipMaskCache m_clipMaskCache;
+
+    int m_tilesSkipped, m_tilesVisited; // overlay tiles of the last rendered frame
+#if defined(_VSMOD) && defined(_LUA)
+    int m_luaCalls; // Lua handler calls of the last rendered frame
+    double m_luaTime; // and the time spent in them, ms
+#endif
+
+    bool m_fParallelRasterize;
+
 #if defined(_VSMOD) && defined(_LUA)
     int   m_entry; // Id of line
 
@@ -275,6 +322,8 @@ class CRenderedTextSubtitle : public CSimpleTextSubtitle, public ISubPicProvider
 
 #if defined(_VSMOD) && defined(_LUA)
     void ParseLuaTable(CSubtitle* sub, STSStyle& style);
+    // Pushes the line table of m_entry for a tag handler, with the times of this call
+    void PushLuaLineTable(bool fAnimate);
 #endif
 
     double CalcAnimation(double dst, double src, bool fAnimate);
@@ -298,6 +347,34 @@ public:
         if(styleOverride != NULL) m_pStyleOverride = styleOverride;
     }
 
+    // memory the rasterized words of this RTS may keep around for reuse, 0 disables the cache
+    void SetOverlayCacheBudget(size_t bytes)
+    {
+        m_overlayCache.SetMaxSize(bytes);
+    }
+
+    // rasterize the words of a frame on the task pool before painting them, on by default
+    void SetParallelRasterization(bool fEnable)
+    {
+        m_fParallelRasterize = fEnable;
+    }
+
+    // overlay tiles Render left out because they had no coverage, and those it mixed, in the last frame
+    void GetTileStats(int& skipped, int& visited)
+    {
+        skipped = m_tilesSkipped;
+        visited = m_tilesVisited;
+    }
+
+#if defined(_VSMOD) && defined(_LUA)
+    // Lua handler calls in the last frame and the milliseconds they took
+    void GetLuaStats(int& calls, double& ms)
+    {
+        calls = m_luaCalls;
+        ms = m_luaTime;
+    }
+#endif
+
 public:
     bool Init(CSize size, CRect vidrect); // will call Deinit()
     void Deinit();
@@ -312,6 +389,7 @@ public:
     STDMETHODIMP_(REFERENCE_TIME) GetStop(POSITION pos, double fps);
     STDMETHODIMP_(bool) IsAnimated(POSITION pos);
     STDMETHODIMP Render(SubPicDesc& spd, REFERENCE_TIME rt, double fps, RECT& bbox);
+    STDMETHODIMP RenderEx(SubPicDesc& spd, REFERENCE_TIME rt, double fps, CAtlList<CRect>& rects);
 
     // IPersist
     STDMETHODIMP GetClassID(CLSID* pClassID);
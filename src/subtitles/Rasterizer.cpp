@@ -24,6 +24,7 @@
 #include <math.h>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include "Rasterizer.h"
 #include "SeparableFilter.h"
 #include "OverlayMix.h"
@@ -38,14 +39,136 @@
 #define _IMPL_MIN _MIN
 #endif
 
+///////////////////////////////////////////////////////////////////////////
+
+static std::atomic<__int64> s_arenaAllocsAvoided(0);
+static std::atomic<__int64> s_arenaHeapAllocs(0);
+static std::atomic<size_t> s_arenaPeakSize(0);
+
+CRasterizerArena::CRasterizerArena() : m_cur(0), m_offset(0), m_last(NULL)
+{
+}
+
+CRasterizerArena::~CRasterizerArena()
+{
+    for(size_t i = 0; i < m_chunks.size(); i++)
+        _aligned_free(m_chunks[i].base);
+}
+
+CRasterizerArena& CRasterizerArena::GetThreadArena()
+{
+    static thread_local CRasterizerArena arena;
+    return arena;
+}
+
+void* CRasterizerArena::Alloc(size_t size)
+{
+    size = (size + 15) & ~15;
+
+    if(m_cur >= m_chunks.size() || m_offset + size > m_chunks[m_cur].size)
+    {
+        // Move on to the next chunk that is large enough, or add one
+        size_t next = m_chunks.empty() ? 0 : m_cur + 1;
+        while(next < m_chunks.size() && m_chunks[next].size < size) next++;
+
+        if(next == m_chunks.size())
+        {
+            size_t chunkSize = m_chunks.empty() ? 0x10000 : m_chunks.back().size * 2;
+            while(chunkSize < size) chunkSize *= 2;
+
+            Chunk c;
+            c.base = (BYTE*)_aligned_malloc(chunkSize, 16);
+            if(!c.base) return NULL;
+            c.size = chunkSize;
+            c.start = m_chunks.empty() ? 0 : m_chunks.back().start + m_chunks.back().size;
+            m_chunks.push_back(c);
+
+            s_arenaHeapAllocs++;
+        }
+        else
+        {
+            s_arenaAllocsAvoided++;
+        }
+
+        m_cur = next;
+        m_offset = 0;
+    }
+    else
+    {
+        s_arenaAllocsAvoided++;
+    }
+
+    m_last = m_chunks[m_cur].base + m_offset;
+    m_offset += size;
+
+    UpdatePeak();
+
+    return m_last;
+}
+
+void* CRasterizerArena::Grow(void* p, size_t oldSize, size_t newSize)
+{
+    if(p && p == m_last)
+    {
+        size_t offset = (BYTE*)p - m_chunks[m_cur].base;
+        if(offset + newSize <= m_chunks[m_cur].size)
+        {
+            m_offset = offset + ((newSize + 15) & ~15);
+            s_arenaAllocsAvoided++;
+            UpdatePeak();
+            return p;
+        }
+    }
+
+    void* q = Alloc(newSize);
+    if(q && p) memcpy(q, p, min(oldSize, newSize));
+    return q;
+}
+
+void CRasterizerArena::UpdatePeak()
+{
+    size_t used = m_chunks[m_cur].start + m_offset;
+    size_t peak = s_arenaPeakSize;
+    while(used > peak && !s_arenaPeakSize.compare_exchange_weak(peak, used));
+}
+
+CRasterizerArena::Mark CRasterizerArena::GetMark() const
+{
+    Mark mark = {m_cur, m_offset};
+    return mark;
+}
+
+void CRasterizerArena::Release(const Mark& mark)
+{
+    m_cur = mark.chunk;
+    m_offset = mark.offset;
+    m_last = NULL;
+}
+
+void CRasterizerArena::Reset()
+{
+    m_cur = m_offset = 0;
+    m_last = NULL;
+}
+
+void CRasterizerArena::GetStats(__int64& allocsAvoided, __int64& heapAllocs, size_t& peakSize)
+{
+    allocsAvoided = s_arenaAllocsAvoided;
+    heapAllocs = s_arenaHeapAllocs;
+    peakSize = s_arenaPeakSize;
+}
+
+///////////////////////////////////////////////////////////////////////////
+
 int Rasterizer::getOverlayWidth()
 {
     return mOverlayWidth * 8;
 }
 
-Rasterizer::Rasterizer() : mpPathTypes(NULL), mpPathPoints(NULL), mPathPoints(0), mpOverlayBuffer(NULL)
+Rasterizer::Rasterizer() : mpPathTypes(NULL), mpPathPoints(NULL), mPathPoints(0), mpOverlayBuffer(NULL), mpOverlayBorder(NULL), mOverlayBufferSize(0)
 {
-    mOverlayWidth = mOverlayHeight = 0;
+    mOverlayWidth = mOverlayHeight = mOverlayPitch = 0;
+    mTilesX = mTilesY = 0;
     mPathOffsetX = mPathOffsetY = 0;
     mOffsetX = mOffsetY = 0;
 }
@@ -67,14 +190,15 @@ void Rasterizer::_TrashPath()
 
 void Rasterizer::_TrashOverlay()
 {
-    delete [] mpOverlayBuffer;
-    mpOverlayBuffer = NULL;
+    _aligned_free(mpOverlayBuffer);
+    mpOverlayBuffer = mpOverlayBorder = NULL;
+    mOverlayBufferSize = 0;
 }
 
 void Rasterizer::_ReallocEdgeBuffer(int edges)
 {
+    mpEdgeBuffer = (Edge*)CRasterizerArena::GetThreadArena().Grow(mpEdgeBuffer, sizeof(Edge) * mEdgeHeapSize, sizeof(Edge) * edges);
     mEdgeHeapSize = edges;
-    mpEdgeBuffer = (Edge*)realloc(mpEdgeBuffer, sizeof(Edge) * edges);
 }
 
 void Rasterizer::_EvaluateBezier(int ptbase, bool fBSpline)
@@ -334,8 +458,9 @@ bool Rasterizer::PartialEndPath(HDC hdc, long dx, long dy)
         if(pNewPoints)
             mpPathPoints = pNewPoints;
 
-        BYTE* pTypes = DNew BYTE[nPoints];
-        POINT* pPoints = DNew POINT[nPoints];
+        CRasterizerArenaScope scratch;
+        BYTE* pTypes = scratch.Alloc<BYTE>(nPoints);
+        POINT* pPoints = scratch.Alloc<POINT>(nPoints);
 
         if(pNewTypes && pNewPoints && nPoints == GetPath(hdc, pPoints, pTypes, nPoints))
         {
@@ -348,15 +473,10 @@ bool Rasterizer::PartialEndPath(HDC hdc, long dx, long dy)
 
             mPathPoints += nPoints;
 
-            delete[] pTypes;
-            delete[] pPoints;
             return true;
         }
         else
             DebugBreak();
-
-        delete[] pTypes;
-        delete[] pPoints;
     }
 
     ::AbortPath(hdc);
@@ -425,17 +545,30 @@ bool Rasterizer::ScanConvert()
     mPathOffsetX = minx;
     mPathOffsetY = miny;
 
-    // Initialize edge buffer.  We use edge 0 as a sentinel.
+    // Scratch buffers come from the thread's arena and go back to it on return.
 
-    mEdgeNext = 1;
-    mEdgeHeapSize = 2048;
-    mpEdgeBuffer = (Edge*)malloc(sizeof(Edge) * mEdgeHeapSize);
+    CRasterizerArenaScope scratch;
 
     // Initialize scanline list.
 
-    mpScanBuffer = DNew size_t[mHeight];
+    mpScanBuffer = scratch.Alloc<size_t>(mHeight);
     memset(mpScanBuffer, 0, mHeight * sizeof(size_t));
 
+    // Initialize edge buffer.  We use edge 0 as a sentinel.
+    // It is allocated last so that it can grow in place.
+
+    // A segment crosses at most |dy| / 8 + 1 scanlines, a curve never varies more vertically
+    // than its control polygon and a closing line no more than its figure, which bounds the
+    // edge count up front in all but degenerate cases; the buffer can still grow past it.
+
+    size_t edgeBound = 0;
+    for(i = 1; i < mPathPoints; ++i)
+        edgeBound += (abs(mpPathPoints[i].y - mpPathPoints[i - 1].y) >> 3) + 1;
+
+    mEdgeNext = 1;
+    mEdgeHeapSize = max(2 * edgeBound + 1, (size_t)2048);
+    mpEdgeBuffer = scratch.Alloc<Edge>(mEdgeHeapSize);
+
     // Scan convert the outline.  Yuck, Bezier curves....
 
     // Unfortunately, Windows 95/98 GDI has a bad habit of giving us text
@@ -491,7 +624,9 @@ bool Rasterizer::ScanConvert()
     // a scanline's worth of edges from the singly-linked lists, and another
     // to collect the actual scans.
 
-    std::vector<int> heap;
+    // No scanline can hold more edges than there are in total.
+
+    int* heap = scratch.Alloc<int>(mEdgeNext);
 
     mOutline.reserve(mEdgeNext / 2);
 
@@ -500,25 +635,26 @@ bool Rasterizer::ScanConvert()
     for(y = 0; y < mHeight; ++y)
     {
         int count = 0;
+        size_t heapSize = 0;
 
         // Detangle scanline into edge heap.
 
         for(size_t ptr = (mpScanBuffer[y] & size_t(-1)); ptr; ptr = mpEdgeBuffer[ptr].next)
         {
-            heap.push_back(mpEdgeBuffer[ptr].posandflag);
+            heap[heapSize++] = mpEdgeBuffer[ptr].posandflag;
         }
 
         // Sort edge heap.  Note that we conveniently made the opening edges
         // one more than closing edges at the same spot, so we won't have any
         // problems with abutting spans.
 
-        std::sort(heap.begin(), heap.end()/*begin() + heap.size()*/);
+        std::sort(heap, heap + heapSize);
 
         // Process edges and add spans.  Since we only check for a non-zero
         // winding number, it doesn't matter which way the outlines go!
 
-        std::vector<int>::iterator itX1 = heap.begin();
-        std::vector<int>::iterator itX2 = heap.end(); // begin() + heap.size();
+        int* itX1 = heap;
+        int* itX2 = heap + heapSize;
 
         size_t x1, x2;
 
@@ -542,14 +678,12 @@ bool Rasterizer::ScanConvert()
                     mOutline.push_back(std::pair<__int64, __int64>((y << 32) + x1 + 0x4000000040000000i64, (y << 32) + x2 + 0x4000000040000000i64)); // G: damn Avery, this is evil! :)
             }
         }
-
-        heap.clear();
     }
 
-    // Dump the edge and scan buffers, since we no longer need them.
+    // The edge and scan buffers go back to the arena with the scope.
 
-    free(mpEdgeBuffer);
-    delete [] mpScanBuffer;
+    mpEdgeBuffer = NULL;
+    mpScanBuffer = NULL;
 
     // All done!
 
@@ -560,11 +694,13 @@ using namespace std;
 
 void Rasterizer::_OverlapRegion(tSpanBuffer& dst, tSpanBuffer& src, int dx, int dy)
 {
-    tSpanBuffer temp;
-
-    temp.reserve(dst.size() + src.size());
+    // temp takes the old contents of dst, dst gets temp's storage back. Both keep
+    // their capacity from call to call, so merging does not hit the heap.
+    static thread_local tSpanBuffer temp;
 
+    temp.clear();
     dst.swap(temp);
+    dst.reserve(temp.size() + src.size());
 
     tSpanBuffer::iterator itA = temp.begin();
     tSpanBuffer::iterator itAE = temp.end();
@@ -680,6 +816,32 @@ void Rasterizer::_OverlapRegion(tSpanBuffer& dst, tSpanBuffer& src, int dx, int
     }
 }
 
+// VSFILTER_WIDEN=spans|grid|auto picks the engine for the whole process, like VSFILTER_SIMD
+static Rasterizer::WideningMode GetWideningModeFromEnv()
+{
+    char env[16];
+    size_t len = 0;
+    if(!getenv_s(&len, env, sizeof(env), "VSFILTER_WIDEN") && len > 0)
+    {
+        if(!_stricmp(env, "grid")) return Rasterizer::WIDEN_GRID;
+        if(!_stricmp(env, "auto")) return Rasterizer::WIDEN_AUTO;
+    }
+
+    return Rasterizer::WIDEN_SPANS;
+}
+
+static Rasterizer::WideningMode s_wideningMode = GetWideningModeFromEnv();
+
+void Rasterizer::SetWideningMode(WideningMode mode)
+{
+    s_wideningMode = mode;
+}
+
+Rasterizer::WideningMode Rasterizer::GetWideningMode()
+{
+    return s_wideningMode;
+}
+
 bool Rasterizer::CreateWidenedRegion(int rx, int ry)
 {
     if(rx < 0) rx = 0;
@@ -687,6 +849,29 @@ bool Rasterizer::CreateWidenedRegion(int rx, int ry)
 
     mWideBorder = max(rx, ry);
 
+    if(rx == 0 && ry == 0)
+        return true;
+
+    WideningMode mode = s_wideningMode;
+
+    if(mode == WIDEN_AUTO)
+    {
+        // A span merge costs roughly as much as a few dozen grid cells.
+        __int64 spanCost = __int64(2 * ry + 1) * mOutline.size() * 32;
+        __int64 gridCost = __int64(mWidth + 2 * rx) * (mHeight + 2 * ry);
+
+        mode = gridCost < spanCost ? WIDEN_GRID : WIDEN_SPANS;
+    }
+
+    // The grid engine needs a few rows of subpixel mask, use the spans if there is no memory for them
+    if(mode != WIDEN_GRID || !_WidenRegionGrid(rx, ry))
+        _WidenRegionSpans(rx, ry);
+
+    return true;
+}
+
+void Rasterizer::_WidenRegionSpans(int rx, int ry)
+{
     if(ry > 0)
     {
         // Do a half circle.
@@ -704,6 +889,165 @@ bool Rasterizer::CreateWidenedRegion(int rx, int ry)
         _OverlapRegion(mWideOutline, mOutline, rx, 0);
         _OverlapRegion(mWideOutline, mOutline, rx, 0);
     }
+}
+
+// Mask rows the grid engine keeps at a time, so a full-frame drawing with a wide border
+// does not pin a subpixel mask of the whole frame in the arena
+#define WIDEN_GRID_BAND_BYTES (1 << 20)
+
+// reach[x]: how far up and down cell x of a row reaches through the spans [first, last)
+// of that row, -1 where it is more than rx subpixels from all of them
+void Rasterizer::_WidenGridRowReach(const tSpanBuffer& outline, size_t first, size_t last, int rx, const int* reachOf, int* reach, int w)
+{
+    // Distance to the end of the previous span, left to right
+    int prevEnd = INT_MIN / 2;
+    size_t k = first;
+    for(int x = 0; x < w; x++)
+    {
+        for(; k < last && (int)(outline[k].second & 0xffffffff) - 0x40000000 + rx <= x; k++)
+            prevEnd = (int)(outline[k].second & 0xffffffff) - 0x40000000 + rx;
+
+        reach[x] = (k < last && (int)(outline[k].first & 0xffffffff) - 0x40000000 + rx <= x) ? 0 : x - prevEnd + 1;
+    }
+
+    // Distance to the start of the next span, right to left
+    int nextStart = INT_MAX / 2;
+    k = last;
+    for(int x = w - 1; x >= 0; x--)
+    {
+        for(; k > first && (int)(outline[k - 1].first & 0xffffffff) - 0x40000000 + rx > x; k--)
+            nextStart = (int)(outline[k - 1].first & 0xffffffff) - 0x40000000 + rx;
+
+        int d = min(reach[x], nextStart - x);
+        reach[x] = d <= rx ? reachOf[d] : -1;
+    }
+}
+
+// Dilates mOutline with the same discrete ellipse _WidenRegionSpans uses, but on the
+// subpixel grid: each row gets the horizontal distance to its nearest span, which is
+// turned into how far up and down that cell reaches, and two vertical sweeps then
+// collect the union. The cost is linear in the widened area whatever the radius is.
+// Unlike the span merge, the resulting spans never overlap each other.
+// The output is built in bands of rows, each sweep starting ry rows outside the band
+// since no cell reaches further than that. Returns false if the scratch memory could
+// not be had.
+bool Rasterizer::_WidenRegionGrid(int rx, int ry)
+{
+    mWideOutline.clear();
+
+    if(mOutline.empty())
+        return true;
+
+    CRasterizerArenaScope scratch;
+
+    int w = mWidth + 2 * rx;
+    int h = mHeight + 2 * ry;
+
+    int band = max(2 * ry, WIDEN_GRID_BAND_BYTES / w);
+    if(band > h) band = h;
+    if(band < 1) band = 1;
+
+    // reachOf[d]: largest |dy| at which a cell d subpixels away from a span is still covered
+    int* reachOf = scratch.Alloc<int>(rx + 1);
+    // First span of every input row; mOutline is sorted by row
+    size_t* rows = scratch.Alloc<size_t>(mHeight + 1);
+    int* reach = scratch.Alloc<int>(w);
+    int* down = scratch.Alloc<int>(w);
+    int* up = scratch.Alloc<int>(w);
+    byte* mask = scratch.Alloc<byte>((size_t)w * band);
+
+    if(!reachOf || !rows || !reach || !down || !up || !mask)
+        return false;
+
+    for(int d = 0; d <= rx; d++) reachOf[d] = -1;
+
+    for(int dy = ry; dy >= 0; --dy)
+    {
+        int x = ry > 0 ? (int)(0.5 + sqrt(float(ry * ry - dy * dy)) * float(rx) / float(ry)) : rx;
+        if(x > rx) x = rx;
+
+        for(int d = 0; d <= x; ++d)
+            if(reachOf[d] < 0) reachOf[d] = dy;
+    }
+
+    for(int y = 0; y <= mHeight; y++) rows[y] = mOutline.size();
+
+    for(size_t i = mOutline.size(); i-- > 0;)
+        rows[(size_t)((mOutline[i].first >> 32) - 0x40000000)] = i;
+    for(int y = mHeight - 1; y >= 0; --y)
+        if(rows[y] > rows[y + 1]) rows[y] = rows[y + 1];
+
+    for(int p0 = 0; p0 < h; p0 += band)
+    {
+        int p1 = min(p0 + band, h);
+
+        for(int x = 0; x < w; x++)
+        {
+            down[x] = INT_MIN;
+            up[x] = INT_MAX;
+        }
+
+        // Downward sweep, rows up to ry above the band still reach into it
+        for(int p = max(p0 - ry, 0); p < p1; p++)
+        {
+            int y = p - ry;
+
+            if(y >= 0 && y < mHeight && rows[y] < rows[y + 1])
+            {
+                _WidenGridRowReach(mOutline, rows[y], rows[y + 1], rx, reachOf, reach, w);
+
+                for(int x = 0; x < w; x++)
+                    if(reach[x] >= 0 && p + reach[x] > down[x]) down[x] = p + reach[x];
+            }
+
+            if(p >= p0)
+            {
+                byte* m = &mask[(size_t)(p - p0) * w];
+                for(int x = 0; x < w; x++) m[x] = down[x] >= p;
+            }
+        }
+
+        // Upward sweep, rows up to ry below the band
+        for(int p = min(p1 + ry, h) - 1; p >= p0; p--)
+        {
+            int y = p - ry;
+
+            if(y >= 0 && y < mHeight && rows[y] < rows[y + 1])
+            {
+                _WidenGridRowReach(mOutline, rows[y], rows[y + 1], rx, reachOf, reach, w);
+
+                for(int x = 0; x < w; x++)
+                    if(reach[x] >= 0 && p - reach[x] < up[x]) up[x] = p - reach[x];
+            }
+
+            if(p < p1)
+            {
+                byte* m = &mask[(size_t)(p - p0) * w];
+                for(int x = 0; x < w; x++) m[x] |= up[x] <= p;
+            }
+        }
+
+        // Collect the runs back into spans, in the same biased encoding as mOutline
+        for(int p = p0; p < p1; p++)
+        {
+            const byte* m = &mask[(size_t)(p - p0) * w];
+            unsigned __int64 yofs = (unsigned __int64)(p - ry + 0x40000000) << 32;
+
+            for(int x = 0; x < w;)
+            {
+                if(!m[x])
+                {
+                    x++;
+                    continue;
+                }
+
+                int x1 = x;
+                while(x < w && m[x]) x++;
+
+                mWideOutline.push_back(tSpan(yofs + (unsigned int)(x1 - rx + 0x40000000), yofs + (unsigned int)(x - rx + 0x40000000)));
+            }
+        }
+    }
 
     return true;
 }
@@ -714,13 +1058,193 @@ void Rasterizer::DeleteOutlines()
     mOutline.clear();
 }
 
-bool Rasterizer::Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX, double fGaussianBlurY)
+///////////////////////////////////////////////////////////////////////////
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+// For CPUID usage in the coverage and Draw paths
+#include "../dsutil/vd.h"
+
+// Add full coverage (0x08, one subsample row of 8 subpixels) to 'cells' consecutive
+// cells of one overlay plane.
+typedef void (*FillCoverageRunFunc)(BYTE* dst, size_t cells);
+
+static void FillCoverageRun_c(BYTE* dst, size_t cells)
 {
-    _TrashOverlay();
+    while(cells--)
+        *dst++ += 0x08;
+}
+
+static void FillCoverageRun_sse2(BYTE* dst, size_t cells)
+{
+    const __m128i k = _mm_set1_epi8(0x08);
 
+    for(; cells >= 16; cells -= 16, dst += 16)
+    {
+        __m128i v = _mm_loadu_si128((__m128i*)dst);
+        _mm_storeu_si128((__m128i*)dst, _mm_add_epi8(v, k));
+    }
+
+    FillCoverageRun_c(dst, cells);
+}
+
+static void FillCoverageRun_avx2(BYTE* dst, size_t cells)
+{
+    const __m256i k = _mm256_set1_epi8(0x08);
+
+    for(; cells >= 32; cells -= 32, dst += 32)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i*)dst);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_add_epi8(v, k));
+    }
+
+    FillCoverageRun_sse2(dst, cells);
+}
+
+static void FillCoverageRun_avx512(BYTE* dst, size_t cells)
+{
+    const __m512i k = _mm512_set1_epi8(0x08);
+
+    for(; cells >= 64; cells -= 64, dst += 64)
+        _mm512_storeu_si512(dst, _mm512_add_epi8(_mm512_loadu_si512(dst), k));
+
+    // The rest in one masked step, most runs of a glyph row are shorter than a vector
+    if(cells)
+    {
+        __mmask64 m = ((unsigned __int64)1 << cells) - 1;
+        _mm512_mask_storeu_epi8(dst, m, _mm512_add_epi8(_mm512_maskz_loadu_epi8(m, dst), k));
+    }
+}
+
+// One \be pass over an overlay plane, in place. The 3x3 kernel [1 2 1; 2 4 2; 1 2 1] / 16
+// is split into a horizontal [1 2 1] kept as 16-bit row sums and a vertical [1 2 1] with
+// a single shift at the end, which gives exactly the same result as the direct 3x3 sum.
+// prev and cur hold the horizontal sums of the two rows above the next one, w entries
+// each, so nothing is copied. The outermost rows and columns are left alone.
+template<bool fSSE2>
+static void EdgeBlurPass(BYTE* buf, int w, int h, int pitch, WORD* prev, WORD* cur)
+{
+    // Vectors cover whole interior pixels and also read the pixel right of their last one
+    int vend = fSSE2 ? 1 + ((w - 2) & ~15) : 1;
+
+    // Horizontal sums of the first two rows
+    for(int x = 1; x < w - 1; x++)
+    {
+        prev[x] = buf[x - 1] + (buf[x] << 1) + buf[x + 1];
+        cur[x] = buf[pitch + x - 1] + (buf[pitch + x] << 1) + buf[pitch + x + 1];
+    }
+
+    for(int j = 1; j < h - 1; j++)
+    {
+        BYTE* dst = buf + pitch * j;
+        const BYTE* next = dst + pitch;
+
+        int x = 1;
+        for(; x < vend; x += 16)
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            __m128i l = _mm_loadu_si128((__m128i*)(next + x - 1));
+            __m128i c = _mm_loadu_si128((__m128i*)(next + x));
+            __m128i r = _mm_loadu_si128((__m128i*)(next + x + 1));
+
+            __m128i n0 = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(l, zero), _mm_unpacklo_epi8(r, zero)), _mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 1));
+            __m128i n1 = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero)), _mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 1));
+
+            __m128i p0 = _mm_loadu_si128((__m128i*)(prev + x));
+            __m128i p1 = _mm_loadu_si128((__m128i*)(prev + x + 8));
+            __m128i c0 = _mm_loadu_si128((__m128i*)(cur + x));
+            __m128i c1 = _mm_loadu_si128((__m128i*)(cur + x + 8));
+
+            __m128i o0 = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(p0, n0), _mm_slli_epi16(c0, 1)), 4);
+            __m128i o1 = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(p1, n1), _mm_slli_epi16(c1, 1)), 4);
+
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(o0, o1));
+
+            _mm_storeu_si128((__m128i*)(prev + x), c0);
+            _mm_storeu_si128((__m128i*)(prev + x + 8), c1);
+            _mm_storeu_si128((__m128i*)(cur + x), n0);
+            _mm_storeu_si128((__m128i*)(cur + x + 8), n1);
+        }
+
+        for(; x < w - 1; x++)
+        {
+            WORD n = next[x - 1] + (next[x] << 1) + next[x + 1];
+            dst[x] = (BYTE)((prev[x] + (cur[x] << 1) + n) >> 4);
+            prev[x] = cur[x];
+            cur[x] = n;
+        }
+    }
+}
+
+template<bool fSSE2>
+static void BoxBlurPasses(BYTE* buf, BYTE* tmp, int w, int h, int pitch, const BoxBlurKernel& box, int direction, void* scratch)
+{
+    BoxBlur(buf, tmp, w, h, pitch, box, direction, scratch, fSSE2);
+}
+
+typedef void (*EdgeBlurPassFunc)(BYTE* buf, int w, int h, int pitch, WORD* prev, WORD* cur);
+typedef void (*BoxBlurFunc)(BYTE* buf, BYTE* tmp, int w, int h, int pitch, const BoxBlurKernel& box, int direction, void* scratch);
+
+// The coverage and blur kernels of each tier, the blurs have none wider than SSE2
+struct CRasterizerFuncs
+{
+    FillCoverageRunFunc fillCoverageRun;
+    EdgeBlurPassFunc edgeBlurPass;
+    BoxBlurFunc boxBlur;
+};
+
+static const CRasterizerFuncs& GetRasterizerFuncs()
+{
+    static const CRasterizerFuncs tiers[CCpuID::tier_count] =
+    {
+        {FillCoverageRun_c, EdgeBlurPass<false>, BoxBlurPasses<false>},
+        {FillCoverageRun_sse2, EdgeBlurPass<true>, BoxBlurPasses<true>},
+        {FillCoverageRun_avx2, EdgeBlurPass<true>, BoxBlurPasses<true>},
+        {FillCoverageRun_avx512, EdgeBlurPass<true>, BoxBlurPasses<true>},
+    };
+
+    return SelectTier(tiers);
+}
+
+// The overlay outlives Rasterize (Draw reads it), so it is not arena memory, but
+// re-rasterizing the same word at another subpixel phase can reuse it.
+void Rasterizer::_ReallocOverlay(int width, int height)
+{
+    mOverlayWidth = width;
+    mOverlayHeight = height;
+    mOverlayPitch = (width + OVERLAY_ALIGN - 1) & ~(OVERLAY_ALIGN - 1);
+
+    size_t size = GetOverlaySize();
+    if(size > mOverlayBufferSize)
+    {
+        _TrashOverlay();
+        mpOverlayBuffer = (byte*)_aligned_malloc(size, OVERLAY_ALIGN);
+        mOverlayBufferSize = size;
+    }
+
+    mpOverlayBorder = mpOverlayBuffer + mOverlayPitch * mOverlayHeight;
+}
+
+void Rasterizer::SetOverlay(int width, int height, int offsetX, int offsetY, const byte* src)
+{
+    _ReallocOverlay(width, height);
+    mOffsetX = offsetX;
+    mOffsetY = offsetY;
+
+    if(size_t overlaySize = GetOverlaySize())
+        memcpy(mpOverlayBuffer, src, overlaySize);
+
+    _BuildTileMap();
+}
+
+bool Rasterizer::Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX, double fGaussianBlurY)
+{
     if(!mWidth || !mHeight)
     {
-        mOverlayWidth = mOverlayHeight = 0;
+        _ReallocOverlay(0, 0);
+        _BuildTileMap();
         return true;
     }
 
@@ -764,15 +1288,17 @@ bool Rasterizer::Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX,
         mOffsetY -= mWideBorder + bluradjust;
     }
 
-    mOverlayWidth = ((width + 7) >> 3) + 1;
-    mOverlayHeight = ((height + 14) >> 3) + 1;
+    _ReallocOverlay(((width + 7) >> 3) + 1, ((height + 14) >> 3) + 1);
+    memset(mpOverlayBuffer, 0, GetOverlaySize());
 
-    mpOverlayBuffer = DNew byte[2 * mOverlayWidth * mOverlayHeight];
-    memset(mpOverlayBuffer, 0, 2 * mOverlayWidth * mOverlayHeight);
+    CRasterizerArenaScope scratch;
 
     // Are we doing a border?
 
     tSpanBuffer* pOutline[2] = {&mOutline, &mWideOutline};
+    byte* pPlane[2] = {mpOverlayBuffer, mpOverlayBorder};
+
+    const CRasterizerFuncs& f = GetRasterizerFuncs();
 
     for(ptrdiff_t i = countof(pOutline) - 1; i >= 0; i--)
     {
@@ -789,19 +1315,20 @@ bool Rasterizer::Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX,
             {
                 size_t first = x1 >> 3;
                 size_t last = (x2 - 1) >> 3;
-                byte* dst = mpOverlayBuffer + 2 * (mOverlayWidth * (y >> 3) + first) + i;
+                byte* dst = pPlane[i] + mOverlayPitch * (y >> 3) + first;
 
                 if(first == last)
                     *dst += x2 - x1;
                 else
                 {
                     *dst += ((first + 1) << 3) - x1;
-                    dst += 2;
+                    dst++;
 
-                    while(++first < last)
+                    size_t cells = last - first - 1;
+                    if(cells)
                     {
-                        *dst += 0x08;
-                        dst += 2;
+                        f.fillCoverageRun(dst, cells);
+                        dst += cells;
                     }
 
                     *dst += x2 - (last << 3);
@@ -816,113 +1343,110 @@ bool Rasterizer::Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX,
         GaussianKernel filter(fGaussianBlur);
         if(mOverlayWidth >= filter.width && mOverlayHeight >= filter.width)
         {
-            size_t pitch = mOverlayWidth * 2;
-
-            byte *tmp = DNew byte[pitch*mOverlayHeight];
+            byte *tmp = scratch.Alloc<byte>(mOverlayPitch * mOverlayHeight);
             if(!tmp) return(false);
 
-            int border = !mWideOutline.empty() ? 1 : 0;
-
-            byte *src = mpOverlayBuffer + border;
+            byte *plane = !mWideOutline.empty() ? mpOverlayBorder : mpOverlayBuffer;
 
-            
-
-            SeparableFilterX<2>(src, tmp, mOverlayWidth, mOverlayHeight, pitch, filter.kernel, filter.width, filter.divisor, direction);
-            SeparableFilterY<2>(tmp, src, mOverlayWidth, mOverlayHeight, pitch, filter.kernel, filter.width, filter.divisor, direction);
-
-            delete[] tmp;
+            if(UseBoxBlur(filter, mOverlayWidth, mOverlayHeight))
+            {
+                // Large radius on a large overlay, the direct convolution would cost O(sigma) per pixel
+                BoxBlurKernel box(filter);
+                void* sums = scratch.Alloc<BYTE>(BoxBlurScratchSize(mOverlayPitch));
+                f.boxBlur(plane, tmp, mOverlayWidth, mOverlayHeight, mOverlayPitch, box, direction, sums);
+            }
+            else
+            {
+                SeparableFilterX<1>(plane, tmp, mOverlayWidth, mOverlayHeight, mOverlayPitch, filter.kernel, filter.width, filter.divisor, direction);
+                SeparableFilterY<1>(tmp, plane, mOverlayWidth, mOverlayHeight, mOverlayPitch, filter.kernel, filter.width, filter.divisor, direction);
+            }
         }
     }
 
     // If we're blurring, do a 3x3 box blur
     // Can't do it on subpictures smaller than 3x3 pixels
-    for(int pass = 0; pass < fBlur; pass++)
+    if(fBlur > 0 && mOverlayWidth >= 3 && mOverlayHeight >= 3)
     {
-        if(mOverlayWidth >= 3 && mOverlayHeight >= 3)
-        {
-            int pitch = mOverlayWidth * 2;
+        // Two rows of horizontal sums, shared by all passes
+        size_t rowSize = mOverlayPitch;
+        WORD* rows = scratch.Alloc<WORD>(2 * rowSize);
 
-            byte* tmp = DNew byte[pitch*mOverlayHeight];
-            if(!tmp) return(false);
+        byte* plane = !mWideOutline.empty() ? mpOverlayBorder : mpOverlayBuffer;
 
-            memcpy(tmp, mpOverlayBuffer, pitch * mOverlayHeight);
+        for(int pass = 0; pass < fBlur; pass++)
+            f.edgeBlurPass(plane, mOverlayWidth, mOverlayHeight, mOverlayPitch, &rows[0], &rows[rowSize]);
+    }
 
-            int border = !mWideOutline.empty() ? 1 : 0;
+    _BuildTileMap();
 
-            // This could be done in a separated way and win some speed
-            for(ptrdiff_t j = 1; j < mOverlayHeight - 1; j++)
-            {
-                byte* src = tmp + pitch * j + 2 + border;
-                byte* dst = mpOverlayBuffer + pitch * j + 2 + border;
+    return true;
+}
 
-                for(ptrdiff_t i = 1; i < mOverlayWidth - 1; i++, src += 2, dst += 2)
-                {
-                    *dst = (src[-2-pitch] + (src[-pitch] << 1) + src[+2-pitch]
-                            + (src[-2] << 1) + (src[0] << 2) + (src[+2] << 1)
-                            + src[-2+pitch] + (src[+pitch] << 1) + src[+2+pitch]) >> 4;
-                }
+void Rasterizer::_BuildTileMap()
+{
+    mTilesX = (mOverlayWidth + OVERLAY_TILE_SIZE - 1) >> OVERLAY_TILE_SHIFT;
+    mTilesY = (mOverlayHeight + OVERLAY_TILE_SIZE - 1) >> OVERLAY_TILE_SHIFT;
+    mTileMap.assign(mTilesX * mTilesY, 0);
+
+    for(int y = 0; y < mOverlayHeight; y++)
+    {
+        const byte* body = mpOverlayBuffer + mOverlayPitch * y;
+        const byte* border = mpOverlayBorder + mOverlayPitch * y;
+        BYTE* tiles = &mTileMap[(y >> OVERLAY_TILE_SHIFT) * mTilesX];
+
+        for(int tx = 0; tx < mTilesX; tx++)
+        {
+            if(tiles[tx] == (OVERLAY_TILE_BODY | OVERLAY_TILE_BORDER)) continue;
+
+            int x = tx << OVERLAY_TILE_SHIFT;
+            int xend = min(x + OVERLAY_TILE_SIZE, mOverlayWidth);
+
+            BYTE b0 = 0, b1 = 0;
+            for(; x < xend; x++)
+            {
+                b0 |= body[x];
+                b1 |= border[x];
             }
 
-            delete [] tmp;
+            tiles[tx] |= (b0 ? OVERLAY_TILE_BODY : 0) | (b1 ? OVERLAY_TILE_BORDER : 0);
         }
     }
-
-    return true;
 }
 
-///////////////////////////////////////////////////////////////////////////
-
-static __forceinline void pixmix(DWORD *dst, DWORD color, DWORD alpha, MOD_BLEND mod_blendMode = BLEND_NORMAL)
+struct TileStats
 {
-    DWORD a = (((alpha) * (color >> 24)) >> 6) & 0xff;
-    DWORD ia = 256 - a;
-    a += 1;
-
-    //DWORD tmp = (((((*dst >> 8) & 0x00ff0000) * ia) & 0xff000000) >> 24) & 0xFF;
-    *dst = ((((*dst & 0x00ff00ff) * ia + (color & 0x00ff00ff) * a) & 0xff00ff00) >> 8)
-           | ((((*dst & 0x0000ff00) * ia + (color & 0x0000ff00) * a) & 0x00ff0000) >> 8)
-           | ((((*dst >> 8) & 0x00ff0000) * ia) & 0xff000000);
-}
+    int skipped, visited;
+};
 
-#include <xmmintrin.h>
-#include <emmintrin.h>
+static thread_local TileStats s_tileStats = {0, 0};
 
-static __forceinline void pixmix_sse2(DWORD* dst, DWORD color, DWORD alpha, MOD_BLEND mod_blendMode = BLEND_NORMAL)
+void Rasterizer::ResetTileStats()
 {
-    alpha = (((alpha) * (color >> 24)) >> 6) & 0xff;
-    color &= 0xffffff;
-
-    __m128i zero = _mm_setzero_si128();
-    __m128i a = _mm_set1_epi32(((alpha + 1) << 16) | (0x100 - alpha));
-    __m128i d = _mm_unpacklo_epi8(_mm_cvtsi32_si128(*dst), zero);
-    __m128i s = _mm_unpacklo_epi8(_mm_cvtsi32_si128(color), zero);
-    __m128i r = _mm_unpacklo_epi16(d, s);
-
-    r = _mm_madd_epi16(r, a);
-    r = _mm_srli_epi32(r, 8);
-    r = _mm_packs_epi32(r, r);
-    r = _mm_packus_epi16(r, r);
+    s_tileStats.skipped = s_tileStats.visited = 0;
+}
 
-    *dst = (DWORD)_mm_cvtsi128_si32(r);
+void Rasterizer::GetTileStats(int& skipped, int& visited)
+{
+    skipped = s_tileStats.skipped;
+    visited = s_tileStats.visited;
 }
 
-// For CPUID usage in Rasterizer::Draw
-#include "../dsutil/vd.h"
+///////////////////////////////////////////////////////////////////////////
 
 // Render a subpicture onto a surface.
 // spd is the surface to render on.
-// clipRect is a rectangular clip region to render inside.
-// pAlphaMask is an alpha clipping mask.
+// clip is the region to render inside, a rectangle that may have a rectangular hole.
+// pClipMask is an alpha clipping mask.
 // xsub and ysub ???
 // switchpts seems to be an array of fill colours interlaced with coordinates.
 //    switchpts[i*2] contains a colour and switchpts[i*2+1] contains the coordinate to use that colour from
 // fBody tells whether to render the body of the subs.
 // fBorder tells whether to render the border of the subs.
 #ifdef _VSMOD // patch m004. gradient colors
-CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int xsub, int ysub,
+CRect Rasterizer::Draw(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, int xsub, int ysub,
                        const DWORD* switchpts, bool fBody, bool fBorder, int typ, MOD_GRADIENT& mod_grad, MOD_MOVEVC& mod_vc, MOD_BLEND mod_blendMode)
 #else
-CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int xsub, int ysub,
+CRect Rasterizer::Draw(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, int xsub, int ysub,
                        const DWORD* switchpts, bool fBody, bool fBorder)
 #endif
 {
@@ -930,9 +1454,32 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
 
     if(!switchpts || !fBody && !fBorder) return(bbox);
 
+#ifdef _VSMOD // patch m004. gradient colors
+    // \1img textures are shifted by clipDiff, which follows the bottom of the clip rectangle.
+    // Each of the four rectangles around an \iclip hole has its own, so textured words are
+    // drawn piece by piece as they always were
+    if(!clip.hole.IsRectEmpty() && (mod_grad.mode[typ] == 2 || mod_grad.mode[1] == 2))
+    {
+        const CRect& o = clip.rect;
+        const CRect& c = clip.hole;
+        CRect pieces[4] =
+        {
+            CRect(o.left, o.top, o.right, c.top),
+            CRect(o.left, c.top, c.left, c.bottom),
+            CRect(c.right, c.top, o.right, c.bottom),
+            CRect(o.left, c.bottom, o.right, o.bottom)
+        };
+
+        for(ptrdiff_t i = 0; i < countof(pieces); i++)
+            bbox |= Draw(spd, CClipRegion(pieces[i]), pClipMask, xsub, ysub, switchpts, fBody, fBorder, typ, mod_grad, mod_vc, mod_blendMode);
+
+        return(bbox);
+    }
+#endif
+
     // Limit drawn area to intersection of rendering surface and rectangular clip area
     CRect r(0, 0, spd.w, spd.h);
-    r &= clipRect;
+    r &= clip.rect;
 
     // Remember that all subtitle coordinates are specified in 1/8 pixels
     // (x+4)>>3 rounds to nearest whole pixel.
@@ -967,6 +1514,45 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
     bbox.SetRect(x, y, x + w, y + h);
     bbox &= CRect(0, 0, spd.w, spd.h);
 
+    // The hole is skipped row by row while mixing, only the box has to shrink to what is
+    // left around it: the bands above and below it and the parts left and right of it
+    CRect hole;
+    if(hole.IntersectRect(clip.hole, bbox))
+    {
+        if(hole == bbox) return(CRect(0, 0, 0, 0));
+
+        CRect rest(0, 0, 0, 0), band;
+        if(band.IntersectRect(bbox, CRect(bbox.left, bbox.top, bbox.right, hole.top))) rest |= band;
+        if(band.IntersectRect(bbox, CRect(bbox.left, hole.bottom, bbox.right, bbox.bottom))) rest |= band;
+        if(band.IntersectRect(bbox, CRect(bbox.left, hole.top, hole.left, hole.bottom))) rest |= band;
+        if(band.IntersectRect(bbox, CRect(hole.right, hole.top, bbox.right, hole.bottom))) rest |= band;
+        bbox = rest;
+    }
+
+    // The body is read from the border plane when both are drawn at once, and a border
+    // pixel without border coverage has nothing to subtract the body from either
+    BYTE tileMask = fBody && !fBorder ? OVERLAY_TILE_BODY : OVERLAY_TILE_BORDER;
+
+    int tilesVisited = 0, tilesSkipped = 0;
+    for(int ty = yo >> OVERLAY_TILE_SHIFT, tyend = (yo + h - 1) >> OVERLAY_TILE_SHIFT; ty <= tyend; ty++)
+    {
+        for(int tx = xo >> OVERLAY_TILE_SHIFT, txend = (xo + w - 1) >> OVERLAY_TILE_SHIFT; tx <= txend; tx++)
+        {
+            if(mTileMap[ty * mTilesX + tx] & tileMask) tilesVisited++;
+            else tilesSkipped++;
+        }
+    }
+
+    s_tileStats.visited += tilesVisited;
+    s_tileStats.skipped += tilesSkipped;
+
+#if defined (_VSMOD) && defined(_LUA)
+    // a renderer handler is handed the whole box
+    if(!tilesVisited && LuaRendererHandler.IsEmpty()) return(bbox);
+#else
+    if(!tilesVisited) return(bbox);
+#endif
+
     // CPUID from VDub
     bool fSSE2 = !!(g_cpuid.m_flags & CCpuID::sse2);
     //bool fSSE2 = false;
@@ -974,7 +1560,7 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
 #ifdef _VSMOD // patch m006. moveable vector clip
     mod_vc.hfull = h;
     mod_vc.curpos = CPoint(x, y);
-    mod_vc.alphamask = pAlphaMask + spd.w * y + x;
+    mod_vc.mask = pClipMask;
 #endif
 
     // fill rasterize info
@@ -989,15 +1575,20 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
     rnfo.h = h;
     rnfo.xo = xo;
     rnfo.yo = yo;
-    rnfo.overlayp = mOverlayWidth;
+    rnfo.overlayp = mOverlayPitch;
     rnfo.pitch = spd.pitch;
     rnfo.spdw = spd.w;
     // The alpha bitmap of the subtitles?
-    rnfo.src = mpOverlayBuffer + 2 * (mOverlayWidth * yo + xo);
+    rnfo.src = mpOverlayBuffer + mOverlayPitch * yo + xo;
+    rnfo.srcBorder = mpOverlayBorder + mOverlayPitch * yo + xo;
     // s points to what the "body" to use is
-    // If we're rendering body fill and border, src+1 points to the array of
+    // If we're rendering body fill and border, the border plane holds the
     // widened regions which contain both border and fill in one.
-    rnfo.s = fBorder ? (rnfo.src + 1) : rnfo.src;
+    rnfo.s = fBorder ? rnfo.srcBorder : rnfo.src;
+    rnfo.hole = hole.IsRectEmpty() ? CRect(0, 0, 0, 0) : hole - CPoint(x, y);
+    rnfo.tiles = &mTileMap[0];
+    rnfo.tilesPitch = mTilesX;
+    rnfo.tileMask = tileMask;
 #ifdef _VSMOD // patch m006. moveable vector clip
     rnfo.mod_vc = mod_vc;
     rnfo.mod_grad = mod_grad;
@@ -1007,35 +1598,28 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
     rnfo.mod_grad.yoffset = yo;
     rnfo.typ = typ;
     rnfo.mod_blendMode = mod_blendMode; // vpatch v003. blending mode
-    rnfo.mod_grad.clipDiff = clipRect.bottom < yBeforeClip + mOverlayHeight ? yBeforeClip + mOverlayHeight - clipRect.bottom : 0;
+    rnfo.mod_grad.clipDiff = clip.rect.bottom < yBeforeClip + mOverlayHeight ? yBeforeClip + mOverlayHeight - clip.rect.bottom : 0;
 #else
     // The complex "vector clip mask" I think.
-    rnfo.am = pAlphaMask + spd.w * y + x;
-#endif
-
-    COverlayGetter * Color;
-    
-    // Every remaining line in the bitmap to be rendered...
-    // Basic case of no complex clipping mask
-#ifdef _VSMOD // patch m004. gradient colors
-    if (
-        ((typ == 0) && ((mod_grad.mode[0] == 0) && (mod_grad.mode[1] == 0)))
-        || ((typ != 0) && (mod_grad.mode[typ] == 0))
-        )
-        // No gradient
-    {
-#endif
-        Color = new COverlayColor(switchpts[0], switchpts[2]);
-#ifdef _VSMOD // patch m004. gradient colors
-    }
-    else
-        Color = new COverlayGradient(rnfo.mod_grad, typ);
+    rnfo.am = pClipMask;
+    rnfo.ampos = CPoint(x, y);
 #endif
 
 #if defined (_VSMOD) && defined(_LUA)
     if (LuaRendererHandler.GetLength() > 0)
     {
-        COverlayGetter* Alpha = (pAlphaMask) ? new COverlayAlpha(mod_vc) : NULL;
+        COverlayGetter* Color;
+
+        if (
+            ((typ == 0) && ((mod_grad.mode[0] == 0) && (mod_grad.mode[1] == 0)))
+            || ((typ != 0) && (mod_grad.mode[typ] == 0))
+            )
+            // No gradient
+            Color = new COverlayColor(switchpts[0], switchpts[2]);
+        else
+            Color = new COverlayGradient(rnfo.mod_grad, typ);
+
+        COverlayGetter* Alpha = (pClipMask) ? new COverlayAlpha(mod_vc) : NULL;
 
         if (fSSE2)
         {
@@ -1058,50 +1642,13 @@ CRect Rasterizer::Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int x
         }
 
         if (Alpha) delete Alpha;
+        delete Color;
     }
     else
-    {
 #endif
-        if (!pAlphaMask)
-        {
-            if (fSSE2)
-            {
-                COverlayMixerSSE2 Mix(&rnfo, Color);
-                Mix.Draw(fBody);
-            }
-            else
-            {
-                COverlayMixer Mix(&rnfo, Color);
-                Mix.Draw(fBody);
-            }
-        }
-        else
-        {
-            COverlayGetter* Alpha;
+        // Color source, clip and blend mode are resolved once for the whole overlay
+        DrawOverlay(&rnfo, !!pClipMask, fBody);
 
-#ifdef _VSMOD
-            Alpha = new COverlayAlpha(mod_vc);
-#else
-            Alpha = new COverlayAlpha(pAlphaMask, spd.w, spd.h);
-#endif
-            if (fSSE2)
-            {
-                COverlayAlphaMixer<COverlayMixerSSE2> Mix(&rnfo, Color, Alpha);
-                Mix.Draw(fBody);
-            }
-            else
-            {
-                COverlayAlphaMixer<COverlayMixer> Mix(&rnfo, Color, Alpha);
-                Mix.Draw(fBody);
-            }
-
-            delete Alpha;
-        }
-#if defined (_VSMOD) && defined(_LUA)
-    }
-#endif
-
-    delete Color;
     // Remember to EMMS!
     // Rendering fails in funny ways if we don't do this.
 
@@ -1129,21 +1676,33 @@ void Rasterizer::FillSolidRect(SubPicDesc& spd, int x, int y, int nWidth, int nH
 #else
 void Rasterizer::FillSolidRect(SubPicDesc& spd, int x, int y, int nWidth, int nHeight, DWORD lColor)
 {
-    bool fSSE2 = !!(g_cpuid.m_flags & CCpuID::sse2);
+    DWORD* dst = (DWORD*)((BYTE*)spd.bits + spd.pitch * y) + x;
 
-    for(int wy = y; wy < y + nHeight; wy++)
-    {
-        DWORD* dst = (DWORD*)((BYTE*)spd.bits + spd.pitch * wy) + x;
+    MixSolidRect(dst, spd.pitch, nWidth, nHeight, lColor, 0x40);	// 0x40 because >> 6 in the mix (to preserve tranparency)
+}
+#endif
 
-        if(fSSE2)
-            for(int wt = 0; wt < nWidth; ++wt)
-                pixmix_sse2(&dst[wt], lColor, 0x40);	// 0x40 because >> 6 in pixmix (to preserve tranparency)
-        else
-            for(int wt = 0; wt < nWidth; ++wt)
-                pixmix(&dst[wt], lColor, 0x40);
+CClipMask::CClipMask(const CRect& r, BYTE outside)
+    : rect(r)
+    , pitch(max(r.Width(), 0))
+    , outside(outside)
+    , bits(NULL)
+{
+    if(rect.IsRectEmpty())
+    {
+        rect.SetRectEmpty();
+        pitch = 0;
+        return;
     }
+
+    bits = new BYTE[GetSize()];
+    memset(bits, 0, GetSize());
+}
+
+CClipMask::~CClipMask()
+{
+    delete [] bits;
 }
-#endif
 
 #ifdef _VSMOD // patch m006. moveable vector clip
 MOD_MOVEVC::MOD_MOVEVC()
@@ -1160,7 +1719,7 @@ void MOD_MOVEVC::clear()
     spd = CSize(0, 0);
     curpos = CPoint(0, 0);
     hfull = 0;
-    alphamask = NULL;
+    mask = NULL;
     isInverse = false;
 }
 
@@ -1173,7 +1732,7 @@ byte MOD_MOVEVC::GetAlphaValue(int wx, int wy)
         if((wx < 0) || (wx >= spd.cx)) return 0;
         if((wy <= 0) || (wy > spd.cy)) return 0;
 
-        return alphamask[wx+((hfull-wy)*spd.cx)];
+        return mask->GetValue(curpos.x + wx, curpos.y + hfull - wy);
     }
 
     int xInCanvas = wx - pos.x + curpos.x;
@@ -1190,7 +1749,7 @@ byte MOD_MOVEVC::GetAlphaValue(int wx, int wy)
         else if ((wx - pos.x) > spd.cx - 1) alpham = 0; //canvas.cx
         else if ((hfull - wy - pos.y) < -curpos.y + 1) alpham = 0;
         else if ((hfull - wy - pos.y) > spd.cy - 1) alpham = 0;
-        else alpham = alphamask[wx - pos.x - pos.y*spd.cx + ((hfull - wy)*spd.cx)];
+        else alpham = mask->GetValue(xInCanvas, yInCanvas);
     }
 
     return alpham;
@@ -1220,6 +1779,7 @@ RasterizerNfo::RasterizerNfo()
     mod_vc.clear();
     #else
     am = NULL;
+    ampos = CPoint(0, 0);
     #endif
     */
 }
\ No newline at end of file
@@ -27,6 +27,42 @@
 #include "STS.h"
 #endif
 
+// A vector clip mask (6 bit, 0 - 0x40) in frame coordinates. Only the bounding box of
+// the clip is stored, every pixel outside rect reads as outside.
+class CClipMask
+{
+    CClipMask(const CClipMask&);
+    CClipMask& operator=(const CClipMask&);
+
+public:
+    CRect rect;
+    int pitch;
+    BYTE outside;	// 0, or 0x40 for \iclip
+    BYTE* bits;		// rect.Height() rows of pitch bytes, zeroed
+
+    CClipMask(const CRect& r, BYTE outside);
+    ~CClipMask();
+
+    size_t GetSize() const { return (size_t)pitch * rect.Height(); }
+
+    BYTE GetValue(int x, int y) const
+    {
+        return (x >= rect.left && x < rect.right && y >= rect.top && y < rect.bottom)
+               ? bits[(y - rect.top) * pitch + (x - rect.left)]
+               : outside;
+    }
+};
+
+// The part of the frame Rasterizer::Draw may paint: rect, less hole when it is not empty.
+// \iclip's rectangle form is the frame with the rectangle as the hole.
+struct CClipRegion
+{
+    CRect rect, hole;
+
+    CClipRegion(const CRect& r) : rect(r), hole(0, 0, 0, 0) {}
+    CClipRegion(const CRect& r, const CRect& h) : rect(r), hole(h) {}
+};
+
 #ifdef _VSMOD // patch m006. moveable vector clip
 class MOD_MOVEVC
 {
@@ -40,7 +76,7 @@ public:
     CSize spd;		// output canvas size
     CPoint curpos;  // output origin point
     int hfull;		// full height
-    byte* alphamask;
+    const CClipMask* mask;
     bool isInverse;
 
     MOD_MOVEVC();
@@ -50,6 +86,67 @@ public:
 };
 #endif
 
+// Per-thread bump allocator backing the rasterizer's scratch buffers (edge and scan
+// lists, blur temporaries, ...). Allocations are returned stack-wise through
+// CRasterizerArenaScope; the chunks themselves are kept for the next word and frame.
+class CRasterizerArena
+{
+    struct Chunk
+    {
+        BYTE* base;
+        size_t size;
+        size_t start;	// sum of the sizes of the chunks before this one
+    };
+
+    std::vector<Chunk> m_chunks;
+    size_t m_cur, m_offset;
+    void* m_last;
+
+    void UpdatePeak();
+
+public:
+    struct Mark
+    {
+        size_t chunk, offset;
+    };
+
+    CRasterizerArena();
+    ~CRasterizerArena();
+
+    static CRasterizerArena& GetThreadArena();
+
+    void* Alloc(size_t size);
+    void* Grow(void* p, size_t oldSize, size_t newSize);	// in place if p is the last allocation and there is room
+    Mark GetMark() const;
+    void Release(const Mark& mark);
+    void Reset();
+
+    // Totals over all threads: allocations served without touching the heap, chunks
+    // that had to be allocated, and the largest amount in use at once on any thread
+    static void GetStats(__int64& allocsAvoided, __int64& heapAllocs, size_t& peakSize);
+};
+
+class CRasterizerArenaScope
+{
+    CRasterizerArena& m_arena;
+    CRasterizerArena::Mark m_mark;
+
+public:
+    CRasterizerArenaScope() : m_arena(CRasterizerArena::GetThreadArena()), m_mark(m_arena.GetMark()) {}
+    ~CRasterizerArenaScope() { m_arena.Release(m_mark); }
+
+    template<class T> T* Alloc(size_t count) { return (T*)m_arena.Alloc(sizeof(T) * count); }
+};
+
+// The overlay is divided into tiles of OVERLAY_TILE_SIZE^2 pixels, each flagged with the
+// layers that have any coverage in it, so that Draw can skip the transparent ones
+#define OVERLAY_TILE_SHIFT 4
+#define OVERLAY_TILE_SIZE (1 << OVERLAY_TILE_SHIFT)
+#define OVERLAY_TILE_BODY 1
+#define OVERLAY_TILE_BORDER 2
+
+#define OVERLAY_ALIGN 32
+
 #define PT_MOVETONC 0xfe
 #define PT_BSPLINETO 0xfc
 #define PT_BSPLINEPATCHTO 0xfa
@@ -60,7 +157,7 @@ public:
     int w;
     int h;
     int spdw;
-    int overlayp;
+    int overlayp;	// overlay plane pitch
     int pitch;
     DWORD color;
 
@@ -68,17 +165,24 @@ public:
     int yo;
 
     const DWORD* sw;
-    byte* s;
-    byte* src;
+    byte* s;			// coverage drawn as body: the border plane when the border is drawn along
+    byte* src;			// body plane
+    byte* srcBorder;	// border plane
     DWORD* dst;
 
+    CRect hole;			// left undrawn (see CClipRegion), relative to dst, empty: none
+    const BYTE* tiles;	// tile flags of the whole overlay, NULL: draw every pixel
+    int tilesPitch;
+    BYTE tileMask;
+
 #ifdef _VSMOD
     int typ;
     MOD_GRADIENT mod_grad;
     MOD_MOVEVC mod_vc;
     MOD_BLEND mod_blendMode;
 #else
-    byte* am;
+    const CClipMask* am;
+    CPoint ampos;		// frame position of the overlay's top left pixel
 #endif
 
     RasterizerNfo();
@@ -123,18 +227,45 @@ private:
 protected:
     int mPathOffsetX, mPathOffsetY;
     int mOffsetX, mOffsetY;
-    int mOverlayWidth, mOverlayHeight;
+    // The overlay holds two planes of mOverlayHeight rows, the body coverage followed by
+    // the border coverage. Rows are mOverlayPitch bytes apart, a multiple of
+    // OVERLAY_ALIGN, and both planes start OVERLAY_ALIGN-aligned.
+    int mOverlayWidth, mOverlayHeight, mOverlayPitch;
     byte *mpOverlayBuffer;
+    byte *mpOverlayBorder;
+    size_t mOverlayBufferSize;	// allocated size, kept across Rasterize calls
+    std::vector<BYTE> mTileMap;
+    int mTilesX, mTilesY;
 
 private:
     void _TrashPath();
     void _TrashOverlay();
+    void _ReallocOverlay(int width, int height);
+    void _BuildTileMap();
     void _ReallocEdgeBuffer(int edges);
     void _EvaluateBezier(int ptbase, bool fBSpline);
     void _EvaluateLine(int pt1idx, int pt2idx);
     void _EvaluateLine(int x0, int y0, int x1, int y1);
     static void _OverlapRegion(tSpanBuffer& dst, tSpanBuffer& src, int dx, int dy);
+    void _WidenRegionSpans(int rx, int ry);
+    static void _WidenGridRowReach(const tSpanBuffer& outline, size_t first, size_t last, int rx, const int* reachOf, int* reach, int w);
+    bool _WidenRegionGrid(int rx, int ry);
 public:
+    enum WideningMode
+    {
+        WIDEN_SPANS = 0,	// overlap the span buffer once per scanline offset (reference)
+        WIDEN_GRID,			// separable dilation on the subpixel grid, cost independent of the radius
+        WIDEN_AUTO			// pick whichever is estimated to be cheaper
+    };
+
+    // Starts from the VSFILTER_WIDEN environment variable, WIDEN_SPANS when it is not set
+    static void SetWideningMode(WideningMode mode);
+    static WideningMode GetWideningMode();
+
+    // Tiles of the drawn overlay areas left out or mixed by Draw on this thread since the last reset
+    static void ResetTileStats();
+    static void GetTileStats(int& skipped, int& visited);
+
 #if defined (_VSMOD) && defined(_LUA)
     int     m_entry; // id
     int     m_layer;
@@ -152,11 +283,13 @@ public:
     bool CreateWidenedRegion(int borderX, int borderY);
     void DeleteOutlines();
     bool Rasterize(int xsub, int ysub, int fBlur, double fGaussianBlurX, double fGaussianBlurY);
+    void SetOverlay(int width, int height, int offsetX, int offsetY, const byte* src);	// as if Rasterize had produced it, src holds both planes
+    size_t GetOverlaySize() const { return 2 * mOverlayPitch * mOverlayHeight; }
     int getOverlayWidth();
 #ifdef _VSMOD // patch m004. gradient colors
-    CRect Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int xsub, int ysub, const DWORD* switchpts, bool fBody, bool fBorder, int typ, MOD_GRADIENT& mod_grad, MOD_MOVEVC& mod_vc, MOD_BLEND mod_blendMode);
+    CRect Draw(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, int xsub, int ysub, const DWORD* switchpts, bool fBody, bool fBorder, int typ, MOD_GRADIENT& mod_grad, MOD_MOVEVC& mod_vc, MOD_BLEND mod_blendMode);
 #else
-    CRect Draw(SubPicDesc& spd, CRect& clipRect, byte* pAlphaMask, int xsub, int ysub, const DWORD* switchpts, bool fBody, bool fBorder);
+    CRect Draw(SubPicDesc& spd, const CClipRegion& clip, const CClipMask* pClipMask, int xsub, int ysub, const DWORD* switchpts, bool fBody, bool fBorder);
 #endif
     void FillSolidRect(SubPicDesc& spd, int x, int y, int nWidth, int nHeight, DWORD lColor);
 };
@@ -92,3 +92,174 @@ bool CPolygonPathKey::operator==(const CPolygonPathKey& polygonPathKey) const
            && IsNearlyEqual(m_scalex, polygonPathKey.m_scalex, 1e-6)
            && IsNearlyEqual(m_scaley, polygonPathKey.m_scaley, 1e-6);
 }
+
+CClipMaskKey::CClipMaskKey(const CStringW& str, double scalex, double scaley, bool inverse, CSize size)
+    : m_str(str)
+    , m_scalex(scalex)
+    , m_scaley(scaley)
+    , m_inverse(inverse)
+    , m_size(size)
+{
+    UpdateHash();
+}
+
+CClipMaskKey::CClipMaskKey(const CClipMaskKey& clipMaskKey)
+    : m_hash(clipMaskKey.m_hash)
+    , m_str(clipMaskKey.m_str)
+    , m_scalex(clipMaskKey.m_scalex)
+    , m_scaley(clipMaskKey.m_scaley)
+    , m_inverse(clipMaskKey.m_inverse)
+    , m_size(clipMaskKey.m_size)
+{
+}
+
+void CClipMaskKey::UpdateHash()
+{
+    m_hash = CStringElementTraits<CStringW>::Hash(m_str);
+    m_hash += m_hash << 5;
+    m_hash += int(m_scalex * 1e6);
+    m_hash += m_hash << 5;
+    m_hash += int(m_scaley * 1e6);
+    m_hash += m_hash << 5;
+    m_hash += m_inverse;
+    m_hash += m_hash << 5;
+    m_hash += m_size.cx;
+    m_hash += m_hash << 5;
+    m_hash += m_size.cy;
+}
+
+bool CClipMaskKey::operator==(const CClipMaskKey& clipMaskKey) const
+{
+    return m_str == clipMaskKey.m_str
+           && IsNearlyEqual(m_scalex, clipMaskKey.m_scalex, 1e-6)
+           && IsNearlyEqual(m_scaley, clipMaskKey.m_scaley, 1e-6)
+           && m_inverse == clipMaskKey.m_inverse
+           && m_size == clipMaskKey.m_size;
+}
+
+#ifdef _VSMOD
+// Transform only reads the points when the distortion is on
+static bool IsSameDistort(const MOD_DISTORT& a, const MOD_DISTORT& b)
+{
+    if(a.enabled != b.enabled) return false;
+    if(!a.enabled) return true;
+
+    for(ptrdiff_t i = 0; i < countof(a.pointsx); i++)
+    {
+        if(a.pointsx[i] != b.pointsx[i] || a.pointsy[i] != b.pointsy[i]) return false;
+    }
+
+    return true;
+}
+#endif
+
+COverlayKey::COverlayKey(const CStringW& str, bool fPolygon, int baseline, STSStyle& style, double scalex, double scaley, bool fOpaqueBox, CPoint org, int xsub, int ysub)
+    : m_str(str)
+    , m_fPolygon(fPolygon)
+    , m_baseline(baseline)
+    , m_fontName(style.fontName)
+    , m_charSet(style.charSet)
+    , m_fontWeight(style.fontWeight)
+    , m_fItalic(style.fItalic)
+    , m_fUnderline(style.fUnderline)
+    , m_fStrikeOut(style.fStrikeOut)
+    , m_fontSize(style.fontSize)
+    , m_fontSpacing(style.fontSpacing)
+    , m_fontScaleX(style.fontScaleX)
+    , m_fontScaleY(style.fontScaleY)
+    , m_fontAngleX(style.fontAngleX)
+    , m_fontAngleY(style.fontAngleY)
+    , m_fontAngleZ(style.fontAngleZ)
+    , m_fontShiftX(style.fontShiftX)
+    , m_fontShiftY(style.fontShiftY)
+    , m_borderStyle(style.borderStyle)
+    , m_outlineWidthX(style.outlineWidthX)
+    , m_outlineWidthY(style.outlineWidthY)
+    , m_fBlur(style.fBlur)
+    , m_fGaussianBlurX(style.fGaussianBlurX)
+    , m_fGaussianBlurY(style.fGaussianBlurY)
+#ifdef _VSMOD
+    , m_z(style.mod_z)
+    , m_fOrtho(style.mod_ortho)
+    , m_fontOrient(style.mod_fontOrient)
+    , m_distort(style.mod_distort)
+#endif
+    , m_scalex(scalex)
+    , m_scaley(scaley)
+    , m_fOpaqueBox(fOpaqueBox)
+    , m_org(org)
+    , m_xsub(xsub)
+    , m_ysub(ysub)
+{
+    UpdateHash();
+}
+
+void COverlayKey::UpdateHash()
+{
+    m_hash  = CStringElementTraits<CStringW>::Hash(m_str);
+    m_hash += m_hash << 5;
+    m_hash += CStringElementTraits<CString>::Hash(m_fontName);
+    m_hash += m_hash << 5;
+    m_hash += m_fPolygon ? m_baseline + 1 : 0;
+    m_hash += m_hash << 5;
+    m_hash += m_charSet + (m_fontWeight << 8) + (m_fItalic << 24) + (m_fUnderline << 25) + (m_fStrikeOut << 26) + (m_fOpaqueBox << 27);
+    m_hash += m_hash << 5;
+    m_hash += int(m_fontSize * 64);
+    m_hash += m_hash << 5;
+    m_hash += int(m_fontScaleX * 64) + (int(m_fontScaleY * 64) << 16);
+    m_hash += m_hash << 5;
+    m_hash += int(m_fontAngleX * 64) + int(m_fontAngleY * 64) + int(m_fontAngleZ * 64);
+    m_hash += m_hash << 5;
+    m_hash += int(m_fontShiftX * 64) + (int(m_fontShiftY * 64) << 16);
+    m_hash += m_hash << 5;
+    m_hash += m_borderStyle + (int(m_outlineWidthX * 64) << 1) + (int(m_outlineWidthY * 64) << 16);
+    m_hash += m_hash << 5;
+    m_hash += m_fBlur + (int(m_fGaussianBlurX * 64) << 8) + (int(m_fGaussianBlurY * 64) << 16);
+    m_hash += m_hash << 5;
+    m_hash += int(m_scalex * 1e6) + int(m_scaley * 1e6);
+    m_hash += m_hash << 5;
+    m_hash += m_org.x + (m_org.y << 16);
+    m_hash += m_hash << 5;
+    m_hash += m_xsub + (m_ysub << 3);
+}
+
+bool COverlayKey::operator==(const COverlayKey& overlayKey) const
+{
+    return m_hash == overlayKey.m_hash
+           && m_str == overlayKey.m_str
+           && m_fPolygon == overlayKey.m_fPolygon
+           && m_baseline == overlayKey.m_baseline
+           && m_fontName == overlayKey.m_fontName
+           && m_charSet == overlayKey.m_charSet
+           && m_fontWeight == overlayKey.m_fontWeight
+           && m_fItalic == overlayKey.m_fItalic
+           && m_fUnderline == overlayKey.m_fUnderline
+           && m_fStrikeOut == overlayKey.m_fStrikeOut
+           && IsNearlyEqual(m_fontSize, overlayKey.m_fontSize)
+           && IsNearlyEqual(m_fontSpacing, overlayKey.m_fontSpacing)
+           && IsNearlyEqual(m_fontScaleX, overlayKey.m_fontScaleX)
+           && IsNearlyEqual(m_fontScaleY, overlayKey.m_fontScaleY)
+           && IsNearlyEqual(m_fontAngleX, overlayKey.m_fontAngleX)
+           && IsNearlyEqual(m_fontAngleY, overlayKey.m_fontAngleY)
+           && IsNearlyEqual(m_fontAngleZ, overlayKey.m_fontAngleZ)
+           && IsNearlyEqual(m_fontShiftX, overlayKey.m_fontShiftX)
+           && IsNearlyEqual(m_fontShiftY, overlayKey.m_fontShiftY)
+           && m_borderStyle == overlayKey.m_borderStyle
+           && IsNearlyEqual(m_outlineWidthX, overlayKey.m_outlineWidthX)
+           && IsNearlyEqual(m_outlineWidthY, overlayKey.m_outlineWidthY)
+           && m_fBlur == overlayKey.m_fBlur
+           && IsNearlyEqual(m_fGaussianBlurX, overlayKey.m_fGaussianBlurX)
+           && IsNearlyEqual(m_fGaussianBlurY, overlayKey.m_fGaussianBlurY)
+#ifdef _VSMOD
+           && IsNearlyEqual(m_z, overlayKey.m_z)
+           && m_fOrtho == overlayKey.m_fOrtho
+           && m_fontOrient == overlayKey.m_fontOrient
+           && IsSameDistort(m_distort, overlayKey.m_distort)
+#endif
+           && IsNearlyEqual(m_scalex, overlayKey.m_scalex)
+           && IsNearlyEqual(m_scaley, overlayKey.m_scaley)
+           && m_fOpaqueBox == overlayKey.m_fOpaqueBox
+           && m_org == overlayKey.m_org
+           && m_xsub == overlayKey.m_xsub
+           && m_ysub == overlayKey.m_ysub;
+}
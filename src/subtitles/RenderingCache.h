@@ -7,6 +7,7 @@
 #include <atlcoll.h>
 #include <cmath>
 #include <memory>
+#include <vector>
 #include "STS.h"
 
 inline bool IsNearlyEqual(double a, double b, double epsilon = 1e-6)
@@ -14,21 +15,36 @@ inline bool IsNearlyEqual(double a, double b, double epsilon = 1e-6)
     return std::fabs(a - b) <= epsilon;
 }
 
+// LRU cache. Every entry has a cost (1 by default, so maxSize is an entry count); the
+// least recently used entries are evicted while the total cost would exceed maxSize.
 template<typename K, typename V, class KTraits = CElementTraits<K>, class VTraits = CElementTraits<V>>
 class CRenderingCache : private CAtlMap<K, POSITION, KTraits>
 {
 private:
     size_t m_maxSize;
+    size_t m_size;
     struct CPositionValue
     {
         POSITION pos;
         V value;
+        size_t cost;
     };
     CAtlList<CPositionValue> m_list;
 
+    void Evict(size_t maxSize)
+    {
+        while(m_size > maxSize && !m_list.IsEmpty())
+        {
+            m_size -= m_list.GetTail().cost;
+            __super::RemoveAtPos(m_list.GetTail().pos);
+            m_list.RemoveTailNoReturn();
+        }
+    }
+
 public:
     CRenderingCache(size_t maxSize)
         : m_maxSize(maxSize)
+        , m_size(0)
     {
     }
 
@@ -46,7 +62,7 @@ public:
         return bFound;
     }
 
-    POSITION SetAt(typename KTraits::INARGTYPE key, typename VTraits::INARGTYPE value)
+    POSITION SetAt(typename KTraits::INARGTYPE key, typename VTraits::INARGTYPE value, size_t cost = 1)
     {
         POSITION pos = nullptr;
         bool bFound = __super::Lookup(key, pos);
@@ -57,27 +73,40 @@ public:
             CPositionValue& posVal = m_list.GetHead();
             pos = posVal.pos;
             posVal.value = value;
+            m_size += cost - posVal.cost;
+            posVal.cost = cost;
+            Evict(m_maxSize);
         }
         else
         {
-            if(m_list.GetCount() >= m_maxSize)
-            {
-                __super::RemoveAtPos(m_list.GetTail().pos);
-                m_list.RemoveTailNoReturn();
-            }
+            if(cost > m_maxSize) return nullptr;
+
+            Evict(m_maxSize - cost);
             pos = __super::SetAt(key, m_list.AddHead());
             CPositionValue& posVal = m_list.GetHead();
             posVal.pos = pos;
             posVal.value = value;
+            posVal.cost = cost;
+            m_size += cost;
         }
 
         return pos;
     }
 
+    void SetMaxSize(size_t maxSize)
+    {
+        m_maxSize = maxSize;
+        Evict(m_maxSize);
+    }
+
+    size_t GetMaxSize() const { return m_maxSize; }
+    size_t GetSize() const { return m_size; }
+
     void Clear()
     {
         m_list.RemoveAll();
         __super::RemoveAll();
+        m_size = 0;
     }
 };
 
@@ -135,3 +164,88 @@ public:
 
     bool operator==(const CPolygonPathKey& polygonPathKey) const;
 };
+
+// Vector clip mask of a \clip or \iclip drawing at a scale and video size
+class CClipMaskKey
+{
+private:
+    ULONG m_hash;
+
+protected:
+    CStringW m_str;
+    double m_scalex, m_scaley;
+    bool m_inverse;
+    CSize m_size;
+
+public:
+    CClipMaskKey(const CStringW& str, double scalex, double scaley, bool inverse, CSize size);
+    CClipMaskKey(const CClipMaskKey& clipMaskKey);
+
+    ULONG GetHash() const { return m_hash; }
+
+    void UpdateHash();
+
+    bool operator==(const CClipMaskKey& clipMaskKey) const;
+};
+
+// Rasterized overlay of a word: everything CWord::Paint derives from the text (or
+// drawing), the rasterization-relevant style fields, the scale and the subpixel phase.
+class COverlayKey
+{
+private:
+    ULONG m_hash;
+
+protected:
+    CStringW m_str;
+    bool m_fPolygon;
+    int m_baseline;
+    CString m_fontName;
+    int m_charSet, m_fontWeight;
+    bool m_fItalic, m_fUnderline, m_fStrikeOut;
+    double m_fontSize, m_fontSpacing;
+    double m_fontScaleX, m_fontScaleY;
+    double m_fontAngleX, m_fontAngleY, m_fontAngleZ;
+    double m_fontShiftX, m_fontShiftY;
+    int m_borderStyle;
+    double m_outlineWidthX, m_outlineWidthY;
+    int m_fBlur;
+    double m_fGaussianBlurX, m_fGaussianBlurY;
+#ifdef _VSMOD
+    double m_z;
+    bool m_fOrtho;
+    int m_fontOrient;
+    MOD_DISTORT m_distort;
+#endif
+    double m_scalex, m_scaley;
+    bool m_fOpaqueBox;
+    CPoint m_org;	// relative to the word, in 1/8 pixels
+    int m_xsub, m_ysub;
+
+public:
+    COverlayKey(const CStringW& str, bool fPolygon, int baseline, STSStyle& style, double scalex, double scaley, bool fOpaqueBox, CPoint org, int xsub, int ysub);
+
+    ULONG GetHash() const { return m_hash; }
+
+    void UpdateHash();
+
+    bool operator==(const COverlayKey& overlayKey) const;
+};
+
+struct COverlayBitmap
+{
+    int width, height;
+    int offsetX, offsetY;
+    std::vector<BYTE> buffer;	// body and border planes, as laid out by Rasterizer
+};
+
+typedef std::shared_ptr<COverlayBitmap> COverlayBitmapSharedPtr;
+typedef CRenderingCache<COverlayKey, COverlayBitmapSharedPtr, CKeyTraits<COverlayKey>> COverlayCache;
+
+#define OVERLAY_CACHE_DEFAULT_BUDGET (64 << 20)
+
+class CClipMask;
+
+typedef std::shared_ptr<CClipMask> CClipMaskSharedPtr;
+typedef CRenderingCache<CClipMaskKey, CClipMaskSharedPtr, CKeyTraits<CClipMaskKey>> CClipMaskCache;
+
+#define CLIP_MASK_CACHE_DEFAULT_BUDGET (16 << 20)
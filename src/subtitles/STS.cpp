@@ -1823,9 +1823,13 @@ void CMyLua::LoadLuaFile(CString Filename)
     }
 
     LuaError(CString("Lua script loaded: ") + Filename);
-    if(LuaHasFunction(L, L"init"))
+
+    // A new script starts with new line tables
+    LuaReleaseRefs(L);
+
+    if(LuaPushFunction(L, L"init"))
     {
-        if (lua_pcall(L, 0, 0, 0) != 0)
+        if (LuaCall(L, 0, 0) != 0)
         {
             // error
             CString ErrorText = L"Error: ";
@@ -1929,11 +1933,9 @@ bool CMyLua::LuaIsFunction(lua_State * L, CString fieldname)
 
 bool CMyLua::LuaHasFunction(lua_State * L, CString funcname)
 {
-    CStringA funcnameA(funcname);
-    lua_getglobal(L, funcnameA);
-    bool Result = lua_isfunction(L, -1);
+    if(!LuaPushFunction(L, funcname)) return false;
     lua_pop(L, 1);
-    return Result;
+    return true;
 }
 
 int CMyLua::LuaGetInt(lua_State * L, CString fieldname)
@@ -1996,6 +1998,127 @@ bool CMyLua::LuaGetBool(lua_State * L, CString fieldname)
     return res;
 }
 
+// Registry references kept per state
+struct CLuaStateRefs
+{
+    int lineTables; // the table of line tables by entry
+
+    CLuaStateRefs() : lineTables(LUA_NOREF) {}
+};
+
+static CCritSec s_luaRefsLock;
+static CAtlMap<lua_State*, CLuaStateRefs*> s_luaRefs;
+
+static CLuaStateRefs* GetLuaRefs(lua_State * L)
+{
+    CAutoLock lock(&s_luaRefsLock);
+
+    CLuaStateRefs* refs = NULL;
+    if(!s_luaRefs.Lookup(L, refs))
+    {
+        refs = DNew CLuaStateRefs();
+        s_luaRefs[L] = refs;
+    }
+    return refs;
+}
+
+bool CMyLua::LuaPushFunction(lua_State * L, CString funcname)
+{
+    CStringA funcnameA(funcname);
+    lua_getglobal(L, funcnameA);
+    if(!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 1);
+        return false;
+    }
+    return true;
+}
+
+void CMyLua::LuaReleaseRefs(lua_State * L)
+{
+    CLuaStateRefs* refs = NULL;
+    {
+        CAutoLock lock(&s_luaRefsLock);
+        if(!s_luaRefs.Lookup(L, refs)) return;
+        s_luaRefs.RemoveKey(L);
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, refs->lineTables);
+
+    delete refs;
+}
+
+void CMyLua::LuaPushLineTable(lua_State * L, int entry)
+{
+    CLuaStateRefs* refs = GetLuaRefs(L);
+
+    if(refs->lineTables == LUA_NOREF)
+    {
+        lua_newtable(L);
+        refs->lineTables = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, refs->lineTables);
+    lua_rawgeti(L, -1, entry);
+    if(!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        LuaAddIntegerField(L, "id", entry);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, entry);
+    }
+    lua_remove(L, -2);
+}
+
+void CMyLua::LuaSetUserField(lua_State * L, int entry)
+{
+    CStringA index;
+    index.Format("sub_%d", entry);
+    lua_getglobal(L, index);
+    if(!lua_istable(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "user");
+}
+
+struct LuaStats
+{
+    int calls;
+    __int64 ticks;
+};
+
+static thread_local LuaStats s_luaStats = {0, 0};
+
+int CMyLua::LuaCall(lua_State * L, int nargs, int nresults)
+{
+    LARGE_INTEGER start, end;
+    QueryPerformanceCounter(&start);
+    int ret = lua_pcall(L, nargs, nresults, 0);
+    QueryPerformanceCounter(&end);
+
+    s_luaStats.calls++;
+    s_luaStats.ticks += end.QuadPart - start.QuadPart;
+    return ret;
+}
+
+void CMyLua::ResetLuaStats()
+{
+    s_luaStats.calls = 0;
+    s_luaStats.ticks = 0;
+}
+
+void CMyLua::GetLuaStats(int& calls, double& ms)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    calls = s_luaStats.calls;
+    ms = freq.QuadPart ? 1000.0 * s_luaStats.ticks / freq.QuadPart : 0;
+}
+
 CString CMyLua::CheckLuaHandler(CString func)
 {
     // Custom functions
@@ -2734,7 +2857,11 @@ CSimpleTextSubtitle::~CSimpleTextSubtitle()
     #ifdef _LUA
     try
     {
-        if(L) lua_close(L);
+        if(L)
+        {
+            LuaReleaseRefs(L);
+            lua_close(L);
+        }
     } catch(...) {}
 
     try
@@ -4332,6 +4459,9 @@ MOD_PNGIMAGE::MOD_PNGIMAGE()
 
     pointer = NULL;
 
+    texture = NULL;
+    texturePitch = 0;
+
     // rasterizer
     alpha = 0xFF;
 }
@@ -4419,6 +4549,21 @@ bool MOD_PNGIMAGE::processData(png_structp png_ptr)
         pointer[y] = (png_byte*) malloc(rowbytes);
 
     png_read_image(png_ptr, pointer);
+
+    texturePitch = width + 1;
+    texture = (DWORD*) malloc(sizeof(DWORD) * texturePitch * height);
+    if(texture)
+    {
+        for(int y = 0; y < height; y++)
+        {
+            const BYTE* src = pointer[height - 1 - y];
+            DWORD* dst = texture + texturePitch * y + 1;
+            for(int x = 0; x < width; x++, src += bpp)
+                dst[x] = (DWORD)((bpp == 4) ? src[3] : 0xFF) << 24 | src[0] << 16 | src[1] << 8 | src[2];
+            dst[-1] = dst[0];
+        }
+    }
+
     return true;
 }
 
@@ -4478,6 +4623,7 @@ bool MOD_PNGIMAGE::initImage(BYTE* data, CString m_fn)
 void MOD_PNGIMAGE::freeImage()
 {
     if(pointer != NULL) delete [] pointer;
+    if(texture != NULL) free(texture);
 }
 
 MOD_GRADIENT::MOD_GRADIENT()
@@ -55,6 +55,22 @@ public:
     bool LuaHasFunction(lua_State * L, CString funcname);
     CString CheckLuaHandler(CString func);
 
+    // Pushes the global function funcname and returns true, or pushes nothing and returns false
+    bool LuaPushFunction(lua_State * L, CString funcname);
+    // Forgets the registry references kept for L, for a new script or before the state is closed
+    static void LuaReleaseRefs(lua_State * L);
+
+    // Pushes the line table handed to the tag handlers of entry, created with its "id" on
+    // first use and reused afterwards: the caller sets the fields that change per call
+    void LuaPushLineTable(lua_State * L, int entry);
+    // Sets the "user" field of the table on top to the saved user data of entry, or nil
+    void LuaSetUserField(lua_State * L, int entry);
+
+    // lua_pcall, counted in the call statistics of this thread
+    int LuaCall(lua_State * L, int nargs, int nresults);
+    static void ResetLuaStats();
+    static void GetLuaStats(int& calls, double& ms);
+
     bool LuaIsFunction(lua_State * L, CString fieldname);
     bool LuaIsNumber(lua_State * L, CString fieldname);
     bool LuaIsString(lua_State * L, CString fieldname);
@@ -127,6 +143,11 @@ public:
 
     png_bytep*	pointer;
 
+    // The image expanded once for the renderer: BGRA rows top first as getmixcolor counts
+    // them, each with a copy of its first pixel in front, so x - 1 can always be sampled
+    DWORD*	texture;
+    int		texturePitch; // in pixels
+
     MOD_PNGIMAGE();
 
     bool operator == (MOD_PNGIMAGE& png);
@@ -27,13 +27,32 @@
 #include <omp.h>
 #endif
 #include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <emmintrin.h>
+
+// Below this many bytes per buffer, spinning up the OpenMP team costs more than it saves
+#define SEPARABLE_FILTER_OMP_MIN_BYTES 65536
+
+// Set on threads that already run as one of many parallel tasks, the filters then stay on
+// the calling thread instead of oversubscribing the machine with an OpenMP team of their own
+inline bool& SeparableFilterSerial()
+{
+    static thread_local bool fSerial = false;
+    return fSerial;
+}
+
+inline bool SeparableFilterUseOmp(ptrdiff_t bytes)
+{
+    return !SeparableFilterSerial() && bytes >= SEPARABLE_FILTER_OMP_MIN_BYTES;
+}
 
 // Filter an image in horizontal direction with a one-dimensional filter
 // PixelWidth is the distance in bytes between pixels
 template<ptrdiff_t PixelDist>
 void SeparableFilterX(unsigned char *src, unsigned char *dst, int width, int height, ptrdiff_t stride, int *kernel, int kernel_size, int divisor, int direction)
 {
-#pragma omp parallel for
+#pragma omp parallel for if(SeparableFilterUseOmp(stride * height))
     for(int y = 0; y < height; y++)
     {
         unsigned char *in = src + y * stride;
@@ -71,7 +90,7 @@ template<ptrdiff_t PixelDist>
 void SeparableFilterY(unsigned char *src, unsigned char *dst, int width, int height, ptrdiff_t stride, int *kernel, int kernel_size, int divisor, int direction)
 {
     width *= PixelDist;
-#pragma omp parallel for
+#pragma omp parallel for if(SeparableFilterUseOmp(stride * height))
     for(int  x = 0; x < width; x += PixelDist)
     {
         unsigned char *in = src + x;
@@ -133,4 +152,276 @@ struct GaussianKernel
     {
         delete[] kernel;
     }
-};
\ No newline at end of file
+};
+
+
+// Constant time gaussian approximation: three box filters in a row, each done with
+// a running sum, so the cost per pixel does not depend on sigma. It works on one
+// overlay plane and wraps around the edges just like SeparableFilterX/Y.
+
+// The cascade is only an approximation, so it takes over from the exact convolution only
+// for large radii (\blur20 and up) on overlays where the convolution costs at least this
+// many multiply-adds per pass; ordinary blurs and small words keep their exact output
+#define BOX_BLUR_MIN_KERNEL_WIDTH 61
+#define BOX_BLUR_MIN_WORK (1 << 22)
+
+static inline bool UseBoxBlur(const GaussianKernel& filter, int width, int height)
+{
+    return filter.width >= BOX_BLUR_MIN_KERNEL_WIDTH
+           && (__int64)filter.width * width * height >= BOX_BLUR_MIN_WORK;
+}
+
+struct BoxBlurKernel
+{
+    enum {passes = 3};
+    int width[passes];
+
+    inline BoxBlurKernel(const GaussianKernel& filter)
+    {
+        // GaussianKernel cuts the curve off at about 1.5 sigma, so match the variance of
+        // its actual weights rather than sigma^2, or large blurs would come out wider
+        // than the convolution they replace
+        double var = 0;
+        for(int k = 0; k < filter.width; k++)
+            var += (double)filter.kernel[k] * (k - filter.width / 2) * (k - filter.width / 2);
+        var /= filter.divisor;
+
+        // Pick odd widths wl and wl+2 so the variances (w^2-1)/12 of the passes add up to var
+        double ideal = sqrt(12 * var / passes + 1);
+        int wl = (int)ideal;
+        if(!(wl & 1)) wl--;
+        if(wl < 1) wl = 1;
+        int m = (int)((12 * var - passes * wl * wl - 4 * passes * wl - 3 * passes) / (-4 * wl - 4) + 0.5);
+        if(m < 0) m = 0;
+        if(m > passes) m = passes;
+        for(int i = 0; i < passes; i++)
+            width[i] = i < m ? wl : wl + 2;
+    }
+};
+
+// (sum + w/2) * BoxBlurMul(w) >> 16 divides by w, results above 255 get clamped
+static inline unsigned int BoxBlurMul(int w)
+{
+    return (65536 + w - 1) / w;
+}
+
+// Horizontal box pass, src and dst must differ. The SSE2 version needs boxw < 256 too: it
+// does eight pixels at a time where neither end of the box wraps, turning the differences
+// of the bytes entering and leaving the box into eight running sums with a prefix sum.
+// The 16-bit sums wrap around but their differences stay exact, so it matches the C loop.
+static inline void BoxFilterX(const unsigned char *src, unsigned char *dst, int width, int height, ptrdiff_t stride, int boxw, bool fSSE2)
+{
+    int r = boxw / 2;
+    unsigned int mul = BoxBlurMul(boxw);
+    bool fVector = fSSE2 && boxw < 256;
+
+#pragma omp parallel for if(SeparableFilterUseOmp(stride * height))
+    for(int y = 0; y < height; y++)
+    {
+        const unsigned char *in = src + y * stride;
+        unsigned char *out = dst + y * stride;
+
+        unsigned int sum = 0;
+        for(int k = -r; k <= r; k++)
+            sum += in[k < 0 ? k + width : k];
+
+        int x = 0;
+
+        if(fVector)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i bias = _mm_set1_epi16((short)(boxw >> 1));
+            const __m128i mul16 = _mm_set1_epi16((short)mul);
+
+            for(; x < r; x++)
+            {
+                unsigned int v = ((sum + (boxw >> 1)) * mul) >> 16;
+                out[x] = (unsigned char)(v > 255 ? 255 : v);
+
+                int xa = x + r + 1, xs = x - r;
+                sum += in[xa >= width ? xa - width : xa];
+                sum -= in[xs < 0 ? xs + width : xs];
+            }
+
+            __m128i sums = _mm_set1_epi16((short)sum);
+
+            for(; x + r + 8 < width; x += 8)
+            {
+                __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(in + x + r + 1)), zero),
+                                          _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(in + x - r)), zero));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 2));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 4));
+                d = _mm_add_epi16(d, _mm_slli_si128(d, 8));
+
+                // lane k sums the box at x + k, which has the first k differences applied
+                __m128i s = _mm_add_epi16(sums, _mm_slli_si128(d, 2));
+                _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(_mm_mulhi_epu16(_mm_add_epi16(s, bias), mul16), zero));
+
+                sums = _mm_add_epi16(sums, d);
+                sums = _mm_shufflehi_epi16(sums, 0xff);
+                sums = _mm_unpackhi_epi64(sums, sums);
+            }
+
+            sum = (unsigned short)_mm_cvtsi128_si32(sums);
+        }
+
+        for(; x < width; x++)
+        {
+            unsigned int v = ((sum + (boxw >> 1)) * mul) >> 16;
+            out[x] = (unsigned char)(v > 255 ? 255 : v);
+
+            int xa = x + r + 1, xs = x - r;
+            sum += in[xa >= width ? xa - width : xa];
+            sum -= in[xs < 0 ? xs + width : xs];
+        }
+    }
+}
+
+// Bytes of scratch BoxBlur needs for the running sums of one row of stride bytes
+static inline size_t BoxBlurScratchSize(ptrdiff_t stride)
+{
+    size_t sums16 = ((stride + 15) & ~15) * sizeof(unsigned short);
+    size_t sums32 = stride * sizeof(unsigned int);
+    return sums16 > sums32 ? sums16 : sums32;
+}
+
+// Vertical box pass, src and dst must differ. The SSE2 version keeps 16-bit running
+// sums for every byte of a row, so it needs boxw < 256. It runs over whole 16-byte
+// blocks and finishes the row in C, so the row padding is neither read nor written
+// (on the ping-pong passes src may be scratch memory with garbage there), and uses
+// aligned loads when the planes, the scratch and stride are 16-byte aligned.
+static inline void BoxFilterY(const unsigned char *src, unsigned char *dst, int width, int height, ptrdiff_t stride, int boxw, void *scratch, bool fSSE2)
+{
+    int r = boxw / 2;
+    unsigned int mul = BoxBlurMul(boxw);
+
+    if(fSSE2 && boxw < 256)
+    {
+        int bytes = width;
+        int vbytes = bytes & ~15;
+        bool fAligned = !(((size_t)src | (size_t)dst | (size_t)scratch | stride) & 15);
+
+        unsigned short *sums = (unsigned short*)scratch;
+        memset(sums, 0, bytes * sizeof(unsigned short));
+
+        for(int k = -r; k <= r; k++)
+        {
+            const unsigned char *in = src + (k < 0 ? k + height : k) * stride;
+            for(int i = 0; i < bytes; i++) sums[i] += in[i];
+        }
+
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi16((short)(boxw >> 1));
+        const __m128i mul16 = _mm_set1_epi16((short)mul);
+
+        for(int y = 0; y < height; y++)
+        {
+            int ya = y + r + 1, ys = y - r;
+            const unsigned char *add = src + (ya >= height ? ya - height : ya) * stride;
+            const unsigned char *sub = src + (ys < 0 ? ys + height : ys) * stride;
+            unsigned char *out = dst + y * stride;
+            unsigned short *sum = sums;
+
+            int i = 0;
+            if(fAligned)
+            {
+                for(; i < vbytes; i += 16)
+                {
+                    __m128i s0 = _mm_load_si128((__m128i*)(sum + i));
+                    __m128i s1 = _mm_load_si128((__m128i*)(sum + i + 8));
+
+                    _mm_store_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_mulhi_epu16(_mm_add_epi16(s0, bias), mul16),
+                                                                          _mm_mulhi_epu16(_mm_add_epi16(s1, bias), mul16)));
+
+                    __m128i a = _mm_load_si128((__m128i*)(add + i));
+                    __m128i b = _mm_load_si128((__m128i*)(sub + i));
+                    _mm_store_si128((__m128i*)(sum + i), _mm_sub_epi16(_mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero)), _mm_unpacklo_epi8(b, zero)));
+                    _mm_store_si128((__m128i*)(sum + i + 8), _mm_sub_epi16(_mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero)), _mm_unpackhi_epi8(b, zero)));
+                }
+            }
+            else
+            {
+                for(; i < vbytes; i += 16)
+                {
+                    __m128i s0 = _mm_loadu_si128((__m128i*)(sum + i));
+                    __m128i s1 = _mm_loadu_si128((__m128i*)(sum + i + 8));
+
+                    _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(_mm_mulhi_epu16(_mm_add_epi16(s0, bias), mul16),
+                                                                           _mm_mulhi_epu16(_mm_add_epi16(s1, bias), mul16)));
+
+                    __m128i a = _mm_loadu_si128((__m128i*)(add + i));
+                    __m128i b = _mm_loadu_si128((__m128i*)(sub + i));
+                    _mm_storeu_si128((__m128i*)(sum + i), _mm_sub_epi16(_mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero)), _mm_unpacklo_epi8(b, zero)));
+                    _mm_storeu_si128((__m128i*)(sum + i + 8), _mm_sub_epi16(_mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero)), _mm_unpackhi_epi8(b, zero)));
+                }
+            }
+
+            for(; i < bytes; i++)
+            {
+                unsigned int v = ((sum[i] + (boxw >> 1)) * mul) >> 16;
+                out[i] = (unsigned char)(v > 255 ? 255 : v);
+                sum[i] = (unsigned short)(sum[i] + add[i] - sub[i]);
+            }
+        }
+    }
+    else
+    {
+        unsigned int *sums = (unsigned int*)scratch;
+        memset(sums, 0, width * sizeof(unsigned int));
+
+        for(int k = -r; k <= r; k++)
+        {
+            const unsigned char *in = src + (k < 0 ? k + height : k) * stride;
+            for(int x = 0; x < width; x++) sums[x] += in[x];
+        }
+
+        for(int y = 0; y < height; y++)
+        {
+            int ya = y + r + 1, ys = y - r;
+            const unsigned char *add = src + (ya >= height ? ya - height : ya) * stride;
+            const unsigned char *sub = src + (ys < 0 ? ys + height : ys) * stride;
+            unsigned char *out = dst + y * stride;
+
+            for(int x = 0; x < width; x++)
+            {
+                unsigned int v = ((sums[x] + (boxw >> 1)) * mul) >> 16;
+                out[x] = (unsigned char)(v > 255 ? 255 : v);
+                sums[x] += add[x];
+                sums[x] -= sub[x];
+            }
+        }
+    }
+}
+
+// Blur buf in place, tmp must be as large as buf and scratch BoxBlurScratchSize(stride) bytes.
+// direction: 0 = both, 1 = horizontal only, 2 = vertical only
+static inline void BoxBlur(unsigned char *buf, unsigned char *tmp, int width, int height, ptrdiff_t stride, const BoxBlurKernel& box, int direction, void *scratch, bool fSSE2)
+{
+    unsigned char *src = buf, *dst = tmp;
+
+    // Boxes wider than the buffer would wrap more than once, clamp them to the largest odd
+    // width that fits, width 1 is a no-op
+    int maxw = (width - 1) | 1, maxh = (height - 1) | 1;
+
+    for(int i = 0; i < BoxBlurKernel::passes; i++)
+    {
+        int boxw = std::min(box.width[i], maxw);
+        if(direction == 2 || boxw < 3) continue;
+        BoxFilterX(src, dst, width, height, stride, boxw, fSSE2);
+        std::swap(src, dst);
+    }
+
+    for(int i = 0; i < BoxBlurKernel::passes; i++)
+    {
+        int boxh = std::min(box.width[i], maxh);
+        if(direction == 1 || boxh < 3) continue;
+        BoxFilterY(src, dst, width, height, stride, boxh, scratch, fSSE2);
+        std::swap(src, dst);
+    }
+
+    if(src != buf)
+    {
+        for(int y = 0; y < height; y++)
+            memcpy(buf + y * stride, src + y * stride, width);
+    }
+}
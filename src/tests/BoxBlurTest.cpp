@@ -0,0 +1,119 @@
+/*
+ * Box blur cascade against the gaussian convolution it replaces
+ */
+
+#include "../subtitles/stdafx.h"
+#include "Test.h"
+#include "../subtitles/SeparableFilter.h"
+#include "../dsutil/vd.h"
+#include <vector>
+
+// A disc with hard edges on a background of thin stripes, like a blurred \bord around text
+static void MakeBlurPlane(std::vector<unsigned char>& plane, int width, int height, ptrdiff_t stride)
+{
+    plane.assign(stride * height, 0);
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            int dx = x - width / 2, dy = y - height / 2, r = min(width, height) / 5;
+            plane[y * stride + x] = dx * dx + dy * dy < r * r ? 255 : ((x / 7 + y / 5) % 3 ? 0 : 128);
+        }
+    }
+}
+
+// Blurs a plane both ways and returns the mean and the largest difference per pixel
+static void CompareBlur(double sigma, int width, int height, bool fSSE2, double& meanDiff, int& maxDiff)
+{
+    ptrdiff_t stride = (width + 15) & ~15;
+
+    std::vector<unsigned char> conv, box, tmp(stride * height), scratch(BoxBlurScratchSize(stride));
+    MakeBlurPlane(conv, width, height, stride);
+    box = conv;
+
+    GaussianKernel filter(sigma);
+    SeparableFilterX<1>(&conv[0], &tmp[0], width, height, stride, filter.kernel, filter.width, filter.divisor, 0);
+    SeparableFilterY<1>(&tmp[0], &conv[0], width, height, stride, filter.kernel, filter.width, filter.divisor, 0);
+
+    BoxBlur(&box[0], &tmp[0], width, height, stride, BoxBlurKernel(filter), 0, &scratch[0], fSSE2);
+
+    double sum = 0;
+    maxDiff = 0;
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            int d = abs(conv[y * stride + x] - box[y * stride + x]);
+            sum += d;
+            maxDiff = max(maxDiff, d);
+        }
+    }
+    meanDiff = sum / (width * height);
+}
+
+TEST(BoxBlurThreshold)
+{
+    // \blur3 and anything below \blur20 keep the convolution, as do small overlays
+    CHECK(!UseBoxBlur(GaussianKernel(3), 2000, 2000));
+    CHECK(!UseBoxBlur(GaussianKernel(19), 2000, 2000));
+    CHECK(!UseBoxBlur(GaussianKernel(20), 40, 40));
+    CHECK(UseBoxBlur(GaussianKernel(20), 400, 400));
+    CHECK(GaussianKernel(20).width == BOX_BLUR_MIN_KERNEL_WIDTH);
+    return true;
+}
+
+TEST(BoxBlurMatchesGaussian)
+{
+    static const double sigmas[] = {20, 30, 60};
+
+    for(int i = 0; i < countof(sigmas); i++)
+    {
+        CHECK(UseBoxBlur(GaussianKernel(sigmas[i]), 400, 400));
+
+        double meanDiff;
+        int maxDiff;
+        CompareBlur(sigmas[i], 400, 400, false, meanDiff, maxDiff);
+
+        // The cascade has the variance of the truncated kernel but not quite its shape
+        CHECK(meanDiff < 2.0);
+        CHECK(maxDiff <= 16);
+    }
+
+    return true;
+}
+
+// The SSE2 passes must give the C result exactly and leave the row padding alone
+TEST(BoxFilterSSE2)
+{
+    if(!(g_cpuid.m_flags & CCpuID::sse2))
+        return true;
+
+    srand(1);
+
+    for(int i = 0; i < 2000; i++)
+    {
+        int width = 1 + rand() % 300, height = 1 + rand() % 40;
+        ptrdiff_t stride = width + rand() % 40;
+        int boxw = min(3 + 2 * (rand() % 130), (width - 1) | 1);
+        if(boxw < 3) continue;
+
+        std::vector<unsigned char> src(stride * height), c(stride * height, 0xab), sse2(stride * height, 0xab);
+        std::vector<unsigned char> scratch(BoxBlurScratchSize(stride) + 16);
+        for(size_t k = 0; k < src.size(); k++)
+            src[k] = (i & 1) ? 255 : (unsigned char)rand();
+
+        BoxFilterX(&src[0], &c[0], width, height, stride, boxw, false);
+        BoxFilterX(&src[0], &sse2[0], width, height, stride, boxw, true);
+        CHECK(c == sse2);
+
+        int boxh = min(boxw, (height - 1) | 1);
+        if(boxh < 3) continue;
+
+        BoxFilterY(&src[0], &c[0], width, height, stride, boxh, &scratch[0], false);
+        BoxFilterY(&src[0], &sse2[0], width, height, stride, boxh, &scratch[0], true);
+        CHECK(c == sse2);
+    }
+
+    return true;
+}
@@ -0,0 +1,89 @@
+/*
+ * Overlay cache keys: words that rasterize differently never share an entry
+ */
+
+#include "../subtitles/stdafx.h"
+#include "Test.h"
+#include "../subtitles/RTS.h"
+#include <vector>
+
+// A word painted through the cache, which hands out the overlay it ended up with
+class COverlayText : public CText
+{
+public:
+    COverlayText(STSStyle& style, COverlayCache* pOverlayCache)
+        : CText(style, L"Cached", 0, 0, 0, 1.0, 1.0)
+    {
+        m_pOverlayCache = pOverlayCache;
+    }
+
+    std::vector<BYTE> GetOverlay() const
+    {
+        std::vector<BYTE> overlay(mpOverlayBuffer, mpOverlayBuffer + GetOverlaySize());
+        overlay.push_back((BYTE)mOverlayWidth);
+        overlay.push_back((BYTE)mOverlayHeight);
+        return overlay;
+    }
+};
+
+static std::vector<BYTE> PaintOverlay(STSStyle& style, COverlayCache& cache, CPoint p, CPoint org)
+{
+    COverlayText w(style, &cache);
+#if defined (_VSMOD) && defined(_LUA)
+    w.Paint(p, org, 0);
+#else
+    w.Paint(p, org);
+#endif
+    return w.GetOverlay();
+}
+
+TEST(OverlayCacheKey)
+{
+    // The words measure and draw with the DC the subtitle owns
+    CCritSec lock;
+    CRenderedTextSubtitle rts(&lock);
+    COverlayCache cache(OVERLAY_CACHE_DEFAULT_BUDGET);
+
+    STSStyle style;
+    CPoint p(100, 100), org(140, 110);
+
+    std::vector<BYTE> plain = PaintOverlay(style, cache, p, org);
+    size_t size = cache.GetSize();
+    CHECK(size > 0);
+
+    // The same word at the same place comes from the cache
+    CHECK(PaintOverlay(style, cache, p, org) == plain);
+    CHECK(cache.GetSize() == size);
+
+    // Shear alone
+    STSStyle shifted = style;
+    shifted.fontShiftX = 0.5;
+    CHECK(PaintOverlay(shifted, cache, p, org) != plain);
+    CHECK(cache.GetSize() > size);
+    size = cache.GetSize();
+
+#ifdef _VSMOD
+    // Distortion alone, the disabled one keeps its points out of the key
+    STSStyle distorted = style;
+    distorted.mod_distort.pointsx[0] = 1.5;
+    CHECK(PaintOverlay(distorted, cache, p, org) == plain);
+    CHECK(cache.GetSize() == size);
+
+    distorted.mod_distort.enabled = true;
+    std::vector<BYTE> distortedOverlay = PaintOverlay(distorted, cache, p, org);
+    CHECK(distortedOverlay != plain);
+    CHECK(cache.GetSize() > size);
+    size = cache.GetSize();
+
+    distorted.mod_distort.pointsy[2] = 1.5;
+    CHECK(PaintOverlay(distorted, cache, p, org) != distortedOverlay);
+    CHECK(cache.GetSize() > size);
+    size = cache.GetSize();
+#endif
+
+    // The origin alone, without anything rotating around it
+    PaintOverlay(style, cache, p, CPoint(org.x + 300, org.y - 50));
+    CHECK(cache.GetSize() > size);
+
+    return true;
+}
@@ -0,0 +1,261 @@
+/*
+ * Overlay mixer row kernels of every SIMD tier against the C ones
+ */
+
+#include "../subtitles/stdafx.h"
+#include "Test.h"
+#include "../subtitles/OverlayMix.h"
+#include <vector>
+#include <algorithm>
+
+// Every row length up to this leaves every tail size after the vector loops of every
+// tier (16 pixels for AVX-512), and then some, for the kernels that hand tails down
+#define MIX_TEST_MAX_LENGTH 48
+
+static DWORD Random32()
+{
+    return ((DWORD)rand() << 30) ^ ((DWORD)rand() << 15) ^ (DWORD)rand();
+}
+
+// A coverage row with runs of 0 and of 0x40 (the kernels skip or shortcut whole blocks
+// of them), every coverage in turn, and then random coverages mixed with the two runs
+static void MakeCoverageRow(std::vector<BYTE>& cov)
+{
+    cov.clear();
+    cov.insert(cov.end(), 16, 0);
+    cov.insert(cov.end(), 16, 0x40);
+    for(int a = 0; a <= 0x40; a++)
+        cov.push_back((BYTE)a);
+    while(cov.size() < 160)
+    {
+        int r = rand() % 3;
+        cov.push_back((BYTE)(r == 0 ? 0 : r == 1 ? 0x40 : rand() % 0x41));
+    }
+}
+
+// Both kernels mix the same row of the same pixels, nothing past n may change
+template<class Mix>
+static bool SameMix(Mix mixRef, Mix mixTier, int n, const std::vector<DWORD>& pixels)
+{
+    std::vector<DWORD> ref(pixels), tier(pixels);
+
+    mixRef(&ref[0], n);
+    mixTier(&tier[0], n);
+
+    return ref == tier && std::equal(ref.begin() + n, ref.end(), pixels.begin() + n);
+}
+
+TEST(OverlaySubtractRow)
+{
+    // Every pair of border and body coverage, as bytes
+    std::vector<BYTE> border(65536), body(65536);
+    for(int i = 0; i < 65536; i++)
+    {
+        border[i] = (BYTE)i;
+        body[i] = (BYTE)(i >> 8);
+    }
+
+    COverlayRowFuncs ref = MakeOverlayRowFuncs(BLEND_NORMAL, CCpuID::tier_c);
+
+    for(int t = CCpuID::tier_sse2; t <= g_cpuid.m_tier; t++)
+    {
+        COverlayRowFuncs f = MakeOverlayRowFuncs(BLEND_NORMAL, (CCpuID::tier_t)t);
+
+        // The short rows at a few offsets, the last round all pairs at once
+        for(int i = 0; i <= MIX_TEST_MAX_LENGTH + 1; i++)
+        {
+            int n = i <= MIX_TEST_MAX_LENGTH ? i : 65536;
+
+            for(int ofs = 0; ofs <= 65536 - n; ofs += 4099)
+            {
+                std::vector<BYTE> a(n + 16, 0xcd), b(n + 16, 0xcd);
+                ref.subtract(&a[0], &border[ofs], &body[ofs], n);
+                f.subtract(&b[0], &border[ofs], &body[ofs], n);
+                CHECK(a == b);
+                CHECK(b[n] == 0xcd);
+            }
+        }
+    }
+
+    return true;
+}
+
+TEST(OverlayClipRow)
+{
+    // Every pair of coverage and clip mask, as bytes
+    std::vector<BYTE> cov(65536), mask(65536);
+    for(int i = 0; i < 65536; i++)
+    {
+        cov[i] = (BYTE)i;
+        mask[i] = (BYTE)(i >> 8);
+    }
+
+    COverlayRowFuncs ref = MakeOverlayRowFuncs(BLEND_NORMAL, CCpuID::tier_c);
+
+    for(int t = CCpuID::tier_sse2; t <= g_cpuid.m_tier; t++)
+    {
+        COverlayRowFuncs f = MakeOverlayRowFuncs(BLEND_NORMAL, (CCpuID::tier_t)t);
+
+        // The short rows at a few offsets, the last round all pairs at once
+        for(int i = 0; i <= MIX_TEST_MAX_LENGTH + 1; i++)
+        {
+            int n = i <= MIX_TEST_MAX_LENGTH ? i : 65536;
+
+            for(int ofs = 0; ofs <= 65536 - n; ofs += 4099)
+            {
+                std::vector<BYTE> a(n + 16, 0xcd), b(n + 16, 0xcd);
+                ref.clip(&a[0], &cov[ofs], &mask[ofs], n);
+                f.clip(&b[0], &cov[ofs], &mask[ofs], n);
+                CHECK(a == b);
+                CHECK(b[n] == 0xcd);
+            }
+        }
+    }
+
+    return true;
+}
+
+struct CMixConst
+{
+    MixConstRowFunc mix;
+    DWORD color;
+    BYTE alpha;
+    void operator()(DWORD* dst, int n) const { mix(dst, n, color, alpha); }
+};
+
+TEST(OverlayMixConstRow)
+{
+    srand(1);
+
+    std::vector<DWORD> pixels(MIX_TEST_MAX_LENGTH + 16);
+    COverlayRowFuncs ref = MakeOverlayRowFuncs(BLEND_NORMAL, CCpuID::tier_c);
+
+    for(int t = CCpuID::tier_sse2; t <= g_cpuid.m_tier; t++)
+    {
+        COverlayRowFuncs f = MakeOverlayRowFuncs(BLEND_NORMAL, (CCpuID::tier_t)t);
+
+        // Every color alpha at every coverage
+        for(int ca = 0; ca < 256; ca++)
+        {
+            for(int a = 0; a <= 0x40; a++)
+            {
+                for(size_t i = 0; i < pixels.size(); i++)
+                    pixels[i] = Random32();
+
+                CMixConst mixRef = {ref.mixConst, ((DWORD)ca << 24) | (Random32() & 0xffffff), (BYTE)a};
+                CMixConst mixTier = mixRef;
+                mixTier.mix = f.mixConst;
+
+                for(int n = 0; n <= MIX_TEST_MAX_LENGTH; n++)
+                    CHECK(SameMix(mixRef, mixTier, n, pixels));
+            }
+        }
+    }
+
+    return true;
+}
+
+struct CMixSolid
+{
+    MixSolidRowFunc mix;
+    const BYTE* alpha;
+    DWORD color;
+    void operator()(DWORD* dst, int n) const { mix(dst, alpha, n, color); }
+};
+
+TEST(OverlayMixSolidRow)
+{
+    srand(2);
+
+    std::vector<BYTE> cov;
+    MakeCoverageRow(cov);
+    std::vector<DWORD> pixels(cov.size());
+
+    COverlayRowFuncs ref = MakeOverlayRowFuncs(BLEND_NORMAL, CCpuID::tier_c);
+
+    for(int t = CCpuID::tier_sse2; t <= g_cpuid.m_tier; t++)
+    {
+        COverlayRowFuncs f = MakeOverlayRowFuncs(BLEND_NORMAL, (CCpuID::tier_t)t);
+
+        // Every color alpha, the row has every coverage
+        for(int ca = 0; ca < 256; ca++)
+        {
+            for(size_t i = 0; i < pixels.size(); i++)
+                pixels[i] = Random32();
+
+            CMixSolid mixRef = {ref.mixSolid, &cov[0], ((DWORD)ca << 24) | (Random32() & 0xffffff)};
+            CMixSolid mixTier = mixRef;
+            mixTier.mix = f.mixSolid;
+
+            CHECK(SameMix(mixRef, mixTier, (int)cov.size(), pixels));
+
+            for(int n = 0; n <= MIX_TEST_MAX_LENGTH; n++)
+            {
+                // Start in the zero run, the full run and among the single coverages
+                for(int ofs = 0; ofs < 64; ofs += 9)
+                {
+                    mixRef.alpha = mixTier.alpha = &cov[ofs];
+                    CHECK(SameMix(mixRef, mixTier, n, pixels));
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+struct CMixColors
+{
+    MixColorRowFunc mix;
+    const BYTE* alpha;
+    const DWORD* colors;
+    void operator()(DWORD* dst, int n) const { mix(dst, alpha, colors, n); }
+};
+
+TEST(OverlayMixColorRow)
+{
+    srand(3);
+
+    std::vector<BYTE> cov;
+    MakeCoverageRow(cov);
+    std::vector<DWORD> pixels(cov.size()), colors(cov.size());
+
+    for(int mode = BLEND_NORMAL; mode <= BLEND_SUBSTRACT_INVERSE; mode++)
+    {
+        COverlayRowFuncs ref = MakeOverlayRowFuncs((MOD_BLEND)mode, CCpuID::tier_c);
+
+        for(int t = CCpuID::tier_sse2; t <= g_cpuid.m_tier; t++)
+        {
+            COverlayRowFuncs f = MakeOverlayRowFuncs((MOD_BLEND)mode, (CCpuID::tier_t)t);
+            CHECK(f.fBlend == ref.fBlend);
+
+            // Every color alpha, the row has every coverage
+            for(int ca = 0; ca < 256; ca++)
+            {
+                for(size_t i = 0; i < pixels.size(); i++)
+                {
+                    pixels[i] = Random32();
+                    colors[i] = ((DWORD)ca << 24) | (Random32() & 0xffffff);
+                }
+
+                CMixColors mixRef = {ref.mixColors, &cov[0], &colors[0]};
+                CMixColors mixTier = mixRef;
+                mixTier.mix = f.mixColors;
+
+                CHECK(SameMix(mixRef, mixTier, (int)cov.size(), pixels));
+
+                for(int n = 0; n <= MIX_TEST_MAX_LENGTH; n++)
+                {
+                    for(int ofs = 0; ofs < 64; ofs += 9)
+                    {
+                        mixRef.alpha = mixTier.alpha = &cov[ofs];
+                        mixRef.colors = mixTier.colors = &colors[ofs];
+                        CHECK(SameMix(mixRef, mixTier, n, pixels));
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,29 @@
+/*
+ * Minimal test runner for the rendering kernels
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+// A test returns true when it passed, CHECK prints the condition that failed and bails out
+typedef bool (*TestFunc)();
+
+struct CTestCase
+{
+    const char* name;
+    TestFunc func;
+    CTestCase* next;
+
+    CTestCase(const char* name, TestFunc func);
+
+    static CTestCase*& First();
+};
+
+#define TEST(name) \
+    static bool name(); \
+    static CTestCase name##_case(#name, name); \
+    static bool name()
+
+#define CHECK(cond) \
+    do { if(!(cond)) { printf("  %s(%d): %s\n", __FILE__, __LINE__, #cond); return false; } } while(0)
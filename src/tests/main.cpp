@@ -0,0 +1,49 @@
+/*
+ * Minimal test runner for the rendering kernels
+ */
+
+#include "../subtitles/stdafx.h"
+#include "Test.h"
+#include "../dsutil/vd.h"
+
+CTestCase::CTestCase(const char* name, TestFunc func)
+    : name(name)
+    , func(func)
+    , next(First())
+{
+    First() = this;
+}
+
+CTestCase*& CTestCase::First()
+{
+    static CTestCase* first = NULL;
+    return first;
+}
+
+// Runs every test, or those whose name starts with the first argument, and returns the
+// number that failed. VSFILTER_SIMD caps the tier the kernels are checked up to.
+int main(int argc, char* argv[])
+{
+    if(!AfxWinInit(::GetModuleHandle(NULL), NULL, ::GetCommandLine(), 0))
+        return 1;
+
+    printf("SIMD tier: %s\n", CCpuID::GetTierName(g_cpuid.m_tier));
+
+    int run = 0, failed = 0;
+
+    for(CTestCase* t = CTestCase::First(); t; t = t->next)
+    {
+        if(argc > 1 && strncmp(t->name, argv[1], strlen(argv[1])))
+            continue;
+
+        bool fPassed = t->func();
+        printf("%s: %s\n", t->name, fPassed ? "ok" : "FAILED");
+
+        run++;
+        if(!fPassed) failed++;
+    }
+
+    printf("%d of %d tests failed\n", failed, run);
+
+    return failed;
+}
@@ -603,6 +603,42 @@ void CDirectVobSubFilter::PrintMessages(BYTE* pOut)
                 msg += tmp;
             }
 
+            if(CSubPicQueueNoThread* pSubPicQueue = dynamic_cast<CSubPicQueueNoThread*>((ISubPicQueue*)m_pSubPicQueue))
+            {
+                int nHits = 0, nMisses = 0;
+                pSubPicQueue->GetCacheStats(nHits, nMisses);
+                tmp.Format(_T("subpic cache: %d hits, %d misses\n"), nHits, nMisses);
+                msg += tmp;
+            }
+
+            CComPtr<ISubPicProvider> pSubPicProvider;
+            m_pSubPicQueue->GetSubPicProvider(&pSubPicProvider);
+
+            CLSID clsid;
+            CComQIPtr<ISubStream> pSubStream = pSubPicProvider;
+            if(pSubStream && SUCCEEDED(pSubStream->GetClassID(&clsid)) && clsid == __uuidof(CRenderedTextSubtitle))
+            {
+                CRenderedTextSubtitle* pRTS = (CRenderedTextSubtitle*)(ISubStream*)pSubStream;
+
+                int skipped = 0, visited = 0;
+                pRTS->GetTileStats(skipped, visited);
+                tmp.Format(_T("overlay tiles: %d skipped, %d mixed\n"), skipped, visited);
+                msg += tmp;
+
+                __int64 allocsAvoided = 0, heapAllocs = 0;
+                size_t peakSize = 0;
+                CRasterizerArena::GetStats(allocsAvoided, heapAllocs, peakSize);
+                tmp.Format(_T("rasterizer arena: %I64d reused, %I64d heap allocs, %d KB peak\n"), allocsAvoided, heapAllocs, (int)(peakSize >> 10));
+                msg += tmp;
+#if defined(_VSMOD) && defined(_LUA)
+                int calls = 0;
+                double ms = 0;
+                pRTS->GetLuaStats(calls, ms);
+                tmp.Format(_T("lua: %d calls, %.2f ms\n"), calls, ms);
+                msg += tmp;
+#endif
+            }
+
         }
     }
 
@@ -274,13 +274,17 @@ HRESULT CDirectVobSubFilter::Transform(IMediaSample* pIn)
             CComPtr<ISubPic> pSubPic;
             if(SUCCEEDED(m_pSubPicQueue->LookupSubPic(CalcCurrentTime(), pSubPic)) && pSubPic)
             {
-                CRect r;
-                pSubPic->GetDirtyRect(r);
+                CAtlList<CRect> rects;
+                pSubPic->GetDirtyRects(rects);
 
                 if(fFlip ^ fFlipSub)
                     spd.h = -spd.h;
 
-                pSubPic->AlphaBlt(r, r, &spd);
+                for(POSITION pos = rects.GetHeadPosition(); pos; )
+                {
+                    CRect r = rects.GetNext(pos);
+                    pSubPic->AlphaBlt(r, r, &spd);
+                }
             }
         }
     }
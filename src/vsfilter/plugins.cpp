@@ -66,12 +66,13 @@ protected:
     CComPtr<ISubPicQueue> m_pSubPicQueue;
     CComPtr<ISubPicProvider> m_pSubPicProvider;
     DWORD_PTR m_SubPicProviderId;
+    size_t m_subPicCacheBudget;
 
     CSimpleTextSubtitle::YCbCrMatrix m_script_selected_yuv;
     CSimpleTextSubtitle::YCbCrRange m_script_selected_range;
 
 public:
-    CFilter() : m_fps(-1), m_SubPicProviderId(0)
+    CFilter() : m_fps(-1), m_SubPicProviderId(0), m_subPicCacheBudget(SUBPIC_CACHE_DEFAULT_BUDGET)
     {
         CAMThread::Create();
     }
@@ -91,6 +92,12 @@ public:
         m_fn = fn;
     }
 
+    // memory the already rendered subtitle images may keep around for frames requested again, before the first Render
+    void SetSubPicCacheBudget(size_t bytes)
+    {
+        m_subPicCacheBudget = bytes;
+    }
+
     bool Render(SubPicDesc& dst, REFERENCE_TIME rt, float fps)
     {
         if(!m_pSubPicProvider)
@@ -103,11 +110,14 @@ public:
             CComPtr<ISubPicAllocator> pAllocator = new CMemSubPicAllocator(dst.type, size, m_script_selected_yuv, m_script_selected_range);
 
             HRESULT hr;
-            if(!(m_pSubPicQueue = new CSubPicQueueNoThread(pAllocator, &hr)) || FAILED(hr))
+            CSubPicQueueNoThread* pSubPicQueue = new CSubPicQueueNoThread(pAllocator, &hr);
+            if(!(m_pSubPicQueue = pSubPicQueue) || FAILED(hr))
             {
                 m_pSubPicQueue = NULL;
                 return(false);
             }
+
+            pSubPicQueue->SetCacheBudget(m_subPicCacheBudget);
         }
 
         if(m_SubPicProviderId != (DWORD_PTR)(ISubPicProvider*)m_pSubPicProvider)
@@ -120,13 +130,17 @@ public:
         if(!m_pSubPicQueue->LookupSubPic(rt, pSubPic))
             return(false);
 
-        CRect r;
-        pSubPic->GetDirtyRect(r);
+        CAtlList<CRect> rects;
+        pSubPic->GetDirtyRects(rects);
 
         if(dst.type == MSP_RGB32 || dst.type == MSP_RGB24 || dst.type == MSP_RGB16 || dst.type == MSP_RGB15)
             dst.h = -dst.h;
 
-        pSubPic->AlphaBlt(r, r, &dst);
+        for(POSITION pos = rects.GetHeadPosition(); pos; )
+        {
+            CRect r = rects.GetNext(pos);
+            pSubPic->AlphaBlt(r, r, &dst);
+        }
 
         return(true);
     }
@@ -231,10 +245,16 @@ public:
 class CTextSubFilter : virtual public CFilter
 {
     int m_CharSet;
+    CRenderedTextSubtitle* m_pRTS; // held by m_pSubPicProvider
+    size_t m_overlayCacheBudget;
+    bool m_fParallelRasterize;
 
 public:
     CTextSubFilter(CString fn = _T(""), int CharSet = DEFAULT_CHARSET, float fps = -1)
         : m_CharSet(CharSet)
+        , m_pRTS(NULL)
+        , m_overlayCacheBudget(OVERLAY_CACHE_DEFAULT_BUDGET)
+        , m_fParallelRasterize(true)
     {
         m_fps = fps;
         if(!fn.IsEmpty()) Open(fn, CharSet);
@@ -245,10 +265,25 @@ public:
         return(m_CharSet);
     }
 
+    // memory for the rasterized words of the script, and whether they are rasterized in parallel
+    void SetRenderingOptions(size_t overlayCacheBudget, bool fParallelRasterize)
+    {
+        m_overlayCacheBudget = overlayCacheBudget;
+        m_fParallelRasterize = fParallelRasterize;
+
+        if(m_pRTS)
+        {
+            CAutoLock cAutoLock(&m_csSubLock);
+            m_pRTS->SetOverlayCacheBudget(m_overlayCacheBudget);
+            m_pRTS->SetParallelRasterization(m_fParallelRasterize);
+        }
+    }
+
     bool Open(CString fn, int CharSet = DEFAULT_CHARSET)
     {
         SetFileName(_T(""));
         m_pSubPicProvider = NULL;
+        m_pRTS = NULL;
 
         if(!m_pSubPicProvider)
         {
@@ -270,6 +305,13 @@ public:
 
                 m_script_selected_yuv = rts->m_eYCbCrMatrix;
                 m_script_selected_range = rts->m_eYCbCrRange;
+
+                if(m_pSubPicProvider)
+                {
+                    m_pRTS = rts;
+                    m_pRTS->SetOverlayCacheBudget(m_overlayCacheBudget);
+                    m_pRTS->SetParallelRasterization(m_fParallelRasterize);
+                }
             }
         }
 
@@ -763,7 +805,10 @@ AVSValue __cdecl VobSubCreateS(AVSValue args, void* user_data, IScriptEnvironmen
     bool utf8 = false;
     if (args[2].Defined())
         utf8 = args[2].AsBool(false);
-    return(new CVobSubAvisynthFilter(args[0].AsClip(), args[1].AsString(), env, utf8));
+    CVobSubAvisynthFilter* filter = new CVobSubAvisynthFilter(args[0].AsClip(), args[1].AsString(), env, utf8);
+    if (args[3].Defined())
+        filter->SetSubPicCacheBudget((size_t)max(args[3].AsInt(), 0) << 20);
+    return(filter);
 }
 
 class CTextSubAvisynthFilter : public CTextSubFilter, public CAvisynthFilter
@@ -798,14 +843,21 @@ AVSValue __cdecl TextSubCreateGeneral(AVSValue args, void* user_data, IScriptEnv
     if (args[5].Defined())
         utf8 = args[5].AsBool(false);
 
-    return(new CTextSubAvisynthFilter(
-               args[0].AsClip(),
-               env,
-               args[1].AsString(),
-               args[2].AsInt(DEFAULT_CHARSET),
-               args[3].AsFloat(-1),
-               vfr,
-               utf8));
+    CTextSubAvisynthFilter* filter = new CTextSubAvisynthFilter(
+        args[0].AsClip(),
+        env,
+        args[1].AsString(),
+        args[2].AsInt(DEFAULT_CHARSET),
+        args[3].AsFloat(-1),
+        vfr,
+        utf8);
+    if (args[6].Defined())
+        filter->SetSubPicCacheBudget((size_t)max(args[6].AsInt(), 0) << 20);
+    if (args[7].Defined() || args[8].Defined())
+        filter->SetRenderingOptions(
+            args[7].Defined() ? (size_t)max(args[7].AsInt(), 0) << 20 : OVERLAY_CACHE_DEFAULT_BUDGET,
+            args[8].AsBool(true));
+    return(filter);
 }
 
 AVSValue __cdecl TextSubSwapUV(AVSValue args, void* user_data, IScriptEnvironment* env)
@@ -870,9 +922,9 @@ AVSValue __cdecl MaskSubCreate(AVSValue args, void* user_data, IScriptEnvironmen
 
 extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit2(IScriptEnvironment* env)
 {
-    env->AddFunction("VobSub", "cs[utf8]b", VobSubCreateS, 0);
+    env->AddFunction("VobSub", "cs[utf8]b[cache]i", VobSubCreateS, 0);
 #ifdef _VSMOD
-    env->AddFunction("TextSubMod", "c[file]s[charset]i[fps]f[vfr]s[utf8]b", TextSubCreateGeneral, 0);
+    env->AddFunction("TextSubMod", "c[file]s[charset]i[fps]f[vfr]s[utf8]b[cache]i[overlay_cache]i[parallel]b", TextSubCreateGeneral, 0);
     env->AddFunction("TextSubModSwapUV", "b", TextSubSwapUV, 0);
     env->AddFunction("MaskSubMod", "[file]s[width]i[height]i[fps]f[length]i[charset]i[vfr]s[utf8]b", MaskSubCreate, 0);
 #else
@@ -889,8 +941,6 @@ extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit2(IScri
 // VapourSynth interface
 //
 
-#include <emmintrin.h>
-
 namespace VapourSynth {
 #include <VapourSynth4.h>
 #include <VSHelper4.h>
@@ -916,7 +966,6 @@ namespace VapourSynth {
         VFRTranslator * vfr;
         CTextSubVapourSynthFilter * textsub;
         CVobSubVapourSynthFilter * vobsub;
-        bool accurate16bit;
     };
 
 	class VSFFrameBuf
@@ -924,7 +973,6 @@ namespace VapourSynth {
 	protected:
 		VSFFrameBuf()
             : subpic{}
-            , subpic2{}
         {
         }
 
@@ -932,116 +980,22 @@ namespace VapourSynth {
 		virtual ~VSFFrameBuf() {}
         virtual void WriteTo(VSFrame* frame) = 0;
 		SubPicDesc subpic;
-        SubPicDesc subpic2;
 
 	private:
 		VSFFrameBuf(const VSFFrameBuf*) = delete;
 		VSFFrameBuf* operator = (const VSFFrameBuf*) = delete;
 	};
 
-	template<int BITDEPTH>
 	class VSFYUVBuf : public VSFFrameBuf
 	{
 		uint8_t* Buffer;
 
 		uint8_t* BufDatas[3];
-		uint8_t* BufDatas2[3]; 
 		int BufStrides[3];
 
 		const VSAPI* api;
 		const VSFilterData* d;
 
-		template<int BC>
-		static inline void SplitBits(int sampleCount, const uint16_t* src, uint8_t* dst1, uint8_t* dst2)
-		{
-			auto srcEnd = src + sampleCount;
-			auto sse2End = src + sampleCount - 8;
-			if (uintptr_t(src) & 0xf)
-				sse2End = src;
-
-			__m128i lomask = _mm_set1_epi16(0xffi16);
-			while (src <= sse2End)
-			{
-				__m128i buf = _mm_load_si128((const __m128i*)src);
-				__m128i hi, lo;
-
-				if (BC == 16)
-				{
-					hi = _mm_srli_epi16(buf, 8);
-					hi = _mm_packus_epi16(hi, hi);
-					lo = _mm_and_si128(buf, lomask);
-					lo = _mm_packus_epi16(lo, lo);
-				}
-				else if (BC == 10)
-				{
-					hi = _mm_srli_epi16(buf, 2);
-					hi = _mm_packus_epi16(hi, hi);
-					lo = _mm_slli_epi16(buf, 6);
-					lo = _mm_and_si128(lo, lomask);
-					lo = _mm_packus_epi16(lo, lo);
-				}
-				_mm_storel_epi64((__m128i*)dst1, hi);
-				_mm_storel_epi64((__m128i*)dst2, lo);
-				dst1 += 8;
-				dst2 += 8;
-				src += 8;
-			}
-
-			while (src < srcEnd)
-			{
-				if (BITDEPTH == 10)
-				{
-					*dst1 = ((*src) >> 2) & 0xff;
-					*dst2 = ((*src) << 6) & 0xff;
-				}
-				else if (BITDEPTH == 16)
-				{
-					*dst1 = ((*src) >> 8) & 0xff;
-					*dst2 = (*src) & 0xff;
-				}
-
-				dst1 += 1;
-				dst2 += 1;
-				src += 1;
-			}
-		}
-
-		template<int BC>
-		static inline void MergeBits(int sampleCount, uint16_t* dst, const uint8_t* src1, const uint8_t* src2)
-		{
-			auto srcEnd = dst + sampleCount;
-			auto sse2End = dst + sampleCount - 8;
-			if (uintptr_t(dst) & 0xf)
-				sse2End = dst;
-
-			while (dst < sse2End)
-			{
-				__m128i hbuf = _mm_loadl_epi64((const __m128i*) src1);
-				__m128i lbuf = _mm_loadl_epi64((const __m128i*) src2);
-				hbuf = _mm_unpacklo_epi8(hbuf, _mm_setzero_si128());
-				hbuf = _mm_slli_epi16(hbuf, 8);
-				lbuf = _mm_unpacklo_epi8(lbuf, _mm_setzero_si128());
-				hbuf = _mm_adds_epi16(hbuf, lbuf);
-				if (BC == 10)
-					hbuf = _mm_srli_epi16(hbuf, 6);
-
-				_mm_store_si128((__m128i*)dst, hbuf);
-				src1 += 8;
-				src2 += 8;
-				dst += 8;
-			}
-
-			while (dst < srcEnd)
-			{
-				*dst = (*src1 << 8) | *src2;
-				if (BC == 10)
-					*dst >>= 6;
-				src1 += 1;
-				src2 += 1;
-				dst += 1;
-			}
-		}
-
 	public:
 		~VSFYUVBuf()
 		{
@@ -1060,48 +1014,14 @@ namespace VapourSynth {
 			}
 			Buffer = (uint8_t*)malloc(totalSize);
 
-			if (BITDEPTH <= 8)
-			{
-				BufDatas[0] = Buffer;
-				BufDatas[1] = BufDatas[0] + BufStrides[0] * d->vi->height;
-				BufDatas[2] = BufDatas[1] + BufStrides[1] * d->vi->height / 2;
+			BufDatas[0] = Buffer;
+			BufDatas[1] = BufDatas[0] + BufStrides[0] * d->vi->height;
+			BufDatas[2] = BufDatas[1] + BufStrides[1] * d->vi->height / 2;
 
-				for (int i = 0; i < 3; ++i)
-				{
-					const uint8_t* p = api->getReadPtr(frame, i);
-					memcpy(BufDatas[i], p, api->getStride(frame, i) * d->vi->height / (i == 0 ? 1 : 2));
-				}
-			}
-			else
+			for (int i = 0; i < 3; ++i)
 			{
-				for (int i = 0; i < 3; ++i)
-					BufStrides[i] /= 2;
-
-				BufDatas[0] = Buffer;
-				BufDatas[1] = BufDatas[0] + BufStrides[0] * d->vi->height;
-				BufDatas[2] = BufDatas[1] + BufStrides[1] * d->vi->height / 2;
-				BufDatas2[0] = BufDatas[2] + BufStrides[2] * d->vi->height / 2;
-				BufDatas2[1] = BufDatas2[0] + BufStrides[0] * d->vi->height;
-				BufDatas2[2] = BufDatas2[1] + BufStrides[1] * d->vi->height / 2;
-
-				for (int i = 0; i < 3; ++i)
-				{
-					const uint8_t* p = api->getReadPtr(frame, i);
-					int srcStride = api->getStride(frame, i);
-
-					int wEnd = d->vi->width / (i == 0 ? 1 : 2);
-					int hEnd = d->vi->height / (i == 0 ? 1 : 2);
-					uint8_t* pDst = BufDatas[i];
-					uint8_t* pDst2 = BufDatas2[i];
-
-					for (int h = 0; h < hEnd; ++h)
-					{
-						const uint16_t* pSample = reinterpret_cast<const uint16_t*>(p + h * srcStride);
-						uint8_t* pDstSample = BufDatas[i] + h * BufStrides[i];
-						uint8_t* pDstSample2 = BufDatas2[i] + h * BufStrides[i];
-						SplitBits<BITDEPTH>(wEnd, pSample, pDstSample, pDstSample2);
-					}
-				}
+				const uint8_t* p = api->getReadPtr(frame, i);
+				memcpy(BufDatas[i], p, api->getStride(frame, i) * d->vi->height / (i == 0 ? 1 : 2));
 			}
 
 			subpic.w = d->vi->width;
@@ -1113,65 +1033,50 @@ namespace VapourSynth {
 			subpic.bitsV = BufDatas[2];
 			subpic.bpp = 8;
 			subpic.type = MSP_YV12;
-
-            if (BITDEPTH > 8)
-            {
-                subpic2.w = d->vi->width;
-                subpic2.h = d->vi->height;
-                subpic2.pitch = BufStrides[0];
-                subpic2.pitchUV = BufStrides[1];
-                subpic2.bits = BufDatas2[0];
-                subpic2.bitsU = BufDatas2[1];
-                subpic2.bitsV = BufDatas2[2];
-                subpic2.bpp = 8;
-                subpic2.type = MSP_YV12;
-            }
 		}
 
         void WriteTo(VSFrame* frame) override
 		{
-			if (BITDEPTH <= 8)
-			{
-				for (int i = 0; i < 3; ++i)
-				{
-					int dstStride = api->getStride(frame, i);
-					uint8_t* pDst = api->getWritePtr(frame, i);
-					int srcStride = BufStrides[i];
-					const uint8_t* pSrc = BufDatas[i];
-					int wEnd = d->vi->width / (i == 0 ? 1 : 2);
-					int hEnd = d->vi->height / (i == 0 ? 1 : 2);
-					for (int h = 0; h < hEnd; ++h)
-					{
-						uint8_t* pDstRow = pDst + h * dstStride;
-						const uint8_t* pSrcRow = pSrc + h * srcStride;
-						memcpy(pDstRow, pSrcRow, wEnd);
-					}
-				}
-			}
-			else
+			for (int i = 0; i < 3; ++i)
 			{
-				for (int i = 0; i < 3; ++i)
+				int dstStride = api->getStride(frame, i);
+				uint8_t* pDst = api->getWritePtr(frame, i);
+				int srcStride = BufStrides[i];
+				const uint8_t* pSrc = BufDatas[i];
+				int wEnd = d->vi->width / (i == 0 ? 1 : 2);
+				int hEnd = d->vi->height / (i == 0 ? 1 : 2);
+				for (int h = 0; h < hEnd; ++h)
 				{
-					int dstStride = api->getStride(frame, i);
-					uint8_t* pDst = api->getWritePtr(frame, i);
-					int srcStride = BufStrides[i];
-					const uint8_t* pSrc = BufDatas[i];
-					const uint8_t* pSrc2 = BufDatas2[i];
-					int wEnd = d->vi->width / (i == 0 ? 1 : 2);
-					int hEnd = d->vi->height / (i == 0 ? 1 : 2);
-					for (int h = 0; h < hEnd; ++h)
-					{
-						uint16_t* pDstSample = reinterpret_cast<uint16_t*>(pDst + h * dstStride);
-						const uint8_t* pSrcSample = pSrc + h * srcStride;
-						const uint8_t* pSrcSample2 = pSrc2 + h * srcStride;
-
-						MergeBits<BITDEPTH>(wEnd, pDstSample, pSrcSample, pSrcSample2);
-					}
+					uint8_t* pDstRow = pDst + h * dstStride;
+					const uint8_t* pSrcRow = pSrc + h * srcStride;
+					memcpy(pDstRow, pSrcRow, wEnd);
 				}
 			}
 		}
 	};
 
+	// 10 and 16 bit samples are blended in place, the subpic points straight at the output frame
+	class VSFYUV16Buf : public VSFFrameBuf
+	{
+	public:
+        VSFYUV16Buf(const VSAPI* api, const VSFilterData* d, VSFrame* frame, int type)
+		{
+			subpic.w = d->vi->width;
+			subpic.h = d->vi->height;
+			subpic.pitch = api->getStride(frame, 0);
+			subpic.pitchUV = api->getStride(frame, 1);
+			subpic.bits = api->getWritePtr(frame, 0);
+			subpic.bitsU = api->getWritePtr(frame, 1);
+			subpic.bitsV = api->getWritePtr(frame, 2);
+			subpic.bpp = 16;
+			subpic.type = type;
+		}
+
+        void WriteTo(VSFrame* frame) override
+		{
+		}
+	};
+
 	class VSFRGBBuf : public VSFFrameBuf
 	{
         uint8_t* tmp;
@@ -1265,11 +1170,11 @@ namespace VapourSynth {
             else if (d->vi->format.colorFamily == cfYUV)
 			{
                 if (vsh::isSameVideoPresetFormat(pfYUV420P8, &d->vi->format, core, vsapi))
-					frameBuf.reset(new VSFYUVBuf<8>(vsapi, core, d, src));
+					frameBuf.reset(new VSFYUVBuf(vsapi, core, d, src));
                 else if (vsh::isSameVideoPresetFormat(pfYUV420P10, &d->vi->format, core, vsapi))
-					frameBuf.reset(new VSFYUVBuf<10>(vsapi, core, d, src));
+					frameBuf.reset(new VSFYUV16Buf(vsapi, d, dst, MSP_YUV420P10));
                 else if (vsh::isSameVideoPresetFormat(pfYUV420P16, &d->vi->format, core, vsapi))
-					frameBuf.reset(new VSFYUVBuf<16>(vsapi, core, d, src));
+					frameBuf.reset(new VSFYUV16Buf(vsapi, d, dst, MSP_YUV420P16));
 			}
 
 			if (frameBuf)
@@ -1281,17 +1186,9 @@ namespace VapourSynth {
 					timestamp = static_cast<REFERENCE_TIME>(10000000 * d->vfr->TimeStampFromFrameNumber(n));
 
                 if (d->textsub)
-                {
                     d->textsub->Render(frameBuf->subpic, timestamp, d->fps);
-                    if (d->accurate16bit && frameBuf->subpic2.bits)
-                        d->textsub->Render(frameBuf->subpic2, timestamp, d->fps);
-                }
                 else
-                {
                     d->vobsub->Render(frameBuf->subpic, timestamp, d->fps);
-                    if (d->accurate16bit && frameBuf->subpic2.bits)
-                        d->vobsub->Render(frameBuf->subpic2, timestamp, d->fps);
-                }
 
 				frameBuf->WriteTo(dst);
 			}
@@ -1372,9 +1269,29 @@ namespace VapourSynth {
             return;
         }
 
-        d.accurate16bit = vsapi->mapGetInt(in, "accurate", 0, &err) != 0;
-        if (err)
-            d.accurate16bit = false;
+        // "accurate" is deprecated, 10/16 bit clips are always blended at full precision
+        vsapi->mapGetInt(in, "accurate", 0, &err);
+        if (!err)
+            vsapi->logMessage(mtWarning, (filterName + ": accurate is deprecated and ignored, 10/16 bit clips are always blended at full precision").c_str(), core);
+
+        if (d.textsub) {
+            int overlayCache = vsh::int64ToIntS(vsapi->mapGetInt(in, "overlay_cache", 0, &err));
+            size_t overlayCacheBudget = err ? OVERLAY_CACHE_DEFAULT_BUDGET : static_cast<size_t>(max(overlayCache, 0)) << 20;
+
+            bool parallel = !!vsapi->mapGetInt(in, "parallel", 0, &err);
+            if (err)
+                parallel = true;
+
+            d.textsub->SetRenderingOptions(overlayCacheBudget, parallel);
+        }
+
+        int cache = vsh::int64ToIntS(vsapi->mapGetInt(in, "cache", 0, &err));
+        if (!err) {
+            if (d.textsub)
+                d.textsub->SetSubPicCacheBudget(static_cast<size_t>(max(cache, 0)) << 20);
+            else
+                d.vobsub->SetSubPicCacheBudget(static_cast<size_t>(max(cache, 0)) << 20);
+        }
 
         VSFilterDependency deps[] = {{d.node, rpGeneral}};
         vsapi->createVideoFilter(out, static_cast<const char *>(userData), d.vi, vsfilterGetFrame, vsfilterFree, fmParallelRequests, deps, 1, ud.release(), core);
@@ -1391,13 +1308,17 @@ namespace VapourSynth {
                              "charset:int:opt;"
                              "fps:float:opt;"
                              "vfr:data:opt;"
-                             "accurate:int:opt;",
+                             "accurate:int:opt;"
+                             "cache:int:opt;"
+                             "overlay_cache:int:opt;"
+                             "parallel:int:opt;",
                              "clip:vnode;",
                              vsfilterCreate, const_cast<char *>("TextSubMod"), plugin);
         vspapi->registerFunction("VobSub",
                              "clip:vnode;"
                              "file:data;"
-                             "accurate:int:opt;",
+                             "accurate:int:opt;"
+                             "cache:int:opt;",
                              "clip:vnode;",
                              vsfilterCreate, const_cast<char *>("VobSub"), plugin);
     }